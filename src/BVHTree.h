@@ -5,15 +5,19 @@
 
 #include "BoundingBox.h"
 #include "Ray.h"
+#include "RayPacket.h"
 #include "rayHit.h"
 #include "Surface.h"
+#include "ThreadPool.h"
 
 #include "libs/Matrix.h"
 
 #include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <string.h>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -29,6 +33,15 @@ struct alignas(32) BVHNode
     };
 };
 
+// Node of a tree stored without pointers, for saving a built tree. Inner nodes
+// have the index of their first child in child, leaves -1 minus the index of
+// their surface in the list the tree was built from.
+struct BVHFlatNode
+{
+    float boundingBox[6];
+    int32_t child;
+};
+
 // I don't think this actually works..
 // static_assert(offsetof(BVHNode, surf) == offsetof(BVHNode, isInnerNode), "Byte alignment in BVHNode is off, might need to adjust for endianness!");
 
@@ -39,42 +52,126 @@ private:
     unsigned int allocatedSize;
     BVHNode *nodes;
 
+    // subtree whose build was put off so it can run on another thread
+    struct buildTask
+    {
+        std::vector<Surface*> surfaces;
+        int nodeIndex;
+        int firstFreeNode;
+    };
+
 public:
-    BVHTree(std::vector<Surface*>&);
+    // The surfaces are still owned by the caller and have to outlive the tree
+    BVHTree(std::vector<Surface*>&, ThreadPool &pool);
+    // Takes the nodes of a tree flattened from the same surfaces instead of building one
+    BVHTree(const std::vector<Surface*>&, const BVHFlatNode *flatNodes);
     ~BVHTree();
 
+    std::vector<BVHFlatNode> flatten(const std::vector<Surface*> &surfaces) const;
+
     bool hit(Ray ray, float startTime, float endTime, rayHit *record);
-    void hit(rayBundle rays, float startTime, float endTime, hitBundle *records);
+    void hit(rayBundle rays, float startTime, float endTime, hitBundle *records, int laneMask = 0xF);
+    void hit(rayBundle rays, float startTime, const float endTimes[4], hitBundle *records, int laneMask = 0xF);
+    void hit(rayPacket &packet, float startTime, float endTime);
+
+    bool occluded(Ray ray, float startTime, float endTime);
+    int occluded(rayBundle rays, float startTime, const float endTimes[4], int laneMask = 0xF);
+    void occluded(rayPacket &packet, float startTime);
+
+    BoundingBox getBounds();
 
 private:
-    void build(std::vector<Surface*> &surfaces, int nodeIndex);
+    void build(std::vector<Surface*> &surfaces, int nodeIndex, int firstFreeNode, std::vector<buildTask> *deferred, size_t deferSize);
     bool hitNodeList(Ray ray, float startTime, rayHit *record, int nodeOfInterest);
-    void hitNodeList(rayBundle rays, float startTime, hitBundle *records, int nodeOfInterest);
+    void hitNodeList(rayBundle &rays, const simdRayBundle &simdRays, float startTime, hitBundle *records, int nodeOfInterest, int laneMask);
+    void hitNodeList(rayPacket &packet, float startTime, int nodeOfInterest, int firstActiveQuad);
+    bool occludedNodeList(Ray &ray, float startTime, rayHit *record, int nodeOfInterest);
+    int occludedNodeList(rayBundle &rays, const simdRayBundle &simdRays, float startTime, const float endTimes[4], int nodeOfInterest, int laneMask);
+    void occludedNodeList(rayPacket &packet, float startTime, int nodeOfInterest, int firstActiveQuad, int &activeQuads);
 };
 
-BVHTree::BVHTree(std::vector<Surface*> &surfaces)
+BVHTree::BVHTree(std::vector<Surface*> &surfaces, ThreadPool &pool)
 {
+    // every leaf holds one surface, so the tree always has 2n-1 nodes
+    this->allocatedSize = surfaces.size() * 2 - 1;
     //try{
-    this->nodes = new BVHNode[surfaces.size() * 4];
-    this->allocatedSize = surfaces.size() * 4;
+    this->nodes = new BVHNode[this->allocatedSize];
     // }
     // catch (std::bad_alloc e){
     //     std::cerr << e.what() << std::endl;
     //     exit(1);
     // }
-    this->nextFreeNode = 1;
+    this->nextFreeNode = this->allocatedSize;
+
+    if (pool.getThreadCount() == 1)
+    {
+        this->build(surfaces, 0, 1, nullptr, 0);
+        return;
+    }
+
+    // The top of the tree is split up on this thread, the subtrees below it are
+    // built in parallel. Several subtrees per thread even out their varying sizes.
+    std::vector<buildTask> deferred;
+    this->build(surfaces, 0, 1, &deferred, surfaces.size() / (pool.getThreadCount() * 8));
 
-    this->build(surfaces, 0);
+    std::sort(deferred.begin(), deferred.end(), [](const buildTask &a, const buildTask &b) {
+        return a.surfaces.size() > b.surfaces.size();
+    });
+
+    pool.parallelFor(0, deferred.size(), 1, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            this->build(deferred[i].surfaces, deferred[i].nodeIndex, deferred[i].firstFreeNode, nullptr, 0);
+        }
+    });
 }
 
-BVHTree::~BVHTree()
+BVHTree::BVHTree(const std::vector<Surface*> &surfaces, const BVHFlatNode *flatNodes)
+{
+    this->allocatedSize = surfaces.size() * 2 - 1;
+    this->nodes = new BVHNode[this->allocatedSize];
+    this->nextFreeNode = this->allocatedSize;
+
+    for (unsigned int i = 0; i < this->allocatedSize; i++)
+    {
+        memcpy(this->nodes[i].boundingBox, flatNodes[i].boundingBox, sizeof(float) * 6);
+
+        if (flatNodes[i].child >= 0)
+        {
+            this->nodes[i].isInnerNode = 1;
+            this->nodes[i].childrenOffset = flatNodes[i].child;
+        }
+        else
+            this->nodes[i].surf = surfaces[-1 - flatNodes[i].child];
+    }
+}
+
+std::vector<BVHFlatNode> BVHTree::flatten(const std::vector<Surface*> &surfaces) const
 {
-    for (int i = 0; i < this->nextFreeNode; i++)
+    std::unordered_map<Surface*, int> surfaceIndices;
+
+    for (size_t i = 0; i < surfaces.size(); i++)
     {
-        if (!(this->nodes[i].isInnerNode == 1))
-            delete this->nodes[i].surf;
+        surfaceIndices[surfaces[i]] = i;
+    }
+
+    std::vector<BVHFlatNode> flatNodes(this->nextFreeNode);
+
+    for (unsigned int i = 0; i < this->nextFreeNode; i++)
+    {
+        memcpy(flatNodes[i].boundingBox, this->nodes[i].boundingBox, sizeof(float) * 6);
+
+        if (this->nodes[i].isInnerNode == 1)
+            flatNodes[i].child = this->nodes[i].childrenOffset;
+        else
+            flatNodes[i].child = -1 - surfaceIndices[this->nodes[i].surf];
     }
 
+    return flatNodes;
+}
+
+BVHTree::~BVHTree()
+{
     delete[] this->nodes;
 }
 
@@ -84,14 +181,85 @@ bool BVHTree::hit(Ray ray, float startTime, float endTime, rayHit *record)
     return this->hitNodeList(ray, startTime, record, 0);
 }
 
-void BVHTree::hit(rayBundle rays, float startTime, float endTime, hitBundle *records)
+// Only the rays whose bit is set in laneMask are traced, the records of the others are left at endTime
+void BVHTree::hit(rayBundle rays, float startTime, float endTime, hitBundle *records, int laneMask)
+{
+    float endTimes[4] = {endTime, endTime, endTime, endTime};
+    this->hit(rays, startTime, endTimes, records, laneMask);
+}
+
+void BVHTree::hit(rayBundle rays, float startTime, const float endTimes[4], hitBundle *records, int laneMask)
+{
+    for (int i = 0; i < 4; i++) records->records[i].intersectionTime = endTimes[i];
+
+    simdRayBundle simdRays(rays);
+    this->hitNodeList(rays, simdRays, startTime, records, 0, laneMask);
+}
+
+void BVHTree::hit(rayPacket &packet, float startTime, float endTime)
+{
+    for (int q = 0; q < packet.quadCount; q++)
+    {
+        for (int i = 0; i < 4; i++) packet.records[q][i].intersectionTime = endTime;
+    }
+
+    packet.prepare();
+    this->hitNodeList(packet, startTime, 0, 0);
+}
+
+// Any-hit queries only answer whether something lies between startTime and
+// the end time, so traversal stops at the first primitive found
+
+bool BVHTree::occluded(Ray ray, float startTime, float endTime)
+{
+    rayHit record;
+    record.intersectionTime = endTime;
+    return this->occludedNodeList(ray, startTime, &record, 0);
+}
+
+// Returns the lanes of laneMask that are occluded
+int BVHTree::occluded(rayBundle rays, float startTime, const float endTimes[4], int laneMask)
+{
+    simdRayBundle simdRays(rays);
+    return this->occludedNodeList(rays, simdRays, startTime, endTimes, 0, laneMask);
+}
+
+// The end time of each ray is read from its record, occluded rays are cleared from packet.laneMasks
+void BVHTree::occluded(rayPacket &packet, float startTime)
 {
-    for (int i = 0; i < 4; i++) records->records[i].intersectionTime = endTime;
-    this->hitNodeList(rays, startTime, records, 0);
+    int activeQuads = 0;
+
+    for (int q = 0; q < packet.quadCount; q++)
+    {
+        if (packet.laneMasks[q])
+            activeQuads++;
+    }
+
+    if (!activeQuads)
+        return;
+
+    packet.prepare();
+    this->occludedNodeList(packet, startTime, 0, 0, activeQuads);
 }
 
-void BVHTree::build(std::vector<Surface*> &surfaces, int nodeIndex)
+BoundingBox BVHTree::getBounds()
 {
+    return BoundingBox(this->nodes[0].boundingBox);
+}
+
+// The children of a node go to firstFreeNode and the node after it, followed by
+// the nodes of the left subtree, then those of the right. As a subtree over n
+// surfaces takes 2n-1 nodes, the range of each subtree is known before it is
+// built and subtrees can be built independently. Subtrees of at most deferSize
+// surfaces are added to deferred instead of being built, if it's given.
+void BVHTree::build(std::vector<Surface*> &surfaces, int nodeIndex, int firstFreeNode, std::vector<buildTask> *deferred, size_t deferSize)
+{
+    if (deferred && surfaces.size() <= deferSize)
+    {
+        deferred->push_back(buildTask{surfaces, nodeIndex, firstFreeNode});
+        return;
+    }
+
     BVHNode &thisNode = this->nodes[nodeIndex];
     memcpy(thisNode.boundingBox, surfaces[0]->getBoundingBox().minMax, sizeof(float) * 6);
 
@@ -157,19 +325,13 @@ void BVHTree::build(std::vector<Surface*> &surfaces, int nodeIndex)
         left.pop_back();
     }
 
-    int claimedNodesIndex = this->nextFreeNode;
-    this->nextFreeNode += 2;
+    int claimedNodesIndex = firstFreeNode;
 
     thisNode.isInnerNode = 1;
     thisNode.childrenOffset = claimedNodesIndex;
 
-    if (this->nextFreeNode > this->allocatedSize)
-    {
-        throw new std::length_error("Too many things to fit in BVHTree!");
-    }
-
-    this->build(left, claimedNodesIndex);
-    this->build(right, claimedNodesIndex + 1);
+    this->build(left, claimedNodesIndex, claimedNodesIndex + 2, deferred, deferSize);
+    this->build(right, claimedNodesIndex + 1, claimedNodesIndex + 2 * left.size(), deferred, deferSize);
 }
 
 bool BVHTree::hitNodeList(Ray ray, float startTime, rayHit *record, int nodeOfInterest)
@@ -218,49 +380,226 @@ bool BVHTree::hitNodeList(Ray ray, float startTime, rayHit *record, int nodeOfIn
     return hitSurface;
 }
 
-void BVHTree::hitNodeList(rayBundle rays, float startTime, hitBundle *records, int nodeOfInterest)
+void BVHTree::hitNodeList(rayBundle &rays, const simdRayBundle &simdRays, float startTime, hitBundle *records, int nodeOfInterest, int laneMask)
 {
     BVHNode &thisNode = this->nodes[nodeOfInterest];
 
-    bool hitSurface = false;
+    // only the lanes that were still active at the parent can hit its children
+    laneMask &= BoundingBox::hit(thisNode.boundingBox, simdRays, _mm_set1_ps(startTime), records->intersectionTimes());
 
-    bool mask[4];
-    for (int i = 0; i < 4; i++) mask[i] = false;
+    if (!laneMask)
+        return;
 
-    hitBundle newInfo = *records;
+#ifdef RENDER_LEAF_BBOX
+    if (!(thisNode.isInnerNode == 1))
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (laneMask & (1 << i))
+                BoundingBox::hit(thisNode.boundingBox, rays[i], startTime, records->records + i);
+        }
+        return;
+    }
+#endif
 
-    for (int i = 0; i < 4; i++)
+    if (thisNode.isInnerNode == 1)
     {
-        if (!BoundingBox::hit(thisNode.boundingBox, rays[i], startTime, newInfo.records + i))
-            continue;
+        this->hitNodeList(rays, simdRays, startTime, records, thisNode.childrenOffset, laneMask);
+        this->hitNodeList(rays, simdRays, startTime, records, thisNode.childrenOffset + 1, laneMask);
+    }
+    else
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (laneMask & (1 << i))
+                thisNode.surf->hit(rays[i], startTime, records->records + i);
+        }
+    }
+}
+
+void BVHTree::hitNodeList(rayPacket &packet, float startTime, int nodeOfInterest, int firstActiveQuad)
+{
+    BVHNode &thisNode = this->nodes[nodeOfInterest];
+
+    if (packet.coherent && !BoundingBox::hit(thisNode.boundingBox, packet, startTime))
+        return;
+
+    // the packet might still miss entirely, find the first quad with a ray that actually hits.
+    // quads before firstActiveQuad already missed an ancestor of this node
+    __m128 simdStartTime = _mm_set1_ps(startTime);
+    int laneMask = 0;
+
+    for (; firstActiveQuad < packet.quadCount; firstActiveQuad++)
+    {
+        laneMask = packet.laneMasks[firstActiveQuad] & BoundingBox::hit(thisNode.boundingBox, packet.simdRays[firstActiveQuad], 
+            simdStartTime, packet.records[firstActiveQuad].intersectionTimes());
+
+        if (laneMask)
+            break;
+    }
+
+    if (!laneMask)
+        return;
+
+    if (thisNode.isInnerNode == 1)
+    {
+        this->hitNodeList(packet, startTime, thisNode.childrenOffset, firstActiveQuad);
+        this->hitNodeList(packet, startTime, thisNode.childrenOffset + 1, firstActiveQuad);
+        return;
+    }
+
+    for (int q = firstActiveQuad; q < packet.quadCount; q++)
+    {
+        if (q != firstActiveQuad)
+        {
+            laneMask = packet.laneMasks[q] & BoundingBox::hit(thisNode.boundingBox, packet.simdRays[q], simdStartTime, 
+                packet.records[q].intersectionTimes());
+        }
 
-        hitSurface = true;
-        mask[i] = true;
+        for (int i = 0; i < 4; i++)
+        {
+            if (!(laneMask & (1 << i)))
+                continue;
+
+#ifdef RENDER_LEAF_BBOX
+            BoundingBox::hit(thisNode.boundingBox, packet.rays[q][i], startTime, packet.records[q].records + i);
+#else
+            thisNode.surf->hit(packet.rays[q][i], startTime, packet.records[q].records + i);
+#endif
+        }
     }
+}
+
+bool BVHTree::occludedNodeList(Ray &ray, float startTime, rayHit *record, int nodeOfInterest)
+{
+    BVHNode &thisNode = this->nodes[nodeOfInterest];
+
+    rayHit newInfo = *record;
+
+    if (!BoundingBox::hit(thisNode.boundingBox, ray, startTime, &newInfo))
+        return false;
 
 #ifdef RENDER_LEAF_BBOX
     if (!(thisNode.isInnerNode == 1))
+        return true;
+#endif
+
+    if (thisNode.isInnerNode == 1)
     {
-        *records = newInfo;
-        return;
+        return this->occludedNodeList(ray, startTime, record, thisNode.childrenOffset) ||
+            this->occludedNodeList(ray, startTime, record, thisNode.childrenOffset + 1);
+    }
+
+    return thisNode.surf->hit(ray, startTime, record);
+}
+
+int BVHTree::occludedNodeList(rayBundle &rays, const simdRayBundle &simdRays, float startTime, const float endTimes[4], int nodeOfInterest, int laneMask)
+{
+    BVHNode &thisNode = this->nodes[nodeOfInterest];
+
+    laneMask &= BoundingBox::hit(thisNode.boundingBox, simdRays, _mm_set1_ps(startTime), _mm_loadu_ps(endTimes));
+
+    if (!laneMask)
+        return 0;
+
+    int occludedMask = 0;
+
+    if (thisNode.isInnerNode == 1)
+    {
+        occludedMask = this->occludedNodeList(rays, simdRays, startTime, endTimes, thisNode.childrenOffset, laneMask);
+
+        // lanes that are already occluded don't need to look any further
+        laneMask &= ~occludedMask;
+
+        if (laneMask)
+            occludedMask |= this->occludedNodeList(rays, simdRays, startTime, endTimes, thisNode.childrenOffset + 1, laneMask);
+
+        return occludedMask;
     }
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(laneMask & (1 << i)))
+            continue;
+
+#ifdef RENDER_LEAF_BBOX
+        occludedMask |= 1 << i;
+#else
+        rayHit record;
+        record.intersectionTime = endTimes[i];
+
+        if (thisNode.surf->hit(rays[i], startTime, &record))
+            occludedMask |= 1 << i;
 #endif
+    }
 
-    if (!hitSurface)
+    return occludedMask;
+}
+
+void BVHTree::occludedNodeList(rayPacket &packet, float startTime, int nodeOfInterest, int firstActiveQuad, int &activeQuads)
+{
+    BVHNode &thisNode = this->nodes[nodeOfInterest];
+
+    if (packet.coherent && !BoundingBox::hit(thisNode.boundingBox, packet, startTime))
+        return;
+
+    __m128 simdStartTime = _mm_set1_ps(startTime);
+    int laneMask = 0;
+
+    for (; firstActiveQuad < packet.quadCount; firstActiveQuad++)
+    {
+        if (!packet.laneMasks[firstActiveQuad])
+            continue;
+
+        laneMask = packet.laneMasks[firstActiveQuad] & BoundingBox::hit(thisNode.boundingBox, packet.simdRays[firstActiveQuad], 
+            simdStartTime, packet.records[firstActiveQuad].intersectionTimes());
+
+        if (laneMask)
+            break;
+    }
+
+    if (!laneMask)
         return;
 
     if (thisNode.isInnerNode == 1)
     {
-        this->hitNodeList(rays, startTime, records, thisNode.childrenOffset);
-        this->hitNodeList(rays, startTime, records, thisNode.childrenOffset + 1);
+        this->occludedNodeList(packet, startTime, thisNode.childrenOffset, firstActiveQuad, activeQuads);
+
+        if (activeQuads)
+            this->occludedNodeList(packet, startTime, thisNode.childrenOffset + 1, firstActiveQuad, activeQuads);
+
+        return;
     }
-    else
+
+    for (int q = firstActiveQuad; q < packet.quadCount; q++)
     {
+        if (q != firstActiveQuad)
+        {
+            if (!packet.laneMasks[q])
+                continue;
+
+            laneMask = packet.laneMasks[q] & BoundingBox::hit(thisNode.boundingBox, packet.simdRays[q], simdStartTime, 
+                packet.records[q].intersectionTimes());
+        }
+
         for (int i = 0; i < 4; i++)
         {
-            if (mask[i])
-                thisNode.surf->hit(rays[i], startTime, records->records + i);
+            if (!(laneMask & (1 << i)))
+                continue;
+
+#ifndef RENDER_LEAF_BBOX
+            rayHit record;
+            record.intersectionTime = packet.records[q][i].intersectionTime;
+
+            if (!thisNode.surf->hit(packet.rays[q][i], startTime, &record))
+                continue;
+#endif
+
+            packet.laneMasks[q] &= ~(1 << i);
         }
+
+        if (laneMask && !packet.laneMasks[q])
+            activeQuads--;
     }
 }
 
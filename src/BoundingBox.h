@@ -2,8 +2,12 @@
 #define _BOUNDING_BOX_H
 
 #include "Ray.h"
+#include "RayPacket.h"
 #include "rayHit.h"
 
+#include <algorithm>
+#include <limits>
+
 class BoundingBox
 {
 public:
@@ -28,6 +32,8 @@ public:
 	}
 
 	static bool hit(float minMax[6], Ray ray, float startTime, rayHit *record);
+	static int hit(const float minMax[6], const simdRayBundle &rays, __m128 startTime, __m128 endTime);
+	static bool hit(const float minMax[6], const rayPacket &packet, float startTime);
 };
 
 bool BoundingBox::hit(float minMax[6], Ray ray, float startTime, rayHit *record)
@@ -72,7 +78,7 @@ bool BoundingBox::hit(float minMax[6], Ray ray, float startTime, rayHit *record)
 	}
 
 #ifdef RENDER_LEAF_BBOX
-    record->materialID = "";
+    record->materialID = NO_MATERIAL_ID;
     record->surfaceNormal = normal;
     record->intersectionTime = entrance;
     record->intersectionPoint = ray.positionAtTime(entrance);
@@ -81,4 +87,57 @@ bool BoundingBox::hit(float minMax[6], Ray ray, float startTime, rayHit *record)
     return true;
 }
 
+// Slab test for all four rays of a bundle at once, returns a bitmask with bit i set if ray i hits
+int BoundingBox::hit(const float minMax[6], const simdRayBundle &rays, __m128 startTime, __m128 endTime)
+{
+	__m128 entrance = startTime;
+	__m128 exit = endTime;
+
+	for (int i = 0; i < 3; i++)
+	{
+		__m128 slabA = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minMax[i]), rays.origin[i]), rays.invDirection[i]);
+		__m128 slabB = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minMax[i+3]), rays.origin[i]), rays.invDirection[i]);
+
+		// min/max return their second operand on NaN, so a ray parallel to a slab keeps its current interval
+		entrance = _mm_max_ps(_mm_min_ps(slabA, slabB), entrance);
+		exit = _mm_min_ps(_mm_max_ps(slabA, slabB), exit);
+	}
+
+	return _mm_movemask_ps(_mm_cmpge_ps(exit, entrance));
+}
+
+// Conservative interval arithmetic test for a whole coherent packet, returns
+// false only if no ray of the packet can hit the box
+bool BoundingBox::hit(const float minMax[6], const rayPacket &packet, float startTime)
+{
+	float entrance = startTime;
+	float exit = std::numeric_limits<float>::infinity();
+
+	for (int i = 0; i < 3; i++)
+	{
+		// with all directions on this axis sharing a sign we know which slab is entered first
+		bool positive = packet.minInvDirection[i] > 0;
+		float nearSlab = positive ? minMax[i] : minMax[i+3];
+		float farSlab = positive ? minMax[i+3] : minMax[i];
+
+		float nearA = (nearSlab - packet.maxOrigin[i]) * packet.minInvDirection[i];
+		float nearB = (nearSlab - packet.maxOrigin[i]) * packet.maxInvDirection[i];
+		float nearC = (nearSlab - packet.minOrigin[i]) * packet.minInvDirection[i];
+		float nearD = (nearSlab - packet.minOrigin[i]) * packet.maxInvDirection[i];
+
+		float farA = (farSlab - packet.maxOrigin[i]) * packet.minInvDirection[i];
+		float farB = (farSlab - packet.maxOrigin[i]) * packet.maxInvDirection[i];
+		float farC = (farSlab - packet.minOrigin[i]) * packet.minInvDirection[i];
+		float farD = (farSlab - packet.minOrigin[i]) * packet.maxInvDirection[i];
+
+		entrance = std::max(entrance, std::min({nearA, nearB, nearC, nearD}));
+		exit = std::min(exit, std::max({farA, farB, farC, farD}));
+
+		if (exit < entrance)
+			return false;
+	}
+
+	return true;
+}
+
 #endif
@@ -0,0 +1,299 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include "RenderConfig.h"
+#include "SceneFile.h"
+#include "libs/Buffer.h"
+#include "libs/Matrix.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+// Starts every checkpoint file, the last two characters being the format version
+#define CHECKPOINT_MAGIC "RTCKPT02"
+
+// Running sums over the samples of a pixel
+struct pixelSums
+{
+    Vec3 weightedSum;
+    float weightSum;
+    float luminanceSum;
+    float luminanceSquareSum;
+    int sampleCount;
+};
+
+// Where a render is in its passes
+struct passState
+{
+    // 0 is the preview of a progressive render, or the only pass of any other render
+    int pass;
+    // samples each pixel had before this pass, not counting the preview's
+    int taken;
+    // samples each pixel of this pass gets
+    int samples;
+    // whether the noise of the pixels has picked the pixels of a pass yet
+    bool noiseTested;
+};
+
+// The scene a render is of: the input file, told apart by its path, its size
+// and the time it last changed, and the camera it is seen through
+struct renderScene
+{
+    std::string path;
+    uint64_t fileSize;
+    int64_t modifiedTime;
+    sceneCamera camera;
+
+    // Fails if the file can't be looked at
+    static bool of(const std::string &path, const sceneCamera &camera, renderScene &scene);
+};
+
+// Saves and restores a render in the middle of a pass, so that a killed process
+// can carry on where it was. The file holds the settings and scene of the
+// render, the pass state, which tiles of the pass are done, the pixels taking
+// part in it and the sums of every pixel. The sums are stored as they are in
+// memory, so checkpoints are only meant to be read by the same build.
+class Checkpoint
+{
+private:
+    // Everything the sums depend on, a checkpoint can only resume the same render
+    struct renderSettings
+    {
+        int32_t width;
+        int32_t height;
+        float fov;
+        int32_t maxDepth;
+        int32_t samplesPerPixel;
+        int32_t samplePattern;
+        int32_t pixelFilter;
+        int32_t maxSamplesPerPixel;
+        float adaptiveThreshold;
+        int32_t progressive;
+        int32_t tileSize;
+        int32_t tileCount;
+    };
+
+    // The scene the sums are of, the path being hashed
+    struct sceneSettings
+    {
+        uint64_t pathHash;
+        uint64_t fileSize;
+        int64_t modifiedTime;
+        sceneCamera camera;
+    };
+
+    struct fileHeader
+    {
+        char magic[8];
+        renderSettings settings;
+        sceneSettings scene;
+        int32_t pass;
+        int32_t taken;
+        int32_t samples;
+        int32_t noiseTested;
+    };
+
+    static renderSettings makeSettings(const renderConfig &config, int tileCount);
+    static sceneSettings makeSceneSettings(const renderScene &scene);
+
+    // Buffers are stored row after row, whatever their layout in memory
+    template<class T> static bool writeRows(FILE *file, const Buffer<T> &buffer);
+    template<class T> static bool readRows(FILE *file, Buffer<T> &buffer);
+
+public:
+    // Writes the checkpoint of a pass. The sums of the tiles that aren't done
+    // have to be the ones from before the pass.
+    static bool write(const std::string &path, const renderConfig &config, const renderScene &scene, const passState &state,
+        const std::vector<char> &tilesDone, const Buffer<char> &passPixels, const Buffer<pixelSums> &accumulation);
+
+    // Reads a checkpoint into buffers already sized for the render. Fails with a
+    // reason in error if the file can't be read or is from another render or scene.
+    static bool read(const std::string &path, const renderConfig &config, const renderScene &scene, passState &state,
+        std::vector<char> &tilesDone, Buffer<char> &passPixels, Buffer<pixelSums> &accumulation, std::string &error);
+};
+
+bool renderScene::of(const std::string &path, const sceneCamera &camera, renderScene &scene)
+{
+    struct stat info;
+
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+
+    scene.path = path;
+    scene.fileSize = info.st_size;
+    scene.modifiedTime = info.st_mtime;
+    scene.camera = camera;
+
+    return true;
+}
+
+Checkpoint::renderSettings Checkpoint::makeSettings(const renderConfig &config, int tileCount)
+{
+    renderSettings settings;
+
+    // the padding of the struct goes to the file too
+    memset(&settings, 0, sizeof(settings));
+
+    settings.width = config.width;
+    settings.height = config.height;
+    settings.fov = config.fov;
+    settings.maxDepth = config.maxDepth;
+    settings.samplesPerPixel = config.samplesPerPixel;
+    settings.samplePattern = config.samplePattern;
+    settings.pixelFilter = config.pixelFilter;
+    settings.maxSamplesPerPixel = config.maxSamplesPerPixel;
+    settings.adaptiveThreshold = config.adaptiveThreshold;
+    settings.progressive = config.progressive;
+    settings.tileSize = config.tileSize;
+    settings.tileCount = tileCount;
+
+    return settings;
+}
+
+Checkpoint::sceneSettings Checkpoint::makeSceneSettings(const renderScene &scene)
+{
+    sceneSettings settings;
+    memset(&settings, 0, sizeof(settings));
+
+    // FNV-1a
+    settings.pathHash = 14695981039346656037ull;
+
+    for (unsigned char c : scene.path)
+    {
+        settings.pathHash = (settings.pathHash ^ c) * 1099511628211ull;
+    }
+
+    settings.fileSize = scene.fileSize;
+    settings.modifiedTime = scene.modifiedTime;
+    settings.camera = scene.camera;
+
+    return settings;
+}
+
+bool Checkpoint::write(const std::string &path, const renderConfig &config, const renderScene &scene, const passState &state,
+    const std::vector<char> &tilesDone, const Buffer<char> &passPixels, const Buffer<pixelSums> &accumulation)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file)
+        return false;
+
+    fileHeader header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.settings = makeSettings(config, tilesDone.size());
+    header.scene = makeSceneSettings(scene);
+    header.pass = state.pass;
+    header.taken = state.taken;
+    header.samples = state.samples;
+    header.noiseTested = state.noiseTested;
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(tilesDone.data(), 1, tilesDone.size(), file) == tilesDone.size() &&
+        writeRows(file, passPixels) && writeRows(file, accumulation);
+
+    return fclose(file) == 0 && written;
+}
+
+bool Checkpoint::read(const std::string &path, const renderConfig &config, const renderScene &scene, passState &state,
+    std::vector<char> &tilesDone, Buffer<char> &passPixels, Buffer<pixelSums> &accumulation, std::string &error)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file)
+    {
+        error = "can't open the file";
+        return false;
+    }
+
+    fileHeader header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error = "not a checkpoint file";
+        fclose(file);
+        return false;
+    }
+
+    renderSettings settings = makeSettings(config, tilesDone.size());
+
+    if (memcmp(&header.settings, &settings, sizeof(settings)) != 0)
+    {
+        error = "written for a render with other settings";
+        fclose(file);
+        return false;
+    }
+
+    sceneSettings expected = makeSceneSettings(scene);
+
+    if (memcmp(&header.scene, &expected, sizeof(expected)) != 0)
+    {
+        error = "written for a render of another scene, or of the scene before it changed";
+        fclose(file);
+        return false;
+    }
+
+    bool complete = fread(tilesDone.data(), 1, tilesDone.size(), file) == tilesDone.size() &&
+        readRows(file, passPixels) && readRows(file, accumulation);
+
+    fclose(file);
+
+    if (!complete)
+    {
+        error = "the file is cut short";
+        return false;
+    }
+
+    state.pass = header.pass;
+    state.taken = header.taken;
+    state.samples = header.samples;
+    state.noiseTested = header.noiseTested != 0;
+
+    return true;
+}
+
+template<class T>
+bool Checkpoint::writeRows(FILE *file, const Buffer<T> &buffer)
+{
+    std::vector<T> row(buffer.getWidth());
+    typename Buffer<T>::const_iterator element = buffer.begin();
+
+    for (size_t y = 0; y < buffer.getHeight(); y++)
+    {
+        for (size_t x = 0; x < row.size(); x++)
+        {
+            row[x] = *element++;
+        }
+
+        if (fwrite(row.data(), sizeof(T), row.size(), file) != row.size())
+            return false;
+    }
+
+    return true;
+}
+
+template<class T>
+bool Checkpoint::readRows(FILE *file, Buffer<T> &buffer)
+{
+    std::vector<T> row(buffer.getWidth());
+
+    for (size_t y = 0; y < buffer.getHeight(); y++)
+    {
+        if (fread(row.data(), sizeof(T), row.size(), file) != row.size())
+            return false;
+
+        for (size_t x = 0; x < row.size(); x++)
+        {
+            buffer.at(x, y) = row[x];
+        }
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,340 @@
+#ifndef _GEOMETRY_CACHE_H
+#define _GEOMETRY_CACHE_H
+
+#include "BVHTree.h"
+#include "SceneFile.h"
+#include "Surface.h"
+#include "Triangle.h"
+
+#include "libs/Matrix.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The triangles of a chunk read back from the scene file, with their tree
+struct geometryChunk
+{
+    std::vector<Triangle> triangles;
+    std::unique_ptr<BVHTree> tree;
+    size_t bytes;
+};
+
+struct geometryCacheStats
+{
+    long long loads;
+    long long hits;
+    long long evictions;
+    size_t peakBytes;
+};
+
+// Keeps the chunks of an out of core scene that rays reached last in memory, up
+// to a number of bytes, reading the others from the scene file when they are
+// needed. The least recently used chunks are dropped first, though never the
+// last one standing. Chunks handed out stay alive until they are let go of, even
+// once the cache dropped them.
+class GeometryCache
+{
+private:
+    FILE *file;
+    std::mutex fileMutex;
+
+    std::vector<sceneChunk> chunks;
+    // of the scene, the IDs of the chunks' triangles are checked against it
+    int materialCount;
+    size_t capacity;
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<const geometryChunk>> loaded;
+    // most recently used first
+    std::list<int> recentlyUsed;
+    std::vector<std::list<int>::iterator> recentPositions;
+    size_t usedBytes;
+    geometryCacheStats stats;
+
+    std::shared_ptr<const geometryChunk> read(int chunk);
+    void readSection(uint64_t offset, void *data, size_t size);
+
+public:
+    GeometryCache(const std::string &path, const sceneChunk *chunks, int chunkCount, int materialCount, size_t capacity);
+    ~GeometryCache();
+
+    GeometryCache(const GeometryCache&) = delete;
+    GeometryCache& operator=(const GeometryCache&) = delete;
+
+    std::shared_ptr<const geometryChunk> acquire(int chunk);
+
+    geometryCacheStats getStats();
+};
+
+// Collects the rays that reach the chunks of an out of core scene instead of
+// having them traced against the chunks right away. Once the rays of a stream
+// have been through the scene's tree, the queue of each chunk is traced in one
+// go, so a chunk is acquired once for all of its rays rather than once per ray.
+// A queue collects the traversals of the thread that started it.
+class ChunkRayQueue
+{
+private:
+    // the queue collecting on this thread, if any
+    static thread_local ChunkRayQueue *collecting;
+
+    // chunk and ray of each ray that reached a chunk
+    std::vector<std::pair<int, int>> entries;
+    int ray;
+
+public:
+    ChunkRayQueue();
+
+    // Queues the rays reaching chunks in the traversals on this thread, until stop
+    void start();
+    void stop();
+    void clear();
+
+    // The ray the following traversals are of
+    void setRay(int ray);
+
+    // Queues the current ray for the chunk, false if no queue is collecting on this thread
+    static bool queue(int chunk);
+
+    // Sorts the rays by chunk, so the rays of each chunk are next to each other
+    const std::vector<std::pair<int, int>>& byChunk();
+};
+
+// Stands in for a chunk in the scene's tree, so the chunk is only read once a
+// ray gets into its bounds
+class ChunkSurface : public Surface
+{
+private:
+    GeometryCache *cache;
+    int chunk;
+    BoundingBox bounds;
+
+public:
+    ChunkSurface(GeometryCache *cache, int chunk, const sceneChunk &entry);
+
+    // Queues the ray instead of testing it if a ChunkRayQueue is collecting
+    virtual bool hit(Ray ray, float startTime, rayHit *record);
+
+    virtual Vec3 getCentroid();
+    virtual BoundingBox getBoundingBox();
+};
+
+GeometryCache::GeometryCache(const std::string &path, const sceneChunk *chunks, int chunkCount, int materialCount, size_t capacity)
+    : chunks(chunks, chunks + chunkCount), materialCount(materialCount), capacity(capacity),
+    loaded(chunkCount), recentPositions(chunkCount), usedBytes(0), stats{0, 0, 0, 0}
+{
+    this->file = fopen(path.c_str(), "rb");
+
+    if (!this->file)
+    {
+        printf("Could not open %s to read its geometry\n", path.c_str());
+        exit(5);
+    }
+}
+
+GeometryCache::~GeometryCache()
+{
+    fclose(this->file);
+}
+
+std::shared_ptr<const geometryChunk> GeometryCache::acquire(int chunk)
+{
+    {
+        std::lock_guard<std::mutex> lk(this->mutex);
+
+        if (this->loaded[chunk])
+        {
+            this->stats.hits++;
+            this->recentlyUsed.splice(this->recentlyUsed.begin(), this->recentlyUsed, this->recentPositions[chunk]);
+            return this->loaded[chunk];
+        }
+    }
+
+    // other threads carry on tracing while the chunk is read
+    std::shared_ptr<const geometryChunk> data = this->read(chunk);
+
+    std::lock_guard<std::mutex> lk(this->mutex);
+
+    // another thread might have read it meanwhile
+    if (this->loaded[chunk])
+    {
+        this->recentlyUsed.splice(this->recentlyUsed.begin(), this->recentlyUsed, this->recentPositions[chunk]);
+        return this->loaded[chunk];
+    }
+
+    this->stats.loads++;
+    this->loaded[chunk] = data;
+    this->recentlyUsed.push_front(chunk);
+    this->recentPositions[chunk] = this->recentlyUsed.begin();
+    this->usedBytes += data->bytes;
+
+    while (this->usedBytes > this->capacity && this->recentlyUsed.size() > 1)
+    {
+        int oldest = this->recentlyUsed.back();
+        this->recentlyUsed.pop_back();
+
+        this->usedBytes -= this->loaded[oldest]->bytes;
+        this->loaded[oldest].reset();
+        this->stats.evictions++;
+    }
+
+    this->stats.peakBytes = std::max(this->stats.peakBytes, this->usedBytes);
+
+    return data;
+}
+
+geometryCacheStats GeometryCache::getStats()
+{
+    std::lock_guard<std::mutex> lk(this->mutex);
+    return this->stats;
+}
+
+std::shared_ptr<const geometryChunk> GeometryCache::read(int chunk)
+{
+    const sceneChunk &entry = this->chunks[chunk];
+
+    std::vector<float> corners(9 * entry.triangleCount);
+    std::vector<int32_t> materials(entry.triangleCount);
+    std::vector<BVHFlatNode> flatTree(entry.treeNodeCount);
+
+    {
+        std::lock_guard<std::mutex> lk(this->fileMutex);
+
+        this->readSection(entry.trianglesOffset, corners.data(), corners.size() * sizeof(float));
+        this->readSection(entry.materialsOffset, materials.data(), materials.size() * sizeof(int32_t));
+        this->readSection(entry.treeOffset, flatTree.data(), flatTree.size() * sizeof(BVHFlatNode));
+    }
+
+    if (!SceneFile::validTree(flatTree.data(), entry.treeNodeCount, entry.triangleCount))
+    {
+        printf("The tree of geometry chunk %d is broken\n", chunk);
+        exit(5);
+    }
+
+    for (int i = 0; i < entry.triangleCount; i++)
+    {
+        if (!SceneFile::validMaterial(materials[i], this->materialCount))
+        {
+            printf("A material ID of geometry chunk %d is out of range\n", chunk);
+            exit(5);
+        }
+    }
+
+    std::shared_ptr<geometryChunk> data = std::make_shared<geometryChunk>();
+    data->triangles.reserve(entry.triangleCount);
+
+    for (int i = 0; i < entry.triangleCount; i++)
+    {
+        const float *corner = corners.data() + 9 * i;
+        data->triangles.push_back(Triangle(Vec3(corner), Vec3(corner + 3), Vec3(corner + 6), materials[i]));
+    }
+
+    std::vector<Surface*> surfaces;
+    surfaces.reserve(data->triangles.size());
+
+    for (auto &triangle : data->triangles)
+    {
+        surfaces.push_back(&triangle);
+    }
+
+    data->tree.reset(new BVHTree(surfaces, flatTree.data()));
+    data->bytes = data->triangles.size() * sizeof(Triangle) + flatTree.size() * sizeof(BVHNode);
+
+    return data;
+}
+
+// The scene file was checked when it was opened, so failing here means it
+// changed or the disk failed under us, which the render can't get past
+void GeometryCache::readSection(uint64_t offset, void *data, size_t size)
+{
+#ifdef _WIN32
+    bool seeked = _fseeki64(this->file, offset, SEEK_SET) == 0;
+#else
+    bool seeked = fseeko(this->file, offset, SEEK_SET) == 0;
+#endif
+
+    if (!seeked || fread(data, 1, size, this->file) != size)
+    {
+        printf("Could not read geometry from the scene file\n");
+        exit(5);
+    }
+}
+
+thread_local ChunkRayQueue *ChunkRayQueue::collecting = nullptr;
+
+ChunkRayQueue::ChunkRayQueue()
+    : ray(0)
+{
+}
+
+void ChunkRayQueue::start()
+{
+    collecting = this;
+}
+
+void ChunkRayQueue::stop()
+{
+    collecting = nullptr;
+}
+
+void ChunkRayQueue::clear()
+{
+    this->entries.clear();
+}
+
+void ChunkRayQueue::setRay(int ray)
+{
+    this->ray = ray;
+}
+
+bool ChunkRayQueue::queue(int chunk)
+{
+    if (!collecting)
+        return false;
+
+    collecting->entries.push_back(std::make_pair(chunk, collecting->ray));
+    return true;
+}
+
+const std::vector<std::pair<int, int>>& ChunkRayQueue::byChunk()
+{
+    std::sort(this->entries.begin(), this->entries.end());
+    return this->entries;
+}
+
+ChunkSurface::ChunkSurface(GeometryCache *cache, int chunk, const sceneChunk &entry)
+    : Surface(NO_MATERIAL_ID), cache(cache), chunk(chunk),
+    bounds(Vec3(entry.bounds), Vec3(entry.bounds + 3))
+{
+}
+
+// The chunk is only held while the ray is tested against it, so every chunk
+// in memory is one the cache counts
+bool ChunkSurface::hit(Ray ray, float startTime, rayHit *record)
+{
+    if (ChunkRayQueue::queue(this->chunk))
+        return false;
+
+    std::shared_ptr<const geometryChunk> data = this->cache->acquire(this->chunk);
+
+    return data->tree->hit(ray, startTime, record->intersectionTime, record);
+}
+
+Vec3 ChunkSurface::getCentroid()
+{
+    return (Vec3(this->bounds.minMax) + Vec3(this->bounds.minMax + 3)) / 2;
+}
+
+BoundingBox ChunkSurface::getBoundingBox()
+{
+    return this->bounds;
+}
+
+#endif
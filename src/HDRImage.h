@@ -0,0 +1,287 @@
+#ifndef _HDR_IMAGE_H
+#define _HDR_IMAGE_H
+
+#include "libs/Buffer.h"
+#include "libs/Matrix.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// What a render is saved as, picked by the extension of the output path
+enum ImageFormat
+{
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_PFM,
+    IMAGE_FORMAT_EXR
+};
+
+// Writes the linear colours of a render as floats, without scaling them by the
+// brightest one or cutting them down to 8 bits, so they can still be exposed
+// and composited afterwards. PFM is the portable float map, EXR a scanline
+// OpenEXR file with float channels, stored as they are or run length encoded.
+// Rows of the colour buffer go from the top of the image down.
+class HDRImage
+{
+private:
+    // OpenEXR's run length encoding of a scanline, after its bytes are split
+    // into even and odd ones and turned into differences
+    static size_t rleCompress(const std::vector<uint8_t> &data, std::vector<uint8_t> &scratch, std::vector<uint8_t> &out);
+
+    static void put(std::vector<uint8_t> &out, const void *data, size_t size);
+    static void putInt(std::vector<uint8_t> &out, uint32_t value);
+    static void putFloat(std::vector<uint8_t> &out, float value);
+    static void putAttribute(std::vector<uint8_t> &out, const char *name, const char *type, const std::vector<uint8_t> &value);
+
+public:
+    // PNG unless the path ends in .pfm or .exr, whatever the case
+    static ImageFormat formatOf(const std::string &path);
+
+    static bool isFloatFormat(ImageFormat format);
+
+    // Writes the colours in a float format, false if the file can't be written
+    static bool write(const std::string &path, ImageFormat format, const Buffer<Vec3> &colors, bool compress);
+
+    static bool writePFM(const std::string &path, const Buffer<Vec3> &colors);
+    static bool writeEXR(const std::string &path, const Buffer<Vec3> &colors, bool compress);
+};
+
+ImageFormat HDRImage::formatOf(const std::string &path)
+{
+    std::string extension = path.substr(std::min(path.size(), path.rfind('.')));
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+
+    if (extension == ".pfm")
+        return IMAGE_FORMAT_PFM;
+    if (extension == ".exr")
+        return IMAGE_FORMAT_EXR;
+
+    return IMAGE_FORMAT_PNG;
+}
+
+bool HDRImage::isFloatFormat(ImageFormat format)
+{
+    return format == IMAGE_FORMAT_PFM || format == IMAGE_FORMAT_EXR;
+}
+
+bool HDRImage::write(const std::string &path, ImageFormat format, const Buffer<Vec3> &colors, bool compress)
+{
+    if (format == IMAGE_FORMAT_PFM)
+        return writePFM(path, colors);
+
+    return writeEXR(path, colors, compress);
+}
+
+// PFM rows go from the bottom up, in the byte order the sign of the scale says,
+// so the rows of the buffer are written straight from memory
+bool HDRImage::writePFM(const std::string &path, const Buffer<Vec3> &colors)
+{
+    static_assert(sizeof(Vec3) == 3 * sizeof(float), "PFM rows are written straight from the colour buffer");
+
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file)
+        return false;
+
+    const uint16_t byteOrder = 1;
+    bool littleEndian = *reinterpret_cast<const uint8_t*>(&byteOrder) == 1;
+    bool written = fprintf(file, "PF\n%d %d\n%s\n", static_cast<int>(colors.getWidth()), static_cast<int>(colors.getHeight()),
+        littleEndian ? "-1.0" : "1.0") > 0;
+
+    for (size_t y = colors.getHeight(); written && y-- > 0;)
+    {
+        written = fwrite(colors.getData() + y * colors.getWidth(), sizeof(Vec3), colors.getWidth(), file) == colors.getWidth();
+    }
+
+    return fclose(file) == 0 && written;
+}
+
+// Every scanline is a chunk of its own, its channels one after another in
+// alphabetical order. The offsets of the chunks come first, so their slots are
+// filled in once the chunks are written.
+bool HDRImage::writeEXR(const std::string &path, const Buffer<Vec3> &colors, bool compress)
+{
+    const int width = colors.getWidth();
+    const int height = colors.getHeight();
+
+    std::vector<uint8_t> header;
+    const uint8_t magic[] = {0x76, 0x2f, 0x31, 0x01};
+    put(header, magic, sizeof(magic));
+    // version 2, single part scanline file
+    putInt(header, 2);
+
+    std::vector<uint8_t> value;
+
+    for (const char *channel : {"B", "G", "R"})
+    {
+        put(value, channel, 2);
+        // float pixels, not perceptually linear, no sub sampling
+        putInt(value, 2);
+        putInt(value, 0);
+        putInt(value, 1);
+        putInt(value, 1);
+    }
+
+    value.push_back(0);
+    putAttribute(header, "channels", "chlist", value);
+
+    value.assign(1, compress ? 1 : 0);
+    putAttribute(header, "compression", "compression", value);
+
+    value.clear();
+    putInt(value, 0);
+    putInt(value, 0);
+    putInt(value, width - 1);
+    putInt(value, height - 1);
+    putAttribute(header, "dataWindow", "box2i", value);
+    putAttribute(header, "displayWindow", "box2i", value);
+
+    // increasing y
+    value.assign(1, 0);
+    putAttribute(header, "lineOrder", "lineOrder", value);
+
+    value.clear();
+    putFloat(value, 1);
+    putAttribute(header, "pixelAspectRatio", "float", value);
+    putAttribute(header, "screenWindowWidth", "float", value);
+
+    value.clear();
+    putFloat(value, 0);
+    putFloat(value, 0);
+    putAttribute(header, "screenWindowCenter", "v2f", value);
+
+    header.push_back(0);
+
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file)
+        return false;
+
+    std::vector<uint8_t> offsets(8 * height);
+    bool written = fwrite(header.data(), 1, header.size(), file) == header.size() &&
+        fwrite(offsets.data(), 1, offsets.size(), file) == offsets.size();
+
+    uint64_t offset = header.size() + offsets.size();
+    std::vector<uint8_t> scanline, scratch, compressed, chunk;
+
+    for (int y = 0; written && y < height; y++)
+    {
+        scanline.clear();
+
+        for (int channel = 2; channel >= 0; channel--)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                putFloat(scanline, colors.at(x, y)[channel]);
+            }
+        }
+
+        //readers take a chunk that didn't get smaller for one that was stored as it is
+        const std::vector<uint8_t> &data = compress && rleCompress(scanline, scratch, compressed) < scanline.size() ? compressed : scanline;
+
+        chunk.clear();
+        putInt(chunk, y);
+        putInt(chunk, data.size());
+        put(chunk, data.data(), data.size());
+
+        for (int i = 0; i < 8; i++)
+        {
+            offsets[8 * y + i] = static_cast<uint8_t>(offset >> (8 * i));
+        }
+
+        written = fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+        offset += chunk.size();
+    }
+
+    written = written && fseek(file, header.size(), SEEK_SET) == 0 &&
+        fwrite(offsets.data(), 1, offsets.size(), file) == offsets.size();
+
+    return fclose(file) == 0 && written;
+}
+
+size_t HDRImage::rleCompress(const std::vector<uint8_t> &data, std::vector<uint8_t> &scratch, std::vector<uint8_t> &out)
+{
+    const size_t size = data.size();
+    const size_t half = (size + 1) / 2;
+    // runs are at most this long, both repeated and literal ones
+    const int maxRun = 127;
+
+    scratch.resize(size);
+    out.clear();
+
+    for (size_t i = 0; i < size; i++)
+    {
+        scratch[i % 2 == 0 ? i / 2 : half + i / 2] = data[i];
+    }
+
+    for (size_t i = size; i-- > 1;)
+    {
+        scratch[i] = static_cast<uint8_t>(scratch[i] - scratch[i - 1] + 128);
+    }
+
+    size_t runStart = 0;
+
+    while (runStart < size)
+    {
+        size_t runEnd = runStart + 1;
+
+        while (runEnd < size && scratch[runEnd] == scratch[runStart] && runEnd - runStart <= maxRun)
+            runEnd++;
+
+        if (runEnd - runStart >= 3)
+        {
+            out.push_back(static_cast<uint8_t>(runEnd - runStart - 1));
+            out.push_back(scratch[runStart]);
+        }
+        else
+        {
+            //literal bytes up to the next run of three
+            while (runEnd < size && runEnd - runStart < maxRun &&
+                (runEnd + 2 >= size || scratch[runEnd] != scratch[runEnd + 1] || scratch[runEnd + 1] != scratch[runEnd + 2]))
+                runEnd++;
+
+            out.push_back(static_cast<uint8_t>(-static_cast<int>(runEnd - runStart)));
+            out.insert(out.end(), scratch.begin() + runStart, scratch.begin() + runEnd);
+        }
+
+        runStart = runEnd;
+    }
+
+    return out.size();
+}
+
+void HDRImage::put(std::vector<uint8_t> &out, const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+// EXR files are little endian whatever the machine
+void HDRImage::putInt(std::vector<uint8_t> &out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+void HDRImage::putFloat(std::vector<uint8_t> &out, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putInt(out, bits);
+}
+
+void HDRImage::putAttribute(std::vector<uint8_t> &out, const char *name, const char *type, const std::vector<uint8_t> &value)
+{
+    put(out, name, strlen(name) + 1);
+    put(out, type, strlen(type) + 1);
+    putInt(out, value.size());
+    put(out, value.data(), value.size());
+}
+
+#endif
@@ -3,23 +3,21 @@
 
 #include "libs/Matrix.h"
 
-#include <string>
-
 class Light
 {
 private:
     Vec3 position;
-    std::string materialID;
+    int materialID;
 
 public:
-    Light(Vec3 position, std::string material);
+    Light(Vec3 position, int materialID);
 
     Vec3 getPosition();
-    std::string getMaterialName();
+    int getMaterialID();
 };
 
-Light::Light(Vec3 position, std::string material)
-    : position(position), materialID(material)
+Light::Light(Vec3 position, int materialID)
+    : position(position), materialID(materialID)
 {}
 
 Vec3 Light::getPosition()
@@ -27,7 +25,7 @@ Vec3 Light::getPosition()
     return this->position;
 }
 
-std::string Light::getMaterialName()
+int Light::getMaterialID()
 {
     return this->materialID;
 }
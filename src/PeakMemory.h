@@ -0,0 +1,92 @@
+#ifndef _PEAK_MEMORY_H
+#define _PEAK_MEMORY_H
+
+#include <cstdio>
+#include <cstring>
+
+#if !defined(_WIN32) && !defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+// Peak resident memory of the process, to tell which phase of a render needs
+// the most. Only Linux can start the peak over for every phase, elsewhere each
+// phase reports the peak since the process started.
+class PeakMemory
+{
+public:
+    // In bytes, 0 if the system doesn't tell
+    static size_t read();
+
+    // Starts measuring the next phase, false if the peak can't be started over
+    static bool reset();
+
+    // Prints the peak of the phase that just ended and starts the next one
+    static void report(const char *phase);
+};
+
+size_t PeakMemory::read()
+{
+#if defined(__linux__)
+    FILE *status = fopen("/proc/self/status", "r");
+
+    if (!status)
+        return 0;
+
+    char line[256];
+    size_t kilobytes = 0;
+
+    while (fgets(line, sizeof(line), status))
+    {
+        if (strncmp(line, "VmHWM:", 6) == 0)
+        {
+            sscanf(line + 6, "%zu", &kilobytes);
+            break;
+        }
+    }
+
+    fclose(status);
+    return kilobytes * 1024;
+#elif !defined(_WIN32)
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    // bytes on macOS, kilobytes on the BSDs
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+bool PeakMemory::reset()
+{
+#if defined(__linux__)
+    // writing 5 sets the peak back to the current resident size
+    FILE *clearRefs = fopen("/proc/self/clear_refs", "w");
+
+    if (!clearRefs)
+        return false;
+
+    bool written = fputs("5", clearRefs) >= 0;
+    return fclose(clearRefs) == 0 && written;
+#else
+    return false;
+#endif
+}
+
+void PeakMemory::report(const char *phase)
+{
+    size_t peak = read();
+
+    if (peak == 0)
+        return;
+
+    printf("Peak memory while %s: %.2f MB%s\n", phase, peak / (1024.0 * 1024.0), reset() ? "" : " since the start");
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef _PIXEL_SAMPLER_H
+#define _PIXEL_SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+// R2 sequence, 1/g and 1/g^2 for the plastic number g
+#define R2_ALPHA_X 0.7548776662f
+#define R2_ALPHA_Y 0.5698402910f
+
+// Gaussian filter radius in pixels and falloff
+#define GAUSSIAN_FILTER_RADIUS 1.5f
+#define GAUSSIAN_FILTER_ALPHA 2.0f
+
+enum SamplePattern
+{
+    // R2 low discrepancy points
+    SAMPLE_PATTERN_R2,
+    // one jittered sample per cell of a grid, even for square sample counts.
+    // Samples past the sample count start over on the grid.
+    SAMPLE_PATTERN_STRATIFIED
+};
+
+enum PixelFilter
+{
+    PIXEL_FILTER_BOX,
+    PIXEL_FILTER_GAUSSIAN
+};
+
+// Places the samples of a pixel and weights them by the reconstruction filter.
+// Samples are spread over the whole filter footprint, which is wider than the
+// pixel for the Gaussian, so every pixel is resolved from its own samples and
+// tiles never write to each other's pixels. The sequence is shifted by a hash
+// of the pixel so that neighbouring pixels don't share a pattern.
+class PixelSampler
+{
+private:
+    int samplesPerPixel;
+    SamplePattern pattern;
+    PixelFilter filter;
+
+    float strataX;
+    float strataY;
+    float footprint;
+    float gaussianEdge;
+
+    static uint32_t hashPixel(uint32_t x, uint32_t y);
+    static __m128 fraction(__m128 values);
+
+    float filterWeight(float offset) const;
+
+public:
+    PixelSampler(int samplesPerPixel, SamplePattern pattern, PixelFilter filter);
+
+    int getSampleCount() const;
+
+    // Samples [first, first + 4) of pixel (x, y), as offsets in pixels from the
+    // pixel's lower left corner, and their filter weights. With one sample per
+    // pixel, the first sample is put in the middle of the pixel.
+    void getSamples(int x, int y, int first, float offsetX[4], float offsetY[4], float weight[4]) const;
+
+    // Samples [first, first + count) of a pixel, the arrays must hold count
+    // rounded up to a multiple of four values
+    void getPixelSamples(int x, int y, int first, int count, float *offsetX, float *offsetY, float *weight) const;
+};
+
+PixelSampler::PixelSampler(int samplesPerPixel, SamplePattern pattern, PixelFilter filter)
+    : samplesPerPixel(samplesPerPixel), pattern(pattern), filter(filter)
+{
+    this->strataX = std::ceil(std::sqrt(static_cast<float>(samplesPerPixel)));
+    this->strataY = std::ceil(samplesPerPixel / this->strataX);
+
+    this->footprint = filter == PIXEL_FILTER_GAUSSIAN ? 2 * GAUSSIAN_FILTER_RADIUS : 1;
+    this->gaussianEdge = std::exp(-GAUSSIAN_FILTER_ALPHA * GAUSSIAN_FILTER_RADIUS * GAUSSIAN_FILTER_RADIUS);
+}
+
+int PixelSampler::getSampleCount() const
+{
+    return this->samplesPerPixel;
+}
+
+void PixelSampler::getSamples(int x, int y, int first, float offsetX[4], float offsetY[4], float weight[4]) const
+{
+    if (this->samplesPerPixel == 1 && first == 0)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            offsetX[i] = offsetY[i] = 0.5f;
+            weight[i] = 1;
+        }
+        return;
+    }
+
+    uint32_t hash = hashPixel(x, y);
+    __m128 index = _mm_add_ps(_mm_set1_ps(first), _mm_setr_ps(0, 1, 2, 3));
+
+    __m128 u = fraction(_mm_add_ps(_mm_set1_ps((hash & 0xFFFF) / 65536.0f), _mm_mul_ps(index, _mm_set1_ps(R2_ALPHA_X))));
+    __m128 v = fraction(_mm_add_ps(_mm_set1_ps((hash >> 16) / 65536.0f), _mm_mul_ps(index, _mm_set1_ps(R2_ALPHA_Y))));
+
+    if (this->pattern == SAMPLE_PATTERN_STRATIFIED)
+    {
+        // the cell comes from the sample index, the R2 point only jitters inside it
+        __m128 sampleCount = _mm_set1_ps(this->samplesPerPixel);
+        __m128 round = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_div_ps(index, sampleCount)));
+        __m128 cell = _mm_sub_ps(index, _mm_mul_ps(round, sampleCount));
+
+        __m128 columns = _mm_set1_ps(this->strataX);
+        __m128 row = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_div_ps(cell, columns)));
+        __m128 column = _mm_sub_ps(cell, _mm_mul_ps(row, columns));
+
+        u = _mm_div_ps(_mm_add_ps(column, u), columns);
+        v = _mm_div_ps(_mm_add_ps(row, v), _mm_set1_ps(this->strataY));
+    }
+
+    // from the unit square to the filter footprint, centred on the pixel
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 footprint = _mm_set1_ps(this->footprint);
+    _mm_storeu_ps(offsetX, _mm_add_ps(half, _mm_mul_ps(_mm_sub_ps(u, half), footprint)));
+    _mm_storeu_ps(offsetY, _mm_add_ps(half, _mm_mul_ps(_mm_sub_ps(v, half), footprint)));
+
+    for (int i = 0; i < 4; i++)
+    {
+        weight[i] = this->filterWeight(offsetX[i] - 0.5f) * this->filterWeight(offsetY[i] - 0.5f);
+    }
+}
+
+void PixelSampler::getPixelSamples(int x, int y, int first, int count, float *offsetX, float *offsetY, float *weight) const
+{
+    for (int i = 0; i < count; i += 4)
+    {
+        this->getSamples(x, y, first + i, offsetX + i, offsetY + i, weight + i);
+    }
+}
+
+float PixelSampler::filterWeight(float offset) const
+{
+    if (this->filter == PIXEL_FILTER_BOX)
+        return 1;
+
+    // shifted down so the weight reaches zero at the edge of the footprint
+    return std::max(0.0f, std::exp(-GAUSSIAN_FILTER_ALPHA * offset * offset) - this->gaussianEdge);
+}
+
+uint32_t PixelSampler::hashPixel(uint32_t x, uint32_t y)
+{
+    uint32_t hash = x * 0x8da6b343u ^ y * 0xd8163841u;
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68bu;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// fractional part of non-negative values
+__m128 PixelSampler::fraction(__m128 values)
+{
+    return _mm_sub_ps(values, _mm_cvtepi32_ps(_mm_cvttps_epi32(values)));
+}
+
+#endif
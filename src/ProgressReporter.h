@@ -0,0 +1,165 @@
+#ifndef _PROGRESS_REPORTER_H
+#define _PROGRESS_REPORTER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define PROGRESS_BAR_SIZE 40
+// how often the reporter thread looks at the counters
+#define PROGRESS_INTERVAL_MS 100
+
+enum ProgressFormat
+{
+    // a bar redrawn in place, for terminals
+    PROGRESS_BAR,
+    // one "progress <percent> <done> <total> <seconds>" line per change, for scripts
+    PROGRESS_MACHINE,
+    PROGRESS_NONE
+};
+
+// Render threads only bump their own counter. A separate thread sums the
+// counters a few times a second and does all of the printing, so workers never
+// wait on a lock or on the terminal.
+class ProgressReporter
+{
+private:
+    // Only the owning thread writes its counter, and each one has a cache line
+    // to itself so the writes don't bounce lines between cores
+    struct threadCounter
+    {
+        std::atomic<long> done;
+        char padding[64];
+    };
+
+    std::vector<threadCounter> counters;
+    long total;
+    ProgressFormat format;
+
+    std::chrono::steady_clock::time_point startTime;
+    int lastPercent;
+    int lastBarFill;
+
+    std::thread reporter;
+    std::mutex mutex;
+    std::condition_variable stopRequested;
+    bool stopping;
+
+    long sumCounters() const;
+    void report(long done);
+    void reporterLoop();
+
+public:
+    ProgressReporter(int threadCount, long total, ProgressFormat format);
+    ~ProgressReporter();
+
+    // Starts the reporter thread
+    void start();
+
+    // Records finished work of a thread, only to be called by that thread
+    void add(int thread, long amount);
+
+    // Stops the reporter thread and reports the final state
+    void finish();
+};
+
+ProgressReporter::ProgressReporter(int threadCount, long total, ProgressFormat format)
+    : counters(threadCount), total(total), format(format), lastPercent(-1), lastBarFill(-1), stopping(false)
+{
+    for (auto &counter : this->counters)
+    {
+        counter.done.store(0, std::memory_order_relaxed);
+    }
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    if (this->reporter.joinable())
+        this->finish();
+}
+
+void ProgressReporter::start()
+{
+    this->startTime = std::chrono::steady_clock::now();
+    this->report(0);
+
+    this->reporter = std::thread(&ProgressReporter::reporterLoop, this);
+}
+
+void ProgressReporter::add(int thread, long amount)
+{
+    // a single writer doesn't need a read-modify-write
+    std::atomic<long> &done = this->counters[thread].done;
+    done.store(done.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void ProgressReporter::finish()
+{
+    {
+        std::lock_guard<std::mutex> lk(this->mutex);
+        this->stopping = true;
+    }
+    this->stopRequested.notify_one();
+
+    this->reporter.join();
+
+    this->report(this->sumCounters());
+
+    if (this->format == PROGRESS_BAR)
+        std::cout << std::endl;
+}
+
+long ProgressReporter::sumCounters() const
+{
+    long done = 0;
+
+    for (auto &counter : this->counters)
+    {
+        done += counter.done.load(std::memory_order_relaxed);
+    }
+
+    return done;
+}
+
+void ProgressReporter::report(long done)
+{
+    int percent = done * 100 / this->total;
+    int barFill = done * PROGRESS_BAR_SIZE / this->total;
+
+    if (percent == this->lastPercent && barFill == this->lastBarFill)
+        return;
+
+    this->lastPercent = percent;
+    this->lastBarFill = barFill;
+
+    if (this->format == PROGRESS_BAR)
+    {
+        std::cout << "\r[";
+        for (int i = 0; i < PROGRESS_BAR_SIZE; i++)
+        {
+            std::cout << (i < barFill ? "#" : " ");
+        }
+        std::cout << "]  " << percent << "%" << std::flush;
+    }
+    else if (this->format == PROGRESS_MACHINE)
+    {
+        std::cout << "progress " << percent << " " << done << " " << this->total << " "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() - this->startTime).count() << std::endl;
+    }
+}
+
+void ProgressReporter::reporterLoop()
+{
+    std::unique_lock<std::mutex> lk(this->mutex);
+
+    while (!this->stopRequested.wait_for(lk, std::chrono::milliseconds(PROGRESS_INTERVAL_MS), [this]{ return this->stopping; }))
+    {
+        this->report(this->sumCounters());
+    }
+}
+
+#endif
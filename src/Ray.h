@@ -2,9 +2,12 @@
 #define _RAY_H
 
 class RayGenerator;
+struct rayStream;
 
 #include "libs/Matrix.h"
 
+#include <xmmintrin.h>
+
 class Ray
 {
 private:
@@ -19,6 +22,7 @@ public:
     Vec3 positionAtTime(float t);
 
     friend class RayGenerator;
+    friend struct rayStream;
 };
 
 Ray::Ray(Vec3 origin, Vec3 direction)
@@ -47,4 +51,34 @@ struct rayBundle
     }
 };
 
+// The four rays of a bundle transposed to one SSE lane per ray, with the
+// reciprocal directions precomputed for the slab test
+struct simdRayBundle
+{
+    __m128 origin[3];
+    __m128 invDirection[3];
+
+    simdRayBundle() = default;
+    simdRayBundle(rayBundle &rays);
+};
+
+simdRayBundle::simdRayBundle(rayBundle &rays)
+{
+    Vec3 org[4], dir[4];
+
+    for (int i = 0; i < 4; i++)
+    {
+        org[i] = rays[i].positionAtTime(0);
+        dir[i] = rays[i].getDirection();
+    }
+
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    for (int j = 0; j < 3; j++)
+    {
+        this->origin[j] = _mm_setr_ps(org[0][j], org[1][j], org[2][j], org[3][j]);
+        this->invDirection[j] = _mm_div_ps(one, _mm_setr_ps(dir[0][j], dir[1][j], dir[2][j], dir[3][j]));
+    }
+}
+
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "Camera.h"
 #include "Ray.h"
+#include "RayPacket.h"
 
 #include <cmath>
 
@@ -23,6 +24,14 @@ public:
 
     Ray getRay(int x, int y);
     void getRayBundle(int x, int y, rayBundle &bundle);
+    void getRayPacket(int x, int y, int width, int height, rayPacket &packet);
+
+    // Rays through arbitrary points of pixels, offsets are in pixels from the
+    // lower left corner of the pixel and (0.5, 0.5) is its centre
+    Ray getRay(int x, int y, float offsetX, float offsetY);
+    void getRayBundle(const int x[4], const int y[4], const float offsetX[4], const float offsetY[4], rayBundle &bundle);
+    // offsets are given per ray, in quad order
+    void getRayPacket(int x, int y, int width, int height, const float *offsetX, const float *offsetY, rayPacket &packet);
 
 };
 
@@ -50,6 +59,16 @@ Ray RayGenerator::getRay(int x, int y)
     return Ray(this->camera.getPosition(), direction);
 }
 
+Ray RayGenerator::getRay(int x, int y, float offsetX, float offsetY)
+{
+    float u = this->fromCameraToLeft + (this->fromCameraToRight - this->fromCameraToLeft) * (x + offsetX) * this->invImageWidth;
+    float v = this->fromCameraToBottom + (this->fromCameraToTop - this->fromCameraToBottom) * (y + offsetY) * this->invImageHeight;
+
+    Vec3 direction = u * this->camera.getu() + v * this->camera.getv() - d * this->camera.getw();
+
+    return Ray(this->camera.getPosition(), direction);
+}
+
 void RayGenerator::getRayBundle(int x, int y, rayBundle &bundle)
 {
     float uStuff = (this->fromCameraToRight - this->fromCameraToLeft) * this->invImageWidth;
@@ -89,4 +108,58 @@ void RayGenerator::getRayBundle(int x, int y, rayBundle &bundle)
     //return bundle;
 }
 
+void RayGenerator::getRayPacket(int x, int y, int width, int height, rayPacket &packet)
+{
+    packet.width = width;
+    packet.height = height;
+    packet.quadCount = width * height / 4;
+
+    for (int q = 0; q < packet.quadCount; q++)
+    {
+        this->getRayBundle(x + packet.quadX(q), y + packet.quadY(q), packet.rays[q]);
+        packet.laneMasks[q] = 0xF;
+    }
+}
+
+void RayGenerator::getRayBundle(const int x[4], const int y[4], const float offsetX[4], const float offsetY[4], rayBundle &bundle)
+{
+    float uStuff = (this->fromCameraToRight - this->fromCameraToLeft) * this->invImageWidth;
+    float vStuff = (this->fromCameraToTop - this->fromCameraToBottom) * this->invImageHeight;
+
+    const Vec3 camU = this->camera.getu(), 
+    camV = this->camera.getv(), 
+    camW = this->camera.getw(), 
+    camPos = this->camera.getPosition();
+
+    for (int i = 0; i < 4; i++)
+    {
+        float u = this->fromCameraToLeft + uStuff * (x[i] + offsetX[i]);
+        float v = this->fromCameraToBottom + vStuff * (y[i] + offsetY[i]);
+
+        for (int j = 0; j < 3; j++)
+        {
+            bundle.rays[i].direction[j] = u * camU[j] + v * camV[j] - d * camW[j];
+            bundle.rays[i].origin[j] = camPos[j];
+        }
+    }
+}
+
+void RayGenerator::getRayPacket(int x, int y, int width, int height, const float *offsetX, const float *offsetY, rayPacket &packet)
+{
+    packet.width = width;
+    packet.height = height;
+    packet.quadCount = width * height / 4;
+
+    for (int q = 0; q < packet.quadCount; q++)
+    {
+        int quadX = x + packet.quadX(q);
+        int quadY = y + packet.quadY(q);
+        int pixelX[4] = {quadX, quadX + 1, quadX, quadX + 1};
+        int pixelY[4] = {quadY, quadY, quadY + 1, quadY + 1};
+
+        this->getRayBundle(pixelX, pixelY, offsetX + q * 4, offsetY + q * 4, packet.rays[q]);
+        packet.laneMasks[q] = 0xF;
+    }
+}
+
 #endif
@@ -0,0 +1,105 @@
+#ifndef _RAY_PACKET_H
+#define _RAY_PACKET_H
+
+#include "Ray.h"
+#include "rayHit.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <xmmintrin.h>
+
+// 16x16 pixels, packets are stored as 2x2 quads of rays
+#define MAX_PACKET_QUADS 64
+
+// A tile of coherent rays traced together through the BVH. Each quad of the
+// tile is kept as a rayBundle so the SIMD slab test and the per-ray primitive
+// tests are shared with the bundle path.
+struct rayPacket
+{
+    int width;
+    int height;
+    int quadCount;
+
+    rayBundle rays[MAX_PACKET_QUADS];
+    simdRayBundle simdRays[MAX_PACKET_QUADS];
+    hitBundle records[MAX_PACKET_QUADS];
+    // rays that take part in traversal, one bit per lane of each quad
+    int laneMasks[MAX_PACKET_QUADS];
+
+    // Interval bounds over the active rays of the packet, used to reject a node
+    // for the whole packet at once. Only valid if every ray has the same direction
+    // sign on each axis.
+    bool coherent;
+    float minOrigin[3];
+    float maxOrigin[3];
+    float minInvDirection[3];
+    float maxInvDirection[3];
+
+    int quadX(int quad) const;
+    int quadY(int quad) const;
+
+    // transposes the quads for the SIMD slab test and computes the interval bounds
+    void prepare();
+};
+
+int rayPacket::quadX(int quad) const
+{
+    return (quad % (this->width / 2)) * 2;
+}
+
+int rayPacket::quadY(int quad) const
+{
+    return (quad / (this->width / 2)) * 2;
+}
+
+void rayPacket::prepare()
+{
+    alignas(16) float origin[4];
+    alignas(16) float invDirection[4];
+
+    for (int q = 0; q < this->quadCount; q++)
+    {
+        this->simdRays[q] = simdRayBundle(this->rays[q]);
+    }
+
+    for (int j = 0; j < 3; j++)
+    {
+        this->minOrigin[j] = this->minInvDirection[j] = std::numeric_limits<float>::infinity();
+        this->maxOrigin[j] = this->maxInvDirection[j] = -std::numeric_limits<float>::infinity();
+    }
+
+    for (int q = 0; q < this->quadCount; q++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            _mm_store_ps(origin, this->simdRays[q].origin[j]);
+            _mm_store_ps(invDirection, this->simdRays[q].invDirection[j]);
+
+            for (int i = 0; i < 4; i++)
+            {
+                if (!(this->laneMasks[q] & (1 << i)))
+                    continue;
+
+                this->minOrigin[j] = std::min(this->minOrigin[j], origin[i]);
+                this->maxOrigin[j] = std::max(this->maxOrigin[j], origin[i]);
+                this->minInvDirection[j] = std::min(this->minInvDirection[j], invDirection[i]);
+                this->maxInvDirection[j] = std::max(this->maxInvDirection[j], invDirection[i]);
+            }
+        }
+    }
+
+    this->coherent = true;
+
+    for (int j = 0; j < 3; j++)
+    {
+        // a sign change or an axis-parallel ray makes the interval slab test meaningless
+        if (!(this->minInvDirection[j] > 0 || this->maxInvDirection[j] < 0) ||
+            std::isinf(this->minInvDirection[j]) || std::isinf(this->maxInvDirection[j]))
+        {
+            this->coherent = false;
+        }
+    }
+}
+
+#endif
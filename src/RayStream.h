@@ -0,0 +1,165 @@
+#ifndef _RAY_STREAM_H
+#define _RAY_STREAM_H
+
+#include "BoundingBox.h"
+#include "Ray.h"
+
+#include "libs/Matrix.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// bits per axis of the quantized ray origin used to sort streams
+#define STREAM_SORT_BITS 9
+
+// All rays of one bounce for a block of pixels, stored as structure of arrays
+// so they can be reordered cheaply and traced in batches
+struct rayStream
+{
+    std::vector<float> origin[3];
+    std::vector<float> direction[3];
+    std::vector<float> endTime;
+    // pixel the ray contributes to and how much of the color it finds reaches it
+    std::vector<int> pixel;
+    std::vector<Vec3> weight;
+
+    int size() const;
+    void clear();
+    void push(Ray &ray, float endTime, int pixel, Vec3 weight);
+
+    Ray getRay(int index) const;
+    // four consecutive rays, past the end of the stream the last ray is repeated
+    void getBundle(int first, rayBundle &bundle) const;
+
+    // Groups rays by direction octant, then by the Morton order of their origins
+    // inside bounds, so that consecutive rays tend to visit the same BVH nodes
+    void sort(const BoundingBox &bounds);
+
+private:
+    std::vector<uint64_t> keys;
+    std::vector<float> floatScratch;
+    std::vector<int> intScratch;
+    std::vector<Vec3> vecScratch;
+
+    template<typename T>
+    void permute(std::vector<T> &values, std::vector<T> &scratch);
+};
+
+int rayStream::size() const
+{
+    return this->pixel.size();
+}
+
+void rayStream::clear()
+{
+    for (int j = 0; j < 3; j++)
+    {
+        this->origin[j].clear();
+        this->direction[j].clear();
+    }
+
+    this->endTime.clear();
+    this->pixel.clear();
+    this->weight.clear();
+}
+
+void rayStream::push(Ray &ray, float endTime, int pixel, Vec3 weight)
+{
+    for (int j = 0; j < 3; j++)
+    {
+        this->origin[j].push_back(ray.origin[j]);
+        this->direction[j].push_back(ray.direction[j]);
+    }
+
+    this->endTime.push_back(endTime);
+    this->pixel.push_back(pixel);
+    this->weight.push_back(weight);
+}
+
+Ray rayStream::getRay(int index) const
+{
+    Ray ray;
+
+    for (int j = 0; j < 3; j++)
+    {
+        ray.origin[j] = this->origin[j][index];
+        ray.direction[j] = this->direction[j][index];
+    }
+
+    return ray;
+}
+
+void rayStream::getBundle(int first, rayBundle &bundle) const
+{
+    for (int i = 0; i < 4; i++)
+    {
+        bundle[i] = this->getRay(std::min(first + i, this->size() - 1));
+    }
+}
+
+static uint32_t spreadBits(uint32_t v)
+{
+    // inserts two zero bits between each of the low 10 bits
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+void rayStream::sort(const BoundingBox &bounds)
+{
+    const int n = this->size();
+    const float cells = (1 << STREAM_SORT_BITS) - 1;
+
+    this->keys.resize(n);
+
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t octant = 0;
+        uint32_t morton = 0;
+
+        for (int j = 0; j < 3; j++)
+        {
+            octant |= (this->direction[j][i] < 0) << j;
+
+            float extent = bounds.minMax[j+3] - bounds.minMax[j];
+            float t = extent > 0 ? (this->origin[j][i] - bounds.minMax[j]) / extent : 0;
+            uint32_t cell = static_cast<uint32_t>(std::min(std::max(t, 0.0f), 1.0f) * cells);
+
+            morton |= spreadBits(cell) << j;
+        }
+
+        // the ray index in the low bits keeps the order of equal keys stable
+        this->keys[i] = (static_cast<uint64_t>(octant << (3 * STREAM_SORT_BITS) | morton) << 32) | i;
+    }
+
+    std::sort(this->keys.begin(), this->keys.end());
+
+    for (int j = 0; j < 3; j++)
+    {
+        this->permute(this->origin[j], this->floatScratch);
+        this->permute(this->direction[j], this->floatScratch);
+    }
+
+    this->permute(this->endTime, this->floatScratch);
+
+    this->permute(this->pixel, this->intScratch);
+    this->permute(this->weight, this->vecScratch);
+}
+
+template<typename T>
+void rayStream::permute(std::vector<T> &values, std::vector<T> &scratch)
+{
+    scratch.resize(values.size(), values.empty() ? T() : values[0]);
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        scratch[i] = values[this->keys[i] & 0xFFFFFFFF];
+    }
+
+    values.swap(scratch);
+}
+
+#endif
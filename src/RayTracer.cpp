@@ -1,28 +1,33 @@
 // For the test scenes, resolution of 100x100, and fov 90 degree, my
 // generator creates the test images. My ray dirs are normalized.
 
-//Hard code resolution for now
-#define SQUARE_RES true
-
-#if SQUARE_RES
-#define RESX 400
-#define RESY 400
-#else
-#define RESX 1920
-#define RESY 1080
-#endif
-
-#define REFLECTION_DEPTH_LIMIT 8
-#define BUNDLE_RENDER
+//Adaptive sampling measures the error of dark pixels relative to this luminance instead of their own
+#define ADAPTIVE_LUMINANCE_FLOOR 0.05f
+//The preview pass of progressive rendering traces one pixel out of each block of this side length
+#define PREVIEW_BLOCK_DIM 8
+//Progressive rendering only trusts the noise estimate once every pixel has this many samples
+#define PROGRESSIVE_MIN_SAMPLES 4
 
 #include "Camera.h"
+#include "Checkpoint.h"
+#include "HDRImage.h"
 #include "Light.h"
 #include "Material.h"
+#include "PeakMemory.h"
+#include "PixelSampler.h"
+#include "ProgressReporter.h"
 #include "Ray.h"
 #include "RayGenerator.h"
+#include "RenderConfig.h"
 #include "Scene.h"
+#include "SceneLoader.h"
+#include "Shader.h"
 #include "Sphere.h"
 #include "Surface.h"
+#include "ThreadPool.h"
+#include "TileTracer.h"
+#include "TileScheduler.h"
+#include "ToneMapper.h"
 #include "Triangle.h"
 
 #include "libs/Buffer.h"
@@ -32,39 +37,51 @@
 
 #define _USE_MATH_DEFINES //This enables math constants in Windows
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstddef>
+#include <cstdio>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <math.h> //Math functions and some constants
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
 
-Material* objMaterialtoMaterial(obj_material* mat)
+//Relative standard error of the mean luminance of a pixel, dark pixels are
+//compared against a floor. Pixels with fewer than two samples count as noisy.
+float sampleError(const pixelSums &sums)
 {
-	return new Material{
-		mat->name,
-		mat->texture_filename,
-		Vec3(mat->amb),
-		Vec3(mat->diff),
-		Vec3(mat->spec),
-		mat->reflect,
-		mat->refract,
-		mat->trans,
-		mat->shiny,
-		mat->glossy,
-		mat->refract_index
-	};
+	if (sums.sampleCount < 2)
+		return std::numeric_limits<float>::infinity();
+
+	float n = sums.sampleCount;
+	float mean = sums.luminanceSum / n;
+	float variance = std::max(0.0f, sums.luminanceSquareSum / n - mean * mean) * n / (n - 1);
+
+	return std::sqrt(variance / n) / std::max(mean, ADAPTIVE_LUMINANCE_FLOOR);
 }
 
+//Moves a finished file over another one, so a reader never sees half of it
+bool replaceFile(const std::string &from, const std::string &to)
+{
+	if (std::rename(from.c_str(), to.c_str()) == 0)
+		return true;
 
-Vec3 traceRay(Scene& scene, Ray r, int currentDepth = 0);
-void traceRayBundle(Scene& scene, rayBundle r, Vec3Bundle &vecBundle, int currentDepth = 0);
+	//renaming over an existing file fails on Windows
+	std::remove(to.c_str());
+	return std::rename(from.c_str(), to.c_str()) == 0;
+}
 
 int main(int argc, char ** argv)
 {
+	auto launchTime = std::chrono::steady_clock::now();
+
 	// std::vector<Surface*> testVec;
 	// testVec.push_back(new Triangle(Vec3(0), Vec3(), Vec3(), ""));
 	// BVHTree tree(testVec);
@@ -80,421 +97,674 @@ int main(int argc, char ** argv)
 
 	//exit(0);
 
-	//Need at least two arguments (obj input and png output)
-	if(argc < 3)
-	{
-		printf("Usage: %s input.obj output.png [-jn]\n", argv[0]);
-		exit(1);
-	}
+	renderConfig config = renderConfig::fromArgs(argc, argv);
 
-	unsigned int numThreads = 1;
+	//Every parallel phase runs on these threads, the main thread being one of them
+	ThreadPool pool(config.threads);
 
-	if (argc == 4)
+	//Only float images are written from it, pngs are tone mapped a row at a time
+	const bool floatOutput = HDRImage::isFloatFormat(config.outputFormat);
+	Buffer<Vec3> colorBuffer(floatOutput ? config.width : 0, floatOutput ? config.height : 0);
+
+	//load the input scene, an obj file or a binary scene file
+	SceneLoader sceneLoader;
+	std::string loadError;
+	auto loadStart = std::chrono::steady_clock::now();
+	PeakMemory::reset();
+	if (!sceneLoader.load(config.inputPath, pool, loadError))
 	{
-		if (std::string(argv[3]).find("-j") == 0)
-		{
-			numThreads = std::stoi(std::string(argv[3]).substr(2));
-			numThreads = std::min(std::thread::hardware_concurrency(), std::max(1U, numThreads));
-		}
+		printf("Could not load scene file %s: %s\n", config.inputPath.c_str(), loadError.c_str());
+		exit(2);
 	}
 
-	Buffer<Vec3> colorBuffer(RESX, RESY);
+	double loadTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - loadStart).count();
+	double loadedMegabytes = sceneLoader.getFileSize() / (1024.0 * 1024.0);
+	printf("Loaded %s: %.2f MB in %.3fs, %.1f MB/s\n", config.inputPath.c_str(), loadedMegabytes, loadTime,
+		loadTime > 0 ? loadedMegabytes / loadTime : 0.0);
+	PeakMemory::report("parsing");
 
-	//load obj from file argv1
-    objLoader objData = objLoader();
-	if (!objData.load(argv[1]))
-    {
-        printf("Could not load object file %s\n", argv[1]);
-        exit(2);
-    }
+	const sceneView &sceneData = sceneLoader.getView();
 
 	//create a camera object
-    if (!objData.camera)
-    {
-        printf("No camera loaded!\n");
-        exit(3);
-    }
+	if (!sceneData.hasCamera)
+	{
+		printf("No camera loaded!\n");
+		exit(3);
+	}
 
-    Vec3 position(objData.vertexList[objData.camera->camera_pos_index]->e);
-    Vec3 focus(objData.vertexList[objData.camera->camera_look_point_index]->e);
-    Vec3 up(objData.normalList[objData.camera->camera_up_norm_index]->e);
+	Vec3 position(sceneData.camera.position);
+	Vec3 focus(sceneData.camera.focus);
+	Vec3 up(sceneData.camera.up);
 
-    Camera camera = Camera::lookAt(position, focus, up, Mat::toRads(90));
+	//a checkpoint is only resumed for the same scene file and camera
+	renderScene checkpointScene;
 
-	RayGenerator generator = RayGenerator(camera, RESX, RESY);
+	if (!config.checkpointPath.empty() && !renderScene::of(config.inputPath, sceneData.camera, checkpointScene))
+	{
+		printf("Could not read the size and time of %s for the checkpoint\n", config.inputPath.c_str());
+		exit(4);
+	}
+
+	Camera camera = Camera::lookAt(position, focus, up, Mat::toRads(config.fov));
+
+	RayGenerator generator = RayGenerator(camera, config.width, config.height);
 
 	Scene scene;
-	std::vector<Light> lights;
+	sceneLoader.buildScene(scene, pool, static_cast<size_t>(config.geometryCacheMegabytes) * 1024 * 1024);
 
-	for (int i = 0; i < objData.materialCount; i++)
-	{
-		scene.addMaterial(objMaterialtoMaterial(objData.materialList[i]));
-	}
+	//the scene has its own copy of everything now
+	sceneLoader.release();
+	PeakMemory::report("building");
 
-    for (int i = 0; i < objData.sphereCount; i++)
-	{
-		Vec3 center(objData.vertexList[objData.sphereList[i]->pos_index]->e);
-		Vec3 equator(objData.normalList[objData.sphereList[i]->equator_normal_index]->e);
-		Vec3 up(objData.normalList[objData.sphereList[i]->up_normal_index]->e);
-		float radius = Mat::magnitude(equator);
+	Shader shader(scene, config.maxDepth);
 
-		obj_material* mat = objData.materialList[objData.sphereList[i]->material_index];
+	//Rays reaching out of core chunks are queued per chunk in streams, so each chunk is read once for all of them
+	const RenderMode renderMode = sceneLoader.getGeometryCache() ? RENDER_MODE_STREAM : DEFAULT_RENDER_MODE;
 
-		scene.addSurface(new Sphere(center, equator, up, radius, mat->name));
-	}
+	if (renderMode != DEFAULT_RENDER_MODE)
+		std::cout << "Tracing the out of core scene in streams" << std::endl;
 
-	for (int i = 0; i < objData.faceCount; i++)
-	{
-		Vec3 a(objData.vertexList[objData.faceList[i]->vertex_index[0]]->e);
+	auto startTime = std::chrono::system_clock::now();
 
-		for (int j = 2; j < objData.faceList[i]->vertex_count; j++)
-		{
-			Vec3 b(objData.vertexList[objData.faceList[i]->vertex_index[j - 1]]->e);
-			Vec3 c(objData.vertexList[objData.faceList[i]->vertex_index[j]]->e);
+	//Brightest colour component of the image, for max tone mapping
+	float maxComponent = 1;
 
-			obj_material* mat = objData.materialList[objData.faceList[i]->material_index];
+	std::mutex compMutex;
 
-			scene.addSurface(new Triangle(a, b, c, mat->name));
-		}
-	}
+	ToneMapper toneMapper(config.toneOperator, config.exposure);
+
+	TileScheduler scheduler(config.width, config.height, config.tileSize, config.tileOrder, pool.getThreadCount());
+
+	PixelSampler sampler(config.samplesPerPixel, config.samplePattern, config.pixelFilter);
+
+	const int samplesPerPixel = sampler.getSampleCount();
+	//Most samples a pixel gets in one pass. Progressive passes go up to half of the
+	//final count. Sample arrays hold this many per pixel, rounded up to whole quads.
+	const int passSampleLimit = config.progressive ? std::max(samplesPerPixel, config.maxSamplesPerPixel / 2) : samplesPerPixel;
+	const int paddedSamples = (passSampleLimit + 3) & ~3;
 
-	for (int i = 0; i < objData.lightPointCount; i++)
+	//Sums over the samples of every pixel, kept across passes. Unlike colorBuffer, y points up like in the tiles.
+	//Laid out in tiles like the render, so the sums of a tile are in one piece of memory.
+	Buffer<pixelSums> accumulation(config.width, config.height, BUFFER_LAYOUT_TILES, config.tileSize);
+	//Pixels traced in the current pass, laid out like accumulation
+	Buffer<char> passPixels(config.width, config.height, BUFFER_LAYOUT_TILES, config.tileSize);
+	passState state = {0, 0, samplesPerPixel, false};
+
+	//Tiles of the current pass whose sums are in accumulation, by position in the tile grid
+	const int tilesX = (config.width + config.tileSize - 1) / config.tileSize;
+	std::vector<char> tilesDone(scheduler.getTileCount());
+	//Held while a tile's sums are stored, so a checkpoint never sees half a tile
+	std::mutex tileStateMutex;
+
+	pool.parallelFor(0, config.height, 16, [&accumulation, &config](int firstRow, int endRow)
 	{
-		Vec3 position(objData.vertexList[objData.lightPointList[i]->pos_index]->e);
+		for (int y = firstRow; y < endRow; y++)
+		{
+			for (int x = 0; x < config.width; x++)
+			{
+				accumulation.at(x, y) = pixelSums();
+			}
+		}
+	});
 
-		obj_material* mat = objData.materialList[objData.lightPointList[i]->material_index];
+	//Progressive rendering stops handing out tiles once the budget is spent.
+	//It counts from the start of the program, loading the scene included.
+	auto outOfTime = [&config, launchTime]() {
+		return config.timeBudget > 0 && 
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - launchTime).count() >= config.timeBudget;
+	};
 
-		scene.addLight(new Light(position, mat->name));
-	}
+	//Reporter of the pass being rendered
+	std::unique_ptr<ProgressReporter> progress;
 
-	scene.finalizeScene();
+	//Only one thread writes a checkpoint at a time
+	std::mutex checkpointMutex;
+	//seconds from the start of the program
+	std::atomic<double> lastCheckpoint(0);
 
-	auto startTime = std::chrono::system_clock::now();
+	auto checkpointDue = [&config, &lastCheckpoint, launchTime]() {
+		return !config.checkpointPath.empty() && 
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - launchTime).count() - lastCheckpoint >= config.checkpointInterval;
+	};
 
-	const int PROGRESS_BAR_SIZE = 40;
-	int lastProgressPercent = -1;
-	int lastProgressBarFill = 0;
+	//Saves the finished tiles of the pass. Render threads skip it while another
+	//thread is writing one, the end of a pass waits for its turn.
+	auto saveCheckpoint = [&](bool wait) {
+		std::unique_lock<std::mutex> lk(checkpointMutex, std::defer_lock);
 
-	long pixelsRendered = 0;
+		if (wait)
+			lk.lock();
+		else if (!lk.try_lock() || !checkpointDue())
+			return;
 
-	float maxComponent = 1;
+		Buffer<pixelSums> savedSums;
+		std::vector<char> savedTiles;
 
-	std::mutex compMutex;
-	std::mutex progressMutex;
-	//std::mutex ioMutex;
+		{
+			std::lock_guard<std::mutex> tileLock(tileStateMutex);
+			savedSums = accumulation.clone();
+			savedTiles = tilesDone;
+		}
 
-	std::cout << "\r[";
-	for (int i = 0; i < PROGRESS_BAR_SIZE; i++)
-	{
-		std::cout << " ";
-	}
-	std::cout << "]  " << "0%" << std::flush;
+		//the old checkpoint stays in place until the new one is complete
+		std::string partPath = config.checkpointPath + ".part";
+
+		if (!Checkpoint::write(partPath, config, checkpointScene, state, savedTiles, passPixels, savedSums) || !replaceFile(partPath, config.checkpointPath))
+			std::cout << "Could not write checkpoint " << config.checkpointPath << std::endl;
+
+		lastCheckpoint = std::chrono::duration<double>(std::chrono::steady_clock::now() - launchTime).count();
+	};
+
+	//Filter weighted average of the samples of a pixel, y pointing up like in accumulation
+	auto resolvePixel = [&](int x, int y) -> Vec3 {
+		//pixels the preview skipped show the one traced for their block
+		const pixelSums &sums = accumulation.at(x, y).sampleCount > 0 ? accumulation.at(x, y) : 
+			accumulation.at(x - x % PREVIEW_BLOCK_DIM, y - y % PREVIEW_BLOCK_DIM);
+
+		return sums.weightSum > 0 ? sums.weightedSum / sums.weightSum : Vec3(0);
+	};
 
-	auto renderFunc = [&](int offset){
-		float localMaxComponent = 1;
-		int localPixelsRendered = 0;
-#ifndef BUNDLE_RENDER
-		for (int y = 0; y < RESY; y++)
+	//Tone maps row y of accumulation into out, channels being room for ToneMapper::paddedSize floats
+	auto mapRow = [&](int y, float *channels, unsigned char *out) {
+		for (int x = 0; x < config.width; x++)
 		{
-			for (int x = offset; x<RESX; x += numThreads)
+			Vec3 c = resolvePixel(x, y);
+
+			for (int i = 0; i < 3; i++)
 			{
-				Ray r = generator.getRay(x, y);
+				channels[3 * x + i] = c[i];
+			}
+		}
 
-				Vec3 c = traceRay(scene, r);
+		toneMapper.mapRow(channels, 3 * config.width, maxComponent, out);
+	};
 
-				for (int i = 0; i < 3; i++)
-				{
-					if (c[i] > localMaxComponent)
-						localMaxComponent = c[i];
-				}
+	//With streamed output the png's rows are written from the top down, as soon
+	//as every tile they go through is done
+	simplePNG_stream *pngStream = nullptr;
+	//Held by the thread writing rows
+	std::mutex streamMutex;
+	const int tilesY = (config.height + config.tileSize - 1) / config.tileSize;
+	//Tiles left in each row of tiles, and the png rows whose tiles are all done, held under tileStateMutex
+	std::vector<int> tilesLeftInRow(tilesY);
+	int rowsReady = 0;
+	int rowsWritten = 0;
+	Buffer<Color> streamRow(config.width, 1);
+	std::vector<float> streamChannels(ToneMapper::paddedSize(3 * config.width));
+
+	//Moves rowsReady past the rows of tiles that are done, with tileStateMutex held
+	auto findReadyRows = [&]() {
+		while (rowsReady < config.height && tilesLeftInRow[(config.height - 1 - rowsReady) / config.tileSize] == 0)
+			rowsReady = config.height - (config.height - 1 - rowsReady) / config.tileSize * config.tileSize;
+	};
 
-				colorBuffer.at(x, RESY - 1 - y) = c;
+	auto startStream = [&]() {
+		for (int ty = 0; ty < tilesY; ty++)
+		{
+			tilesLeftInRow[ty] = std::count(tilesDone.begin() + ty * tilesX, tilesDone.begin() + (ty + 1) * tilesX, 0);
+		}
 
-				if (localPixelsRendered > RESX * RESY / 500 && (numThreads == 1 || progressMutex.try_lock()))
-				{
-					pixelsRendered += localPixelsRendered + 1;
-#else
-		for (int y = offset * 2; y < RESY; y += 2*numThreads)
+		rowsReady = 0;
+		rowsWritten = 0;
+		findReadyRows();
+
+		pngStream = simplePNG_stream_open(config.outputPath.c_str(), config.width, config.height, config.pngLevel);
+
+		if (!pngStream)
 		{
-			for (int x = 0; x<RESX; x += 2)
-			{
-				rayBundle rayBundle;
-				generator.getRayBundle(x, y, rayBundle);
+			printf("Could not open %s to stream the image to\n", config.outputPath.c_str());
+			exit(6);
+		}
+	};
 
-				Vec3Bundle vecBundle;
-				traceRayBundle(scene, rayBundle, vecBundle);
+	//Writes the rows that are ready. Render threads leave it to the thread
+	//already writing, the end of the render waits for its turn.
+	auto streamRows = [&](bool wait) {
+		std::unique_lock<std::mutex> lk(streamMutex, std::defer_lock);
 
-				for (int i = 0; i < 3; i++)
-				{
-					for (int j = 0; j < 4; j++)
-					{
-						colorBuffer.at(x + (j%2), RESY - 1 - y - (j/2))[i] = vecBundle[j][i];
+		if (wait)
+			lk.lock();
+		else if (!lk.try_lock())
+			return;
 
-						if (vecBundle[j][i] > localMaxComponent)
-							localMaxComponent = vecBundle[j][i];
-					}
-				}
+		for (;;)
+		{
+			int ready;
 
-				if (localPixelsRendered > RESX * RESY / 500 && (numThreads == 1 || progressMutex.try_lock()))
-				{
-					pixelsRendered += localPixelsRendered + 4;
-#endif
-					localPixelsRendered = 0;
+			{
+				std::lock_guard<std::mutex> tileLock(tileStateMutex);
+				ready = rowsReady;
+			}
 
-					int progressPercent = pixelsRendered * 100 / (RESX * RESY);
-					int progressBarFill = pixelsRendered * PROGRESS_BAR_SIZE / (RESX * RESY);
+			if (rowsWritten == ready)
+				return;
 
-					if (progressPercent != lastProgressPercent || progressBarFill != lastProgressBarFill)
-					{
-						lastProgressPercent = progressPercent;
-						std::cout << "\r[";
-						for (int i = 0; i < PROGRESS_BAR_SIZE; i++)
-						{
-							std::cout << (i < progressBarFill ? "#" : " ");
-						}
-						std::cout << "]  " << progressPercent << "%" << std::flush;
-					}
-					if (numThreads != 1) progressMutex.unlock();
-				}
-				else
+			for (; rowsWritten < ready; rowsWritten++)
+			{
+				mapRow(config.height - 1 - rowsWritten, streamChannels.data(), (unsigned char*)streamRow.getData());
+
+				if (simplePNG_stream_write_rows(pngStream, (unsigned char*)streamRow.getData(), 1) != 0)
 				{
-#ifndef BUNDLE_RENDER
-					localPixelsRendered++;
-#else
-					localPixelsRendered += 4;
-#endif
+					printf("Could not write rows to %s\n", config.outputPath.c_str());
+					exit(6);
 				}
 			}
 		}
+	};
+
+	auto finishStream = [&]() {
+		streamRows(true);
 
+		if (simplePNG_stream_close(pngStream) != 0)
 		{
-			std::lock_guard<std::mutex> lk(compMutex);
-			maxComponent = std::max(maxComponent, localMaxComponent);
+			printf("Could not write all rows of %s\n", config.outputPath.c_str());
+			exit(6);
 		}
-	};
 
-	std::vector<std::thread> threads;
+		pngStream = nullptr;
+	};
 
-	for (int i = 1; i < numThreads; i++)
-	{
-		threads.emplace_back(renderFunc, i);
-	}
+	auto renderFunc = [&](int thread){
+		TileTracer tracer(renderMode, shader, generator, sampler, config.tileSize, paddedSamples);
+		std::vector<pixelSums> &sums = tracer.sums;
+		std::vector<char> &activePixels = tracer.activePixels;
 
-	renderFunc(0);
+		renderTile tile;
 
-	for (auto &thread : threads)
-	{
-		thread.join();
-	}
+		while (!outOfTime() && scheduler.nextTile(thread, tile))
+		{
+			auto tileStart = std::chrono::steady_clock::now();
 
-	threads.clear();
+			const int pixelCount = tile.width * tile.height;
+			const int tileIndex = tile.y / config.tileSize * tilesX + tile.x / config.tileSize;
 
-	std::cout << "\r[";
-	for (int i = 0; i < PROGRESS_BAR_SIZE; i++)
-	{
-		std::cout << "#";
-	}
-	std::cout << "]  " << "100%" << std::endl;
+			//done before the render was resumed
+			if (tilesDone[tileIndex])
+			{
+				progress->add(thread, pixelCount);
+				continue;
+			}
 
-	std::cout << std::chrono::duration<double>(std::chrono::system_clock::now() - startTime).count() << std::endl;
+			for (int py = 0; py < tile.height; py++)
+			{
+				for (int px = 0; px < tile.width; px++)
+				{
+					sums[py * tile.width + px] = accumulation.at(tile.x + px, tile.y + py);
+					activePixels[py * tile.width + px] = passPixels.at(tile.x + px, tile.y + py);
+				}
+			}
 
-	//create a frame buffer for RESxRES
-    Buffer<Color> outputBuffer(RESX, RESY);
+			tracer.tracePass(tile, state.samples);
 
-	auto convertFunc = [&outputBuffer, &colorBuffer, maxComponent, numThreads](int offset)
-	{
-		for (int y = 0; y < RESY; y++)
-		{
-			for (int x = offset; x < RESX; x += numThreads)
+			//Adaptive sampling keeps adding batches of samples to the pixels whose
+			//mean is still too uncertain, the other pixels drop out for good.
+			//Progressive rendering does the same over whole passes instead.
+			for (int taken = samplesPerPixel; !config.progressive && taken < config.maxSamplesPerPixel; taken += samplesPerPixel)
 			{
-				outputBuffer.at(x, y) = static_cast<Color>(colorBuffer.at(x, y) * 255 / maxComponent);
-			}
-		}
-	};
+				bool anyActive = false;
 
-	for (int i = 1; i < numThreads; i++)
-	{
-		threads.emplace_back(convertFunc, i);
-	}
+				for (int p = 0; p < pixelCount; p++)
+				{
+					if (!activePixels[p])
+						continue;
 
-	convertFunc(0);
+					activePixels[p] = sampleError(sums[p]) > config.adaptiveThreshold;
+					anyActive |= activePixels[p] != 0;
+				}
 
-	for (auto &thread : threads)
-	{
-		thread.join();
-	}
+				//An edge can slip between the first samples of a pixel, so after
+				//the first pass the neighbours of noisy pixels get refined as well
+				if (taken == samplesPerPixel)
+				{
+					//added pixels are marked 2 so they don't spread any further
+					auto activate = [&](int n) { if (!activePixels[n]) activePixels[n] = 2; };
 
-	//Write output buffer to file argv2
-	simplePNG_write(argv[2], outputBuffer.getWidth(), outputBuffer.getHeight(), (unsigned char*)&outputBuffer.at(0,0));
+					for (int p = 0; p < pixelCount; p++)
+					{
+						int px = p % tile.width;
+						int py = p / tile.width;
 
-	return 0;
-}
+						if (activePixels[p] != 1)
+							continue;
 
+						if (px > 0) activate(p - 1);
+						if (px < tile.width - 1) activate(p + 1);
+						if (py > 0) activate(p - tile.width);
+						if (py < tile.height - 1) activate(p + tile.width);
+					}
+				}
 
-Vec3 traceRay(Scene& scene, Ray r, int currentDepth)
-{
-	rayHit surfaceInfo;
-	Vec3 returnColor(0);
-	
-	if (!scene.hitSurface(r, 0, 1000000, &surfaceInfo))
-		return returnColor;
-	
-	if (surfaceInfo.materialID == "")
-		return surfaceInfo.surfaceNormal / 2 + 0.5;
-
-	const Material* surfaceMat = scene.getMaterial(surfaceInfo.materialID);
-
-	for (auto* light : scene.getLights())
-	{
-		const Material* lightMat = scene.getMaterial(light->getMaterialName());
+				if (!anyActive)
+					break;
 
-		Vec3 lightDir = light->getPosition() - surfaceInfo.intersectionPoint;
-		float lightDistance = Mat::magnitude(lightDir);
-		lightDir = Mat::normalize(lightDir);
+				tracer.tracePass(tile, std::min(samplesPerPixel, config.maxSamplesPerPixel - taken));
+			}
 
-		//std::cout << (*light).getPosition().toString() << std::endl; 
+			{
+				std::lock_guard<std::mutex> lk(tileStateMutex);
 
-		// diffuse lighting
-		float lDotn = Mat::dot(lightDir, surfaceInfo.surfaceNormal);
+				for (int py = 0; py < tile.height; py++)
+				{
+					for (int px = 0; px < tile.width; px++)
+					{
+						accumulation.at(tile.x + px, tile.y + py) = sums[py * tile.width + px];
+					}
+				}
 
-		// specular lighting
-		float spec = 0;
+				tilesDone[tileIndex] = 1;
 
-		if (lDotn > 0)
-		{
-			Vec3 reflectedLight = Mat::normalize(Mat::reflectOut(lightDir, surfaceInfo.surfaceNormal));
-			Vec3 view = Mat::normalize(-r.getDirection());
-			// Vec3 view = Mat::normalize(scene.getCamera().getPosition() - surfaceInfo.intersectionPoint);
+				if (pngStream)
+				{
+					tilesLeftInRow[tile.y / config.tileSize]--;
+					findReadyRows();
+				}
+			}
+
+			if (pngStream)
+				streamRows(false);
+
+			scheduler.addBusyTime(thread, std::chrono::duration<double>(std::chrono::steady_clock::now() - tileStart).count());
 
-			if (Mat::dot(reflectedLight, view) > 0 && surfaceMat->shiny != 0)
-				spec = pow(Mat::dot(reflectedLight, view), surfaceMat->shiny);
+			progress->add(thread, pixelCount);
+
+			if (checkpointDue())
+				saveCheckpoint(false);
 		}
-		else
+	};
+
+	//Stores the filter weighted average of the samples of every pixel in colorBuffer
+	auto resolveImage = [&]() {
+		pool.parallelFor(0, config.height, 16, [&](int firstRow, int endRow)
 		{
-			lDotn = 0;
-		}
+			for (int y = firstRow; y < endRow; y++)
+			{
+				for (int x = 0; x < config.width; x++)
+				{
+					colorBuffer.at(x, config.height - 1 - y) = resolvePixel(x, y);
+				}
+			}
+		});
+	};
 
-		Ray shadowRay(surfaceInfo.intersectionPoint + surfaceInfo.surfaceNormal * 0.0001f, lightDir);
-		rayHit unneeded;
+	//Finds maxComponent, which is never below 1 so dark images aren't brightened
+	auto findMaxComponent = [&]() {
+		maxComponent = 1;
 
-		if (scene.hitSurface(shadowRay, 0, lightDistance, &unneeded))
+		pool.parallelFor(0, config.height, 16, [&](int firstRow, int endRow)
 		{
-			lDotn = 0;
-			spec = 0;
+			float localMaxComponent = 1;
+
+			for (int y = firstRow; y < endRow; y++)
+			{
+				for (int x = 0; x < config.width; x++)
+				{
+					Vec3 c = resolvePixel(x, y);
+					localMaxComponent = std::max(localMaxComponent, std::max(c[0], std::max(c[1], c[2])));
+				}
+			}
+
+			std::lock_guard<std::mutex> lk(compMutex);
+			maxComponent = std::max(maxComponent, localMaxComponent);
+		});
+	};
+
+	//create a frame buffer for RESxRES, streamed renders and float images only need it for the heatmap
+	const bool outputWhole = (!config.streamOutput && !floatOutput) || !config.heatmapPath.empty();
+	Buffer<Color> outputBuffer(outputWhole ? config.width : 0, outputWhole ? config.height : 0);
+
+	//Returns false if the image couldn't be written in full
+	auto writeImage = [&](const std::string &path) {
+		//float images get the colours as they are
+		if (floatOutput)
+		{
+			resolveImage();
+			return HDRImage::write(path, config.outputFormat, colorBuffer, config.pngLevel > 0);
 		}
 
-		Vec3 surfaceColor(0);
+		if (toneMapper.needsMax())
+			findMaxComponent();
 
-		surfaceColor += surfaceMat->amb * lightMat->amb;
+		//resolved, tone mapped and quantized in one pass over the rows
+		pool.parallelFor(0, config.height, 16, [&](int firstRow, int endRow)
+		{
+			std::vector<float> channels(ToneMapper::paddedSize(3 * config.width));
 
-		surfaceColor += surfaceMat->diff * lightMat->diff * lDotn;
+			for (int y = firstRow; y < endRow; y++)
+			{
+				mapRow(config.height - 1 - y, channels.data(), (unsigned char*)&outputBuffer.at(0, y));
+			}
+		});
 
-		surfaceColor += surfaceMat->spec * surfaceMat->spec * spec;
+		//Write output buffer to the output png
+		return simplePNG_write_parallel(path.c_str(), outputBuffer.getWidth(), outputBuffer.getHeight(), (unsigned char*)&outputBuffer.at(0,0), 
+			config.pngLevel, ThreadPool::executor, &pool) == 0;
+	};
 
-		returnColor += surfaceColor;
-	}
+	//Marks the pixels of the next pass, returns how many there are
+	auto selectPixels = [&](std::function<bool(int, int)> selected) {
+		std::atomic<long> selectedCount(0);
 
-	if (surfaceMat->reflect > 0 && currentDepth <= REFLECTION_DEPTH_LIMIT)
-	{
-		Ray reflectedRay(surfaceInfo.intersectionPoint + surfaceInfo.surfaceNormal * 0.0001f, 
-			Mat::reflectIn(r.getDirection(), surfaceInfo.surfaceNormal));
+		pool.parallelFor(0, config.height, 16, [&](int firstRow, int endRow)
+		{
+			long localCount = 0;
+
+			for (int y = firstRow; y < endRow; y++)
+			{
+				for (int x = 0; x < config.width; x++)
+				{
+					passPixels.at(x, y) = selected(x, y);
+					localCount += passPixels.at(x, y);
+				}
+			}
 
-		Vec3 reflectColor = traceRay(scene, reflectedRay, currentDepth + 1);
+			selectedCount += localCount;
+		});
 
-		returnColor = returnColor * (1 - surfaceMat->reflect) + reflectColor * surfaceMat->reflect;
-	}
+		return selectedCount.load();
+	};
 
-	return returnColor;
-}
+	//Renders the pass in state, apart from the tiles of it that are done already
+	auto renderPass = [&]() {
+		scheduler.reset();
 
-void traceRayBundle(Scene& scene, rayBundle rays, Vec3Bundle &vecBundle, int currentDepth)
-{
-	const float DEFAULT_END_TIME = 1000000;
+		progress.reset(new ProgressReporter(pool.getThreadCount(), config.width * config.height, config.progressFormat));
+		progress->start();
 
-	hitBundle records;
+		pool.run(renderFunc);
 
-	for (int i = 0; i < 4; i++) records[i].intersectionTime = DEFAULT_END_TIME;
+		progress->finish();
 
-	scene.hitSurface(rays, 0, DEFAULT_END_TIME, &records);
+		if (!config.checkpointPath.empty())
+			saveCheckpoint(true);
+	};
 
-	for (int i = 0; i < 4; i++)
+	//A resumed render first finishes the pass it was saved in, with the pixels picked for it back then
+	bool resumedPass = false;
+
+	if (config.resume)
 	{
-		Vec3 returnColor(0);
+		std::string error;
 
-		if (records[i].intersectionTime == DEFAULT_END_TIME)
+		if (!Checkpoint::read(config.checkpointPath, config, checkpointScene, state, tilesDone, passPixels, accumulation, error))
 		{
-			vecBundle[i] = returnColor;
-			continue;
+			printf("Could not resume from %s: %s\n", config.checkpointPath.c_str(), error.c_str());
+			exit(4);
 		}
 
-		if (records[i].materialID == "")
-		{
-			vecBundle[i] = records[i].surfaceNormal / 2 + 0.5;
-			continue;
-		}
+		resumedPass = true;
+
+		std::cout << "Resuming pass " << state.pass << " with " << std::count(tilesDone.begin(), tilesDone.end(), 1) 
+			<< " of " << tilesDone.size() << " tiles done" << std::endl;
+	}
 
-		const Material* surfaceMat = scene.getMaterial(records[i].materialID);
+	if (!config.progressive)
+	{
+		if (!resumedPass)
+			selectPixels([](int, int) { return true; });
 
-		for (auto* light : scene.getLights())
+		if (config.streamOutput)
 		{
-			const Material* lightMat = scene.getMaterial(light->getMaterialName());
+			startStream();
+			renderPass();
+			finishStream();
+		}
+		else
+			renderPass();
+	}
+	else
+	{
+		//The image of the last pass stays in place unless the new one is complete
+		auto publishImage = [&]() {
+			std::string partPath = config.outputPath + ".part";
 
-			Vec3 lightDir = light->getPosition() - records[i].intersectionPoint;
-			float lightDistance = Mat::magnitude(lightDir);
-			lightDir = Mat::normalize(lightDir);
+			if (!writeImage(partPath) || !replaceFile(partPath, config.outputPath))
+			{
+				printf("Could not write image %s\n", config.outputPath.c_str());
+				std::remove(partPath.c_str());
+				return false;
+			}
 
-			//std::cout << (*light).getPosition().toString() << std::endl; 
+			return true;
+		};
 
-			// diffuse lighting
-			float lDotn = Mat::dot(lightDir, records[i].surfaceNormal);
+		bool imagePublished = false;
 
-			// specular lighting
-			float spec = 0;
+		auto noisy = [&](int x, int y) {
+			return x >= 0 && x < config.width && y >= 0 && y < config.height && 
+				sampleError(accumulation.at(x, y)) > config.adaptiveThreshold;
+		};
 
-			if (lDotn > 0)
-			{
-				Vec3 reflectedLight = Mat::normalize(Mat::reflectOut(lightDir, records[i].surfaceNormal));
-				Vec3 view = Mat::normalize(-rays[i].getDirection());
-				// Vec3 view = Mat::normalize(scene.getCamera().getPosition() - surfaceInfo.intersectionPoint);
+		//The preview takes one sample in each block, filling in for the whole
+		//block. Then every pass doubles the samples of the pixels that are still
+		//noisy, the preview's pixels having one more than the rest.
+		for (;; state.pass++)
+		{
+			long pixelCount;
 
-				if (Mat::dot(reflectedLight, view) > 0 && surfaceMat->shiny != 0)
-					spec = pow(Mat::dot(reflectedLight, view), surfaceMat->shiny);
+			if (resumedPass)
+			{
+				pixelCount = std::count(passPixels.begin(), passPixels.end(), 1);
+				resumedPass = false;
+			}
+			else if (state.pass == 0)
+			{
+				state.samples = 1;
+				pixelCount = selectPixels([](int x, int y) { return x % PREVIEW_BLOCK_DIM == 0 && y % PREVIEW_BLOCK_DIM == 0; });
 			}
 			else
 			{
-				lDotn = 0;
+				if (state.taken >= config.maxSamplesPerPixel || outOfTime())
+					break;
+
+				state.samples = std::min(state.taken == 0 ? samplesPerPixel : state.taken, config.maxSamplesPerPixel - state.taken);
+
+				if (state.taken < PROGRESSIVE_MIN_SAMPLES)
+					pixelCount = selectPixels([](int, int) { return true; });
+				else if (!state.noiseTested)
+				{
+					//An edge can slip between the first samples of a pixel, so the
+					//neighbours of noisy pixels get refined as well this once
+					pixelCount = selectPixels([&](int x, int y) {
+						return noisy(x, y) || noisy(x - 1, y) || noisy(x + 1, y) || noisy(x, y - 1) || noisy(x, y + 1);
+					});
+					state.noiseTested = true;
+				}
+				else
+					pixelCount = selectPixels(noisy);
+
+				if (pixelCount == 0)
+					break;
+
+				std::fill(tilesDone.begin(), tilesDone.end(), 0);
 			}
 
-			Ray shadowRay(records[i].intersectionPoint + records[i].surfaceNormal * 0.0001f, lightDir);
-			rayHit unneeded;
+			renderPass();
+			imagePublished = publishImage();
+
+			std::cout << (state.pass == 0 ? "Preview" : "Pass " + std::to_string(state.pass)) << ": " << pixelCount << " pixels, " 
+				<< state.samples << " samples each, " << std::chrono::duration<double>(std::chrono::system_clock::now() - startTime).count() << "s" 
+				<< (outOfTime() ? ", time budget spent" : "") << std::endl;
+
+			if (state.pass > 0)
+				state.taken += state.samples;
+		}
+
+		//the image of the last pass is what the render leaves
+		if (!imagePublished)
+			exit(6);
+	}
 
-			if (scene.hitSurface(shadowRay, 0, lightDistance, &unneeded))
+	for (int i = 0; i < pool.getThreadCount(); i++)
+	{
+		std::cout << "Thread " << i << ": " << scheduler.getBusyTime(i) << "s busy, " 
+			<< scheduler.getTilesRendered(i) << " tiles, " << scheduler.getTilesStolen(i) << " stolen" << std::endl;
+	}
+
+	if (config.maxSamplesPerPixel > config.samplesPerPixel)
+	{
+		long totalSamples = 0;
+
+		for (int y = 0; y < config.height; y++)
+		{
+			for (int x = 0; x < config.width; x++)
 			{
-				lDotn = 0;
-				spec = 0;
+				totalSamples += accumulation.at(x, y).sampleCount;
 			}
+		}
 
-			Vec3 surfaceColor(0);
+		std::cout << (config.progressive ? "Progressive rendering: " : "Adaptive sampling: ") 
+			<< static_cast<double>(totalSamples) / (config.width * config.height) << " samples per pixel on average" << std::endl;
+	}
 
-			surfaceColor += surfaceMat->amb * lightMat->amb;
+	if (sceneLoader.getGeometryCache())
+	{
+		geometryCacheStats cacheStats = sceneLoader.getGeometryCache()->getStats();
 
-			surfaceColor += surfaceMat->diff * lightMat->diff * lDotn;
+		printf("Geometry cache: %lld chunk loads, %lld hits, %lld evictions, %.2f MB at most\n", cacheStats.loads,
+			cacheStats.hits, cacheStats.evictions, cacheStats.peakBytes / (1024.0 * 1024.0));
+	}
 
-			surfaceColor += surfaceMat->spec * surfaceMat->spec * spec;
+	PeakMemory::report("rendering");
 
-			returnColor += surfaceColor;
-		}
+	std::cout << std::chrono::duration<double>(std::chrono::system_clock::now() - startTime).count() << std::endl;
+
+	if (!config.progressive && !config.streamOutput && !writeImage(config.outputPath))
+	{
+		printf("Could not write image %s\n", config.outputPath.c_str());
+		exit(6);
+	}
 
-		if (surfaceMat->reflect > 0 && currentDepth <= REFLECTION_DEPTH_LIMIT)
+	if (!config.heatmapPath.empty())
+	{
+		//black through red and yellow to white at the most samples a pixel can get
+		pool.parallelFor(0, config.height, 16, [&outputBuffer, &accumulation, &config](int firstRow, int endRow)
 		{
-			Ray reflectedRay(records[i].intersectionPoint + records[i].surfaceNormal * 0.0001f, 
-				Mat::reflectIn(rays[i].getDirection(), records[i].surfaceNormal));
+			for (int y = firstRow; y < endRow; y++)
+			{
+				for (int x = 0; x < config.width; x++)
+				{
+					float heat = 3.0f * accumulation.at(x, config.height - 1 - y).sampleCount / config.maxSamplesPerPixel;
+					Vec3 c;
 
-			Vec3 reflectColor = traceRay(scene, reflectedRay, currentDepth + 1);
+					for (int i = 0; i < 3; i++)
+					{
+						c[i] = std::min(1.0f, std::max(0.0f, heat - i));
+					}
 
-			returnColor = returnColor * (1 - surfaceMat->reflect) + reflectColor * surfaceMat->reflect;
-		}
+					outputBuffer.at(x, y) = static_cast<Color>(c * 255);
+				}
+			}
+		});
 
-		vecBundle[i] = returnColor;
+		if (simplePNG_write_parallel(config.heatmapPath.c_str(), outputBuffer.getWidth(), outputBuffer.getHeight(), (unsigned char*)&outputBuffer.at(0,0), 
+			config.pngLevel, ThreadPool::executor, &pool) != 0)
+		{
+			printf("Could not write heatmap %s\n", config.heatmapPath.c_str());
+			exit(6);
+		}
 	}
+
+	PeakMemory::report("encoding");
+
+	return 0;
 }
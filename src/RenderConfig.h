@@ -0,0 +1,370 @@
+#ifndef _RENDER_CONFIG_H
+#define _RENDER_CONFIG_H
+
+#include "HDRImage.h"
+#include "PixelSampler.h"
+#include "ProgressReporter.h"
+#include "TileScheduler.h"
+#include "ToneMapper.h"
+
+#include "libs/simplePNG.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#define DEFAULT_RESX 400
+#define DEFAULT_RESY 400
+// horizontal field of view in degrees
+#define DEFAULT_FOV 90
+#define DEFAULT_REFLECTION_DEPTH 8
+// side length in pixels of the tiles handed out to the render threads
+#define DEFAULT_TILE_DIM 32
+// relative standard error of a pixel's mean luminance below which adaptive sampling stops
+#define DEFAULT_ADAPTIVE_THRESHOLD 0.02f
+// samples per pixel progressive rendering stops at unless told otherwise
+#define DEFAULT_PROGRESSIVE_MAX_SAMPLES 1024
+// seconds between checkpoints while rendering
+#define DEFAULT_CHECKPOINT_INTERVAL 60
+// memory the chunks of an out of core scene are cached in
+#define DEFAULT_GEOMETRY_CACHE_MB 1024
+
+// Everything about a render that can be chosen on the command line
+struct renderConfig
+{
+    std::string inputPath;
+    std::string outputPath;
+    // from the extension of outputPath, pfm and exr files get the colours unscaled as floats
+    ImageFormat outputFormat;
+
+    int width;
+    int height;
+    float fov;
+    // reflections stop being traced once a path is deeper than this
+    int maxDepth;
+
+    int samplesPerPixel;
+    SamplePattern samplePattern;
+    PixelFilter pixelFilter;
+
+    // Adaptive sampling is on if this is above samplesPerPixel. Pixels then get
+    // more batches of samplesPerPixel samples while their error is above
+    // adaptiveThreshold, up to this many samples.
+    int maxSamplesPerPixel;
+    float adaptiveThreshold;
+    // png showing the number of samples of each pixel, none if empty
+    std::string heatmapPath;
+
+    // Progressive rendering traces a low resolution preview and then passes of
+    // growing sample counts over the whole image, writing the image after each
+    // one. It stops at maxSamplesPerPixel, once every pixel is below
+    // adaptiveThreshold or once timeBudget seconds have passed, if above 0.
+    bool progressive;
+    float timeBudget;
+
+    // File the render is saved to every checkpointInterval seconds and after
+    // every pass, none if empty. With resume, the render carries on from it.
+    std::string checkpointPath;
+    float checkpointInterval;
+    bool resume;
+
+    int geometryCacheMegabytes;
+
+    // png compression level, 0 only stores the pixels and 9 compresses the most.
+    // Exr files are run length encoded unless it is 0.
+    int pngLevel;
+    // Writes the png while rendering, as soon as the rows from the top down are
+    // done. The brightest colour is only known at the end, so max tone mapping
+    // clips colours at 1 instead of scaling by it.
+    bool streamOutput;
+
+    // How pngs are tone mapped, and what the colours are multiplied by before
+    // all but max mapping
+    ToneOperator toneOperator;
+    float exposure;
+
+    unsigned int threads;
+    int tileSize;
+    TileOrder tileOrder;
+    ProgressFormat progressFormat;
+
+    renderConfig();
+
+    // Parses "input output [options]", prints the usage and exits on a bad command line
+    static renderConfig fromArgs(int argc, char **argv);
+
+private:
+    static void usage(const char *program);
+    static int parseInt(const std::string &arg, const std::string &value, int minimum);
+    static float parseFloat(const std::string &arg, const std::string &value);
+};
+
+renderConfig::renderConfig()
+    : outputFormat(IMAGE_FORMAT_PNG), width(DEFAULT_RESX), height(DEFAULT_RESY), fov(DEFAULT_FOV), maxDepth(DEFAULT_REFLECTION_DEPTH),
+    samplesPerPixel(1), samplePattern(SAMPLE_PATTERN_R2), pixelFilter(PIXEL_FILTER_BOX),
+    maxSamplesPerPixel(0), adaptiveThreshold(DEFAULT_ADAPTIVE_THRESHOLD), progressive(false), timeBudget(0),
+    checkpointInterval(DEFAULT_CHECKPOINT_INTERVAL), resume(false),
+    geometryCacheMegabytes(DEFAULT_GEOMETRY_CACHE_MB), pngLevel(SIMPLE_PNG_DEFAULT_LEVEL), streamOutput(false),
+    toneOperator(TONE_MAP_MAX), exposure(1),
+    threads(1), tileSize(DEFAULT_TILE_DIM), tileOrder(TILE_ORDER_HILBERT), progressFormat(PROGRESS_BAR)
+{
+}
+
+renderConfig renderConfig::fromArgs(int argc, char **argv)
+{
+    renderConfig config;
+
+    //Need at least two arguments (obj input and png output)
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    bool tileOrderGiven = false;
+    bool toneOperatorGiven = false;
+
+    config.inputPath = argv[1];
+    config.outputPath = argv[2];
+    config.outputFormat = HDRImage::formatOf(config.outputPath);
+
+    for (int i = 3; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        std::string value = arg.substr(std::min<size_t>(2, arg.size()));
+        tileOrderGiven |= arg.find("-o") == 0;
+        toneOperatorGiven |= arg.find("-l") == 0;
+
+        //before -r and -s, which would take them for a resolution and a sample count
+        if (arg == "-resume")
+            config.resume = true;
+        else if (arg == "-stream")
+            config.streamOutput = true;
+        else if (arg.find("-r") == 0)
+        {
+            size_t separator = value.find('x');
+
+            if (separator == std::string::npos)
+            {
+                printf("Resolution has to be given as -rWIDTHxHEIGHT, got %s\n", argv[i]);
+                exit(1);
+            }
+
+            config.width = parseInt(arg, value.substr(0, separator), 1);
+            config.height = parseInt(arg, value.substr(separator + 1), 1);
+        }
+        else if (arg.find("-f") == 0)
+        {
+            config.fov = parseInt(arg, value, 1);
+
+            if (config.fov >= 180)
+            {
+                printf("Field of view has to be below 180 degrees, got %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (arg.find("-d") == 0)
+            config.maxDepth = parseInt(arg, value, 0);
+        else if (arg.find("-s") == 0)
+            config.samplesPerPixel = parseInt(arg, value, 1);
+        else if (arg.find("-m") == 0)
+            config.maxSamplesPerPixel = parseInt(arg, value, 1);
+        else if (arg.find("-e") == 0)
+            config.adaptiveThreshold = parseFloat(arg, value);
+        else if (arg.find("-h") == 0 && arg.size() > 2)
+            config.heatmapPath = value;
+        else if (arg == "-progressive")
+            config.progressive = true;
+        else if (arg.find("-b") == 0)
+        {
+            config.timeBudget = parseFloat(arg, value);
+            config.progressive = true;
+        }
+        else if (arg == "-ar2")
+            config.samplePattern = SAMPLE_PATTERN_R2;
+        else if (arg == "-astratified")
+            config.samplePattern = SAMPLE_PATTERN_STRATIFIED;
+        else if (arg == "-kbox")
+            config.pixelFilter = PIXEL_FILTER_BOX;
+        else if (arg == "-kgaussian")
+            config.pixelFilter = PIXEL_FILTER_GAUSSIAN;
+        else if (arg.find("-c") == 0 && arg.size() > 2)
+            config.checkpointPath = value;
+        else if (arg.find("-i") == 0)
+            config.checkpointInterval = parseFloat(arg, value);
+        else if (arg.find("-g") == 0)
+            config.geometryCacheMegabytes = parseInt(arg, value, 1);
+        else if (arg.find("-z") == 0)
+        {
+            config.pngLevel = parseInt(arg, value, 0);
+
+            if (config.pngLevel > 9)
+            {
+                printf("Compression level has to be 9 at most, got %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (arg == "-lmax")
+            config.toneOperator = TONE_MAP_MAX;
+        else if (arg == "-lreinhard")
+            config.toneOperator = TONE_MAP_REINHARD;
+        else if (arg == "-laces")
+            config.toneOperator = TONE_MAP_ACES;
+        else if (arg == "-lexposure")
+            config.toneOperator = TONE_MAP_EXPOSURE;
+        else if (arg.find("-x") == 0)
+            config.exposure = parseFloat(arg, value);
+        else if (arg.find("-j") == 0)
+            config.threads = std::min(std::thread::hardware_concurrency(), static_cast<unsigned int>(parseInt(arg, value, 1)));
+        else if (arg.find("-t") == 0)
+        {
+            //Bundles and packets are traced in 2x2 quads, so tiles have to be even
+            config.tileSize = parseInt(arg, value, 2);
+            config.tileSize += config.tileSize % 2;
+        }
+        else if (arg == "-oscanline")
+            config.tileOrder = TILE_ORDER_SCANLINE;
+        else if (arg == "-otopdown")
+            config.tileOrder = TILE_ORDER_TOP_DOWN;
+        else if (arg == "-omorton")
+            config.tileOrder = TILE_ORDER_MORTON;
+        else if (arg == "-ohilbert")
+            config.tileOrder = TILE_ORDER_HILBERT;
+        else if (arg == "-pbar")
+            config.progressFormat = PROGRESS_BAR;
+        else if (arg == "-pmachine")
+            config.progressFormat = PROGRESS_MACHINE;
+        else if (arg == "-pnone")
+            config.progressFormat = PROGRESS_NONE;
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (config.resume && config.checkpointPath.empty())
+    {
+        printf("Resuming needs the checkpoint file given with -c\n");
+        exit(1);
+    }
+
+    if (config.streamOutput && config.progressive)
+    {
+        printf("Progressive rendering rewrites the whole image after every pass, it can't be streamed\n");
+        exit(1);
+    }
+
+    if (config.streamOutput && config.outputFormat != IMAGE_FORMAT_PNG)
+    {
+        printf("Only png output can be streamed\n");
+        exit(1);
+    }
+
+    //max tone mapping scales by the brightest colour of the whole image, which
+    //isn't known while rows are being written
+    if (config.streamOutput && config.toneOperator == TONE_MAP_MAX)
+    {
+        if (toneOperatorGiven)
+        {
+            printf("Max tone mapping needs the whole image, streamed pngs can use -lreinhard, -laces or -lexposure\n");
+            exit(1);
+        }
+
+        config.toneOperator = TONE_MAP_REINHARD;
+        printf("Streaming the png with reinhard tone mapping\n");
+    }
+
+    //rows can only be written once every tile above them is done
+    if (config.streamOutput && !tileOrderGiven)
+        config.tileOrder = TILE_ORDER_TOP_DOWN;
+
+    // hardware_concurrency is allowed to return 0 if it doesn't know
+    config.threads = std::max(1U, config.threads);
+
+    if (config.progressive && config.maxSamplesPerPixel == 0)
+        config.maxSamplesPerPixel = DEFAULT_PROGRESSIVE_MAX_SAMPLES;
+
+    config.maxSamplesPerPixel = std::max(config.maxSamplesPerPixel, config.samplesPerPixel);
+
+    return config;
+}
+
+void renderConfig::usage(const char *program)
+{
+    printf("Usage: %s input.obj|input.scene output.png|output.pfm|output.exr [options]\n", program);
+    printf("  -rWxH          resolution, default %dx%d\n", DEFAULT_RESX, DEFAULT_RESY);
+    printf("  -fdegrees      horizontal field of view, default %d\n", DEFAULT_FOV);
+    printf("  -ddepth        reflection depth limit, default %d\n", DEFAULT_REFLECTION_DEPTH);
+    printf("  -sn            samples per pixel, default 1\n");
+    printf("  -mn            adaptive sampling up to n samples per pixel, off by default\n");
+    printf("  -eerror        adaptive sampling error threshold, default %g\n", DEFAULT_ADAPTIVE_THRESHOLD);
+    printf("  -hpath         write a heatmap of the samples per pixel to path\n");
+    printf("  -progressive   render in passes of growing sample counts, up to -m (default %d) or -e\n", DEFAULT_PROGRESSIVE_MAX_SAMPLES);
+    printf("  -bseconds      progressive rendering with a time budget\n");
+    printf("  -ar2|-astratified              sample pattern, default r2\n");
+    printf("  -kbox|-kgaussian               pixel filter, default box\n");
+    printf("  -cpath         save checkpoints of the render to path\n");
+    printf("  -iseconds      time between checkpoints, default %d\n", DEFAULT_CHECKPOINT_INTERVAL);
+    printf("  -resume        carry on with the render saved in the checkpoint\n");
+    printf("  -gmegabytes    memory for the geometry of chunked scene files, default %d\n", DEFAULT_GEOMETRY_CACHE_MB);
+    printf("  -zlevel        png compression level from 0 (none) to 9, default %d, exr files are run length encoded above 0\n", SIMPLE_PNG_DEFAULT_LEVEL);
+    printf("  -stream        write the png while rendering, tone mapped with reinhard unless -l says otherwise\n");
+    printf("  -lmax|-lreinhard|-laces|-lexposure  png tone mapping, default max, or reinhard with -stream\n");
+    printf("  -xscale        exposure the colours are multiplied by before tone mapping other than max, default 1\n");
+    printf("  -jn            number of threads, default 1\n");
+    printf("  -tsize         tile size in pixels, default %d\n", DEFAULT_TILE_DIM);
+    printf("  -oscanline|-otopdown|-omorton|-ohilbert  tile order, default hilbert or topdown with -stream\n");
+    printf("  -pbar|-pmachine|-pnone         progress output, default bar\n");
+}
+
+int renderConfig::parseInt(const std::string &arg, const std::string &value, int minimum)
+{
+    size_t parsed = 0;
+    int result = 0;
+
+    try
+    {
+        result = std::stoi(value, &parsed);
+    }
+    catch (std::exception &e)
+    {
+        parsed = 0;
+    }
+
+    if (parsed == 0 || parsed != value.size() || result < minimum)
+    {
+        printf("Bad value in option %s, expected a whole number of at least %d\n", arg.c_str(), minimum);
+        exit(1);
+    }
+
+    return result;
+}
+
+float renderConfig::parseFloat(const std::string &arg, const std::string &value)
+{
+    size_t parsed = 0;
+    float result = 0;
+
+    try
+    {
+        result = std::stof(value, &parsed);
+    }
+    catch (std::exception &e)
+    {
+        parsed = 0;
+    }
+
+    if (parsed == 0 || parsed != value.size() || !(result > 0))
+    {
+        printf("Bad value in option %s, expected a number above 0\n", arg.c_str());
+        exit(1);
+    }
+
+    return result;
+}
+
+#endif
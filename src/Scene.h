@@ -3,12 +3,17 @@
 
 #include "BVHTree.h"
 #include "Camera.h"
+#include "GeometryCache.h"
 #include "Light.h"
 #include "Material.h"
+#include "RayStream.h"
 #include "Surface.h"
+#include "ThreadPool.h"
+#include "Triangle.h"
 
-#include <string>
-#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <utility>
 #include <vector>
 
 class Scene
@@ -16,27 +21,62 @@ class Scene
 private:
     //Camera camera;
     std::vector<Light*> lights;
-    std::unordered_map<std::string, Material*> materials;
+    // materials in ID order until the scene is finalized
+    std::vector<Material*> materials;
+    // dense table indexed by the materialID stored in surfaces, lights and hit records
+    std::vector<Material> materialTable;
+    // surfaces added one at a time, owned by the scene
     std::vector<Surface*> surfaces;
+    // triangles of the meshes, stored back to back rather than allocated one by one
+    std::vector<Triangle> triangles;
 
     BVHTree* sceneTree;
 
+    // the cache of the chunks in the tree, if the scene is out of core
+    GeometryCache *geometryCache = nullptr;
+
+    // surfaces in the order the tree is built from
+    std::vector<Surface*> treeSurfaces();
+
 public:
     Scene() = default;
     ~Scene();
 
     void addLight(Light*);
     void addSurface(Surface*);
-    void addMaterial(Material*);
+    // Adds the triangles made of the vertices at triangleVertices, three per triangle,
+    // from positions holding x, y and z of each vertex
+    void addMesh(const float *positions, const int *triangleVertices, const int *materialIDs, int triangleCount);
+    int addMaterial(Material*);
 
-    void finalizeScene();
+    // Builds the tree over the surfaces, or takes the flattened nodes of one built
+    // from the same surfaces before if they are given
+    void finalizeScene(ThreadPool &pool, const BVHFlatNode *flatTree = nullptr);
+    std::vector<BVHFlatNode> flattenTree();
+
+    // The cache the chunks added to an out of core scene are read through
+    void setGeometryCache(GeometryCache *cache);
 
     std::vector<Light*>& getLights();
-    const Material* getMaterial(std::string name);
+    BoundingBox getBounds();
+    const Material* getMaterial(int materialID);
 
     bool hitSurface(Ray ray, float startTime, float endTime, rayHit *record);
-    void hitSurface(rayBundle rays, float startTime, float endTime, hitBundle *records);
+    void hitSurface(rayBundle rays, float startTime, float endTime, hitBundle *records, int laneMask = 0xF);
+    void hitSurface(rayBundle rays, float startTime, const float endTimes[4], hitBundle *records, int laneMask = 0xF);
+    void hitSurface(rayPacket &packet, float startTime, float endTime);
+
+    bool occluded(Ray ray, float startTime, float endTime);
+    int occluded(rayBundle rays, float startTime, const float endTimes[4], int laneMask = 0xF);
+    void occluded(rayPacket &packet, float startTime);
 
+    // Closest hits of every ray of a stream, written to records. In an out of
+    // core scene the rays reaching each chunk are queued, and the chunk is then
+    // traced for all of them at once.
+    void hitSurface(const rayStream &rays, float startTime, rayHit *records);
+    // Whether each ray of the stream is blocked before its end time, chunks
+    // being traced for their queued rays like above
+    void occluded(const rayStream &rays, float startTime, char *occludedRays);
 };
 
 Scene::~Scene()
@@ -46,9 +86,14 @@ Scene::~Scene()
         delete light;
     }
 
-    for (auto pair : this->materials)
+    for (auto *mat : this->materials)
+    {
+        delete mat;
+    }
+
+    for (auto *surf : this->surfaces)
     {
-        delete pair.second;
+        delete surf;
     }
 
     delete sceneTree;
@@ -64,17 +109,67 @@ void Scene::addSurface(Surface* surf)
     this->surfaces.push_back(surf);
 }
 
-void Scene::addMaterial(Material* mat)
+void Scene::addMesh(const float *positions, const int *triangleVertices, const int *materialIDs, int triangleCount)
+{
+    this->triangles.reserve(this->triangles.size() + triangleCount);
+
+    for (int i = 0; i < triangleCount; i++)
+    {
+        Vec3 a(positions + 3 * triangleVertices[3 * i]);
+        Vec3 b(positions + 3 * triangleVertices[3 * i + 1]);
+        Vec3 c(positions + 3 * triangleVertices[3 * i + 2]);
+
+        this->triangles.push_back(Triangle(a, b, c, materialIDs[i]));
+    }
+}
+
+int Scene::addMaterial(Material* mat)
+{
+    this->materials.push_back(mat);
+    return this->materials.size() - 1;
+}
+
+void Scene::finalizeScene(ThreadPool &pool, const BVHFlatNode *flatTree)
 {
     //I think this should work because all of the internal arrays are explicit arrays and not dynamically allocated?
-    this->materials[mat->name] = mat;
+    this->materialTable.clear();
+    for (auto *mat : this->materials)
+    {
+        this->materialTable.push_back(*mat);
+        delete mat;
+    }
+    this->materials.clear();
+
+    std::vector<Surface*> treeSurfaces = this->treeSurfaces();
+
+    if (flatTree)
+        this->sceneTree = new BVHTree(treeSurfaces, flatTree);
+    else
+        this->sceneTree = new BVHTree(treeSurfaces, pool);
 }
 
-void Scene::finalizeScene()
+std::vector<BVHFlatNode> Scene::flattenTree()
 {
-    this->sceneTree = new BVHTree(this->surfaces);
-    this->surfaces.clear();
-    this->surfaces.resize(0);
+    return this->sceneTree->flatten(this->treeSurfaces());
+}
+
+// the triangles don't move once the scene is finalized, so the tree can point into them
+std::vector<Surface*> Scene::treeSurfaces()
+{
+    std::vector<Surface*> treeSurfaces(this->surfaces);
+    treeSurfaces.reserve(this->surfaces.size() + this->triangles.size());
+
+    for (auto &triangle : this->triangles)
+    {
+        treeSurfaces.push_back(&triangle);
+    }
+
+    return treeSurfaces;
+}
+
+void Scene::setGeometryCache(GeometryCache *cache)
+{
+    this->geometryCache = cache;
 }
 
 std::vector<Light*>& Scene::getLights()
@@ -82,9 +177,14 @@ std::vector<Light*>& Scene::getLights()
     return this->lights;
 }
 
-const Material* Scene::getMaterial(std::string name)
+BoundingBox Scene::getBounds()
 {
-    return this->materials[name];
+    return this->sceneTree->getBounds();
+}
+
+const Material* Scene::getMaterial(int materialID)
+{
+    return &this->materialTable[materialID];
 }
 
 bool Scene::hitSurface(Ray ray, float startTime, float endTime, rayHit *record)
@@ -92,9 +192,202 @@ bool Scene::hitSurface(Ray ray, float startTime, float endTime, rayHit *record)
     return this->sceneTree->hit(ray, startTime, endTime, record);
 }
 
-void Scene::hitSurface(rayBundle rays, float startTime, float endTime, hitBundle *records)
+void Scene::hitSurface(rayBundle rays, float startTime, float endTime, hitBundle *records, int laneMask)
+{
+    this->sceneTree->hit(rays, startTime, endTime, records, laneMask);
+}
+
+void Scene::hitSurface(rayBundle rays, float startTime, const float endTimes[4], hitBundle *records, int laneMask)
+{
+    this->sceneTree->hit(rays, startTime, endTimes, records, laneMask);
+}
+
+void Scene::hitSurface(rayPacket &packet, float startTime, float endTime)
+{
+    this->sceneTree->hit(packet, startTime, endTime);
+}
+
+bool Scene::occluded(Ray ray, float startTime, float endTime)
+{
+    return this->sceneTree->occluded(ray, startTime, endTime);
+}
+
+int Scene::occluded(rayBundle rays, float startTime, const float endTimes[4], int laneMask)
+{
+    return this->sceneTree->occluded(rays, startTime, endTimes, laneMask);
+}
+
+void Scene::occluded(rayPacket &packet, float startTime)
+{
+    this->sceneTree->occluded(packet, startTime);
+}
+
+// Fills a bundle with up to four rays of the stream from first on, the last one
+// being repeated past the end. Returns the lanes that hold one of them.
+static int streamBundle(const rayStream &rays, int first, rayBundle &bundle, float endTimes[4])
 {
-    this->sceneTree->hit(rays, startTime, endTime, records);
+    int laneMask = 0;
+
+    rays.getBundle(first, bundle);
+
+    for (int j = 0; j < 4; j++)
+    {
+        endTimes[j] = rays.endTime[std::min(first + j, rays.size() - 1)];
+        laneMask |= first + j < rays.size() ? 1 << j : 0;
+    }
+
+    return laneMask;
+}
+
+void Scene::hitSurface(const rayStream &rays, float startTime, rayHit *records)
+{
+    ChunkRayQueue queue;
+
+    if (this->geometryCache)
+        queue.start();
+
+    for (int i = 0; i < rays.size(); i += 4)
+    {
+        rayBundle bundle;
+        hitBundle hits;
+        float endTimes[4];
+        int laneMask = streamBundle(rays, i, bundle, endTimes);
+
+        if (this->geometryCache)
+        {
+            // queued rays have to be told apart, so they go through the tree one at a time
+            for (int j = 0; laneMask & (1 << j); j++)
+            {
+                queue.setRay(i + j);
+                this->sceneTree->hit(bundle[j], startTime, endTimes[j], records + i + j);
+            }
+
+            continue;
+        }
+
+        this->sceneTree->hit(bundle, startTime, endTimes, &hits, laneMask);
+
+        for (int j = 0; laneMask & (1 << j); j++)
+        {
+            records[i + j] = hits[j];
+        }
+    }
+
+    queue.stop();
+
+    const std::vector<std::pair<int, int>> &queued = queue.byChunk();
+
+    for (size_t first = 0, end; first < queued.size(); first = end)
+    {
+        int chunk = queued[first].first;
+
+        for (end = first; end < queued.size() && queued[end].first == chunk; end++);
+
+        std::shared_ptr<const geometryChunk> data = this->geometryCache->acquire(chunk);
+
+        // four rays at a time, each only looking for hits closer than the one it has
+        for (size_t k = first; k < end; k += 4)
+        {
+            rayBundle bundle;
+            hitBundle hits;
+            float endTimes[4];
+            int laneMask = 0;
+
+            for (int j = 0; j < 4; j++)
+            {
+                int ray = queued[std::min(k + j, end - 1)].second;
+
+                bundle[j] = rays.getRay(ray);
+                endTimes[j] = records[ray].intersectionTime;
+                laneMask |= k + j < end ? 1 << j : 0;
+            }
+
+            data->tree->hit(bundle, startTime, endTimes, &hits, laneMask);
+
+            for (int j = 0; laneMask & (1 << j); j++)
+            {
+                if (hits[j].intersectionTime < endTimes[j])
+                    records[queued[k + j].second] = hits[j];
+            }
+        }
+    }
+}
+
+void Scene::occluded(const rayStream &rays, float startTime, char *occludedRays)
+{
+    ChunkRayQueue queue;
+
+    if (this->geometryCache)
+        queue.start();
+
+    for (int i = 0; i < rays.size(); i += 4)
+    {
+        rayBundle bundle;
+        float endTimes[4];
+        int laneMask = streamBundle(rays, i, bundle, endTimes);
+        int occludedMask = 0;
+
+        if (this->geometryCache)
+        {
+            for (int j = 0; laneMask & (1 << j); j++)
+            {
+                queue.setRay(i + j);
+                occludedMask |= this->sceneTree->occluded(bundle[j], startTime, endTimes[j]) ? 1 << j : 0;
+            }
+        }
+        else
+            occludedMask = this->sceneTree->occluded(bundle, startTime, endTimes, laneMask);
+
+        for (int j = 0; laneMask & (1 << j); j++)
+        {
+            occludedRays[i + j] = (occludedMask >> j) & 1;
+        }
+    }
+
+    queue.stop();
+
+    const std::vector<std::pair<int, int>> &queued = queue.byChunk();
+
+    for (size_t first = 0, end; first < queued.size(); first = end)
+    {
+        int chunk = queued[first].first;
+        std::vector<int> unblocked;
+
+        // rays that something else already blocks don't need the chunk
+        for (end = first; end < queued.size() && queued[end].first == chunk; end++)
+        {
+            if (!occludedRays[queued[end].second])
+                unblocked.push_back(queued[end].second);
+        }
+
+        if (unblocked.empty())
+            continue;
+
+        std::shared_ptr<const geometryChunk> data = this->geometryCache->acquire(chunk);
+
+        for (size_t k = 0; k < unblocked.size(); k += 4)
+        {
+            rayBundle bundle;
+            float endTimes[4];
+            int laneMask = 0;
+
+            for (int j = 0; j < 4; j++)
+            {
+                int ray = unblocked[std::min(k + j, unblocked.size() - 1)];
+
+                bundle[j] = rays.getRay(ray);
+                endTimes[j] = rays.endTime[ray];
+                laneMask |= k + j < unblocked.size() ? 1 << j : 0;
+            }
+
+            int occludedMask = data->tree->occluded(bundle, startTime, endTimes, laneMask);
+
+            for (int j = 0; laneMask & (1 << j); j++)
+            {
+                occludedRays[unblocked[k + j]] |= (occludedMask >> j) & 1;
+            }
+        }
+    }
 }
 
 #endif
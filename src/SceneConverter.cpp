@@ -0,0 +1,236 @@
+// Converts an obj scene into a binary scene file, which the tracer maps and
+// uses without parsing. The bounding volume hierarchy is built here and stored
+// with it unless -notree is given. With -chunkN the triangles are split into
+// chunks of at most N spatially close triangles, each with a tree of its own,
+// which the tracer only reads once rays reach them.
+
+#include "BVHTree.h"
+#include "Scene.h"
+#include "SceneFile.h"
+#include "SceneLoader.h"
+#include "ThreadPool.h"
+#include "Triangle.h"
+
+#include "libs/Matrix.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+void usage(const char *program)
+{
+	printf("Usage: %s input.obj output.scene [-notree] [-chunkN]\n", program);
+	printf("  -notree   don't store the tree\n");
+	printf("  -chunkN   store the triangles out of core in chunks of up to N triangles\n");
+	exit(1);
+}
+
+// Splits triangles [begin, end) in half along the widest extent of their
+// centroids until every part has at most maxTriangles, appending the bounds
+// of the parts to chunkEnds
+void partition(std::vector<int> &triangles, const std::vector<Vec3> &centroids, int begin, int end,
+	int maxTriangles, std::vector<int> &chunkEnds)
+{
+	if (end - begin <= maxTriangles)
+	{
+		chunkEnds.push_back(end);
+		return;
+	}
+
+	Vec3 min(centroids[triangles[begin]]);
+	Vec3 max(centroids[triangles[begin]]);
+
+	for (int i = begin + 1; i < end; i++)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			min[axis] = std::min(min[axis], centroids[triangles[i]][axis]);
+			max[axis] = std::max(max[axis], centroids[triangles[i]][axis]);
+		}
+	}
+
+	int axis = 0;
+
+	for (int i = 1; i < 3; i++)
+	{
+		if (max[i] - min[i] > max[axis] - min[axis])
+			axis = i;
+	}
+
+	int middle = begin + (end - begin) / 2;
+
+	std::nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end, [&](int a, int b) {
+		return centroids[a][axis] < centroids[b][axis];
+	});
+
+	partition(triangles, centroids, begin, middle, maxTriangles, chunkEnds);
+	partition(triangles, centroids, middle, end, maxTriangles, chunkEnds);
+}
+
+// Gathers the corners and materials of the triangles of a chunk and builds their tree
+sceneChunkData makeChunk(const sceneView &view, const int *triangles, int count, ThreadPool &pool)
+{
+	sceneChunkData chunk;
+	std::vector<Triangle> surfaces;
+	chunk.corners.reserve(9 * count);
+	chunk.materials.reserve(count);
+	surfaces.reserve(count);
+
+	for (int i = 0; i < count; i++)
+	{
+		const int *vertices = view.triangleVertices + 3 * triangles[i];
+
+		for (int j = 0; j < 3; j++)
+		{
+			const float *position = view.positions + 3 * vertices[j];
+			chunk.corners.insert(chunk.corners.end(), position, position + 3);
+		}
+
+		chunk.materials.push_back(view.triangleMaterials[triangles[i]]);
+
+		const float *corners = chunk.corners.data() + 9 * i;
+		surfaces.push_back(Triangle(Vec3(corners), Vec3(corners + 3), Vec3(corners + 6), chunk.materials[i]));
+	}
+
+	std::vector<Surface*> treeSurfaces;
+	treeSurfaces.reserve(count);
+
+	for (auto &triangle : surfaces)
+	{
+		treeSurfaces.push_back(&triangle);
+	}
+
+	BVHTree tree(treeSurfaces, pool);
+	chunk.tree = tree.flatten(treeSurfaces);
+
+	return chunk;
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc < 3)
+		usage(argv[0]);
+
+	bool storeTree = true;
+	int chunkSize = 0;
+
+	for (int i = 3; i < argc; i++)
+	{
+		std::string arg(argv[i]);
+
+		if (arg == "-notree")
+			storeTree = false;
+		else if (arg.find("-chunk") == 0)
+		{
+			const char *value = argv[i] + 6;
+			char *end;
+
+			errno = 0;
+			long size = strtol(value, &end, 10);
+
+			//a chunk has to hold at least one triangle
+			if (*value < '0' || *value > '9' || *end != '\0' || errno == ERANGE || size <= 0 || size > INT_MAX)
+				usage(argv[0]);
+
+			chunkSize = size;
+		}
+		else
+			usage(argv[0]);
+	}
+
+	// hardware_concurrency is allowed to return 0 if it doesn't know
+	ThreadPool pool(std::max(1U, std::thread::hardware_concurrency()));
+
+	auto startTime = std::chrono::steady_clock::now();
+
+	SceneLoader sceneLoader;
+	std::string loadError;
+
+	if (!sceneLoader.load(argv[1], pool, loadError))
+	{
+		printf("Could not load scene file %s: %s\n", argv[1], loadError.c_str());
+		exit(2);
+	}
+
+	sceneView view = sceneLoader.getView();
+
+	if (view.chunkCount > 0)
+	{
+		printf("%s is already split into chunks\n", argv[1]);
+		exit(2);
+	}
+
+	std::vector<sceneChunkData> chunks;
+	int triangleCount = view.triangleCount;
+
+	if (chunkSize > 0 && view.triangleCount > 0)
+	{
+		std::vector<int> triangles(view.triangleCount);
+		std::vector<Vec3> centroids(view.triangleCount);
+
+		for (int i = 0; i < view.triangleCount; i++)
+		{
+			const int *vertices = view.triangleVertices + 3 * i;
+
+			triangles[i] = i;
+			centroids[i] = (Vec3(view.positions + 3 * vertices[0]) + Vec3(view.positions + 3 * vertices[1]) +
+				Vec3(view.positions + 3 * vertices[2])) / 3;
+		}
+
+		std::vector<int> chunkEnds;
+		partition(triangles, centroids, 0, triangles.size(), chunkSize, chunkEnds);
+
+		int chunkBegin = 0;
+
+		for (int chunkEnd : chunkEnds)
+		{
+			chunks.push_back(makeChunk(view, triangles.data() + chunkBegin, chunkEnd - chunkBegin, pool));
+			chunkBegin = chunkEnd;
+		}
+
+		// the triangles live in the chunks only, the tree over the rest is built when rendering
+		view.positions = nullptr;
+		view.vertexCount = 0;
+		view.triangleVertices = nullptr;
+		view.triangleMaterials = nullptr;
+		view.triangleCount = 0;
+		storeTree = false;
+	}
+
+	std::vector<BVHFlatNode> tree;
+
+	if (storeTree)
+	{
+		Scene scene;
+		sceneLoader.buildScene(scene, pool, 0);
+
+		tree = scene.flattenTree();
+		view.tree = tree.data();
+		view.treeNodeCount = tree.size();
+	}
+
+	if (!SceneFile::write(argv[2], view, chunks))
+	{
+		printf("Could not write scene file %s\n", argv[2]);
+		exit(2);
+	}
+
+	std::string layout;
+
+	if (storeTree)
+		layout = " and the tree";
+	else if (!chunks.empty())
+		layout = ", triangles in " + std::to_string(chunks.size()) + " chunks";
+
+	printf("Wrote %s: %d vertices, %d triangles, %d spheres, %d lights, %d materials%s, %fs\n", argv[2],
+		view.vertexCount, triangleCount, view.sphereCount, view.lightCount, view.materialCount, layout.c_str(),
+		std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count());
+
+	return 0;
+}
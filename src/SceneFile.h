@@ -0,0 +1,524 @@
+#ifndef _SCENE_FILE_H
+#define _SCENE_FILE_H
+
+#include "BVHTree.h"
+#include "rayHit.h"
+
+#include "libs/obj_parser.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Starts every scene file, the last three characters being the format version
+#define SCENE_FILE_MAGIC "RTSCN002"
+#define SCENE_FILE_MAGIC_PREFIX_SIZE 5
+#define SCENE_NAME_SIZE 256
+#define SCENE_PATH_SIZE 512
+// Sections start at multiples of this, so the arrays of a mapped file are aligned
+#define SCENE_SECTION_ALIGNMENT 64
+
+struct sceneCamera
+{
+    float position[3];
+    float focus[3];
+    float up[3];
+};
+
+struct sceneMaterial
+{
+    char name[SCENE_NAME_SIZE];
+    char textureFilename[SCENE_PATH_SIZE];
+    float amb[3];
+    float diff[3];
+    float spec[3];
+    double reflect;
+    double refract;
+    double trans;
+    double shiny;
+    double glossy;
+    double refractIndex;
+};
+
+struct sceneSphere
+{
+    float center[3];
+    float equatorNormal[3];
+    float upNormal[3];
+    int32_t materialID;
+};
+
+struct sceneLight
+{
+    float position[3];
+    int32_t materialID;
+};
+
+// Spatially close triangles of an out of core scene, stored with a tree of their
+// own and only read once a ray reaches their bounds
+struct sceneChunk
+{
+    float bounds[6];
+    int32_t triangleCount;
+    int32_t treeNodeCount;
+    // three corners per triangle
+    uint64_t trianglesOffset;
+    uint64_t materialsOffset;
+    uint64_t treeOffset;
+};
+
+// The contents of a chunk, for writing it
+struct sceneChunkData
+{
+    std::vector<float> corners;
+    std::vector<int32_t> materials;
+    std::vector<BVHFlatNode> tree;
+};
+
+// A scene as flat arrays, pointing into a mapped scene file or into the data of
+// the obj loader. Material IDs are indices into materials.
+struct sceneView
+{
+    bool hasCamera;
+    sceneCamera camera;
+
+    const sceneMaterial *materials;
+    int materialCount;
+    const sceneSphere *spheres;
+    int sphereCount;
+    const sceneLight *lights;
+    int lightCount;
+
+    // x, y and z of each vertex
+    const float *positions;
+    int vertexCount;
+    // three vertex indices and a material ID per triangle
+    const int32_t *triangleVertices;
+    const int32_t *triangleMaterials;
+    int triangleCount;
+
+    // Tree over the spheres followed by the triangles, built before. None if null.
+    const BVHFlatNode *tree;
+    int treeNodeCount;
+
+    // Triangles kept on disk, in addition to the ones above
+    const sceneChunk *chunks;
+    int chunkCount;
+};
+
+// Binary scene files, which are mapped into memory and used as they are instead
+// of being parsed. A header with the counts, the camera and the offsets of the
+// sections is followed by the arrays of a sceneView, each starting at a multiple
+// of SCENE_SECTION_ALIGNMENT. Like checkpoints, the arrays are stored as they
+// are in memory, so a file is only read by machines of the same byte order.
+// The sizes, the trees, the material IDs and the vertex indices are checked,
+// those of the chunks once they are read.
+// The chunks of out of core scenes follow the arrays.
+class SceneFile
+{
+private:
+    struct fileHeader
+    {
+        char magic[8];
+        int32_t hasCamera;
+        sceneCamera camera;
+        int32_t materialCount;
+        int32_t sphereCount;
+        int32_t lightCount;
+        int32_t vertexCount;
+        int32_t triangleCount;
+        int32_t treeNodeCount;
+        int32_t chunkCount;
+        uint64_t materialsOffset;
+        uint64_t spheresOffset;
+        uint64_t lightsOffset;
+        uint64_t positionsOffset;
+        uint64_t triangleVerticesOffset;
+        uint64_t triangleMaterialsOffset;
+        uint64_t treeOffset;
+        uint64_t chunksOffset;
+    };
+
+    // the file up to the end of the chunk table, the chunks are left to the geometry cache
+    obj_file_map map;
+    uint64_t fileSize;
+    sceneView view;
+
+    // Reads the header and finds the size of the file, without mapping it
+    static bool readHeader(const std::string &path, fileHeader &header, uint64_t &fileSize, std::string &error);
+
+    // Points data at a section of the mapped file, false if it doesn't fit in the file
+    template<class T>
+    bool section(uint64_t offset, int count, size_t itemSize, const T *&data);
+
+    static uint64_t alignOffset(uint64_t offset);
+    static bool sectionFits(uint64_t offset, uint64_t size, uint64_t fileSize);
+    static bool writeSection(FILE *file, uint64_t &written, uint64_t offset, const void *data, size_t size);
+
+public:
+    SceneFile();
+    ~SceneFile();
+
+    SceneFile(const SceneFile&) = delete;
+    SceneFile& operator=(const SceneFile&) = delete;
+
+    // Whether the file starts like a scene file
+    static bool isSceneFile(const std::string &path);
+
+    // Maps a scene file, failing with a reason in error if it can't be used
+    bool open(const std::string &path, std::string &error);
+    // Unmaps the file, the view is empty afterwards
+    void close();
+
+    const sceneView& getView() const;
+    size_t getFileSize() const;
+
+    // Whether the nodes make up a tree over surfaceCount surfaces, every
+    // interior node's children coming after it so traversal can't loop
+    static bool validTree(const BVHFlatNode *nodes, int nodeCount, int surfaceCount);
+
+    // Whether the ID is one of materialCount materials or NO_MATERIAL_ID
+    static bool validMaterial(int32_t materialID, int materialCount);
+
+    // Writes the view and the contents of its chunks, whose table is made up here
+    static bool write(const std::string &path, const sceneView &view,
+        const std::vector<sceneChunkData> &chunks = std::vector<sceneChunkData>());
+};
+
+SceneFile::SceneFile()
+{
+    this->map.data = NULL;
+    this->map.size = 0;
+    this->fileSize = 0;
+    memset(&this->view, 0, sizeof(this->view));
+}
+
+SceneFile::~SceneFile()
+{
+    this->close();
+}
+
+void SceneFile::close()
+{
+    obj_unmap_file(&this->map);
+
+    this->map.data = NULL;
+    this->map.size = 0;
+    this->fileSize = 0;
+    memset(&this->view, 0, sizeof(this->view));
+}
+
+bool SceneFile::isSceneFile(const std::string &path)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file)
+        return false;
+
+    char magic[8];
+    bool isScene = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, SCENE_FILE_MAGIC, SCENE_FILE_MAGIC_PREFIX_SIZE) == 0;
+
+    fclose(file);
+    return isScene;
+}
+
+bool SceneFile::sectionFits(uint64_t offset, uint64_t size, uint64_t fileSize)
+{
+    return offset % SCENE_SECTION_ALIGNMENT == 0 && offset <= fileSize && size <= fileSize - offset;
+}
+
+template<class T>
+bool SceneFile::section(uint64_t offset, int count, size_t itemSize, const T *&data)
+{
+    data = nullptr;
+
+    if (count < 0 || !sectionFits(offset, static_cast<uint64_t>(count) * itemSize, this->map.size))
+        return false;
+
+    if (count > 0)
+        data = reinterpret_cast<const T*>(this->map.data + offset);
+
+    return true;
+}
+
+bool SceneFile::readHeader(const std::string &path, fileHeader &header, uint64_t &fileSize, std::string &error)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file)
+    {
+        error = "can't open the file";
+        return false;
+    }
+
+    size_t headerSize = fread(&header, 1, sizeof(header), file);
+
+#ifdef _WIN32
+    bool sized = _fseeki64(file, 0, SEEK_END) == 0;
+    fileSize = _ftelli64(file);
+#else
+    bool sized = fseeko(file, 0, SEEK_END) == 0;
+    fileSize = ftello(file);
+#endif
+
+    fclose(file);
+
+    if (headerSize < sizeof(header.magic) || memcmp(header.magic, SCENE_FILE_MAGIC, SCENE_FILE_MAGIC_PREFIX_SIZE) != 0)
+    {
+        error = "not a scene file";
+        return false;
+    }
+
+    if (memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error = "written in another version of the format";
+        return false;
+    }
+
+    if (headerSize < sizeof(header) || !sized)
+    {
+        error = "the file is cut short";
+        return false;
+    }
+
+    return true;
+}
+
+bool SceneFile::open(const std::string &path, std::string &error)
+{
+    fileHeader header;
+
+    if (!readHeader(path, header, this->fileSize, error))
+        return false;
+
+    // Rays only reach some of the chunks, which are read one by one, so only
+    // the arrays and the chunk table in front of them are mapped and read in
+    uint64_t mappedSize = this->fileSize;
+
+    if (header.chunkCount > 0 && header.chunksOffset < this->fileSize)
+        mappedSize = std::min(mappedSize, header.chunksOffset + static_cast<uint64_t>(header.chunkCount) * sizeof(sceneChunk));
+
+    if (!obj_map_file_prefix(&this->map, path.c_str(), mappedSize))
+    {
+        error = "can't open the file";
+        return false;
+    }
+
+    sceneView &view = this->view;
+    view.hasCamera = header.hasCamera != 0;
+    view.camera = header.camera;
+    view.materialCount = header.materialCount;
+    view.sphereCount = header.sphereCount;
+    view.lightCount = header.lightCount;
+    view.vertexCount = header.vertexCount;
+    view.triangleCount = header.triangleCount;
+    view.treeNodeCount = header.treeNodeCount;
+    view.chunkCount = header.chunkCount;
+
+    bool complete = this->section(header.materialsOffset, view.materialCount, sizeof(sceneMaterial), view.materials) &&
+        this->section(header.spheresOffset, view.sphereCount, sizeof(sceneSphere), view.spheres) &&
+        this->section(header.lightsOffset, view.lightCount, sizeof(sceneLight), view.lights) &&
+        this->section(header.positionsOffset, view.vertexCount, 3 * sizeof(float), view.positions) &&
+        this->section(header.triangleVerticesOffset, view.triangleCount, 3 * sizeof(int32_t), view.triangleVertices) &&
+        this->section(header.triangleMaterialsOffset, view.triangleCount, sizeof(int32_t), view.triangleMaterials) &&
+        this->section(header.treeOffset, view.treeNodeCount, sizeof(BVHFlatNode), view.tree) &&
+        this->section(header.chunksOffset, view.chunkCount, sizeof(sceneChunk), view.chunks);
+
+    for (int i = 0; complete && i < view.chunkCount; i++)
+    {
+        const sceneChunk &chunk = view.chunks[i];
+
+        complete = chunk.triangleCount > 0 && chunk.treeNodeCount == 2 * chunk.triangleCount - 1 &&
+            sectionFits(chunk.trianglesOffset, static_cast<uint64_t>(chunk.triangleCount) * 9 * sizeof(float), this->fileSize) &&
+            sectionFits(chunk.materialsOffset, static_cast<uint64_t>(chunk.triangleCount) * sizeof(int32_t), this->fileSize) &&
+            sectionFits(chunk.treeOffset, static_cast<uint64_t>(chunk.treeNodeCount) * sizeof(BVHFlatNode), this->fileSize);
+    }
+
+    if (!complete)
+    {
+        error = "the file is cut short";
+        return false;
+    }
+
+    // a tree that doesn't match the surfaces is left out and built again
+    int surfaceCount = view.sphereCount + view.triangleCount;
+
+    if (view.treeNodeCount != 2 * surfaceCount - 1)
+    {
+        view.tree = nullptr;
+        view.treeNodeCount = 0;
+    }
+
+    if (!validTree(view.tree, view.treeNodeCount, surfaceCount))
+    {
+        error = "the tree is broken";
+        return false;
+    }
+
+    // names and paths are read as C strings
+    for (int i = 0; i < view.materialCount; i++)
+    {
+        if (!memchr(view.materials[i].name, '\0', SCENE_NAME_SIZE) ||
+            !memchr(view.materials[i].textureFilename, '\0', SCENE_PATH_SIZE))
+        {
+            error = "a material name or texture path isn't terminated";
+            return false;
+        }
+    }
+
+    bool materialsValid = true;
+
+    for (int i = 0; i < view.sphereCount; i++)
+        materialsValid &= validMaterial(view.spheres[i].materialID, view.materialCount);
+    for (int i = 0; i < view.lightCount; i++)
+        materialsValid &= validMaterial(view.lights[i].materialID, view.materialCount);
+    for (int i = 0; i < view.triangleCount; i++)
+        materialsValid &= validMaterial(view.triangleMaterials[i], view.materialCount);
+
+    if (!materialsValid)
+    {
+        error = "a material ID is out of range";
+        return false;
+    }
+
+    for (int i = 0; i < 3 * view.triangleCount; i++)
+    {
+        if (view.triangleVertices[i] < 0 || view.triangleVertices[i] >= view.vertexCount)
+        {
+            error = "a vertex index is out of range";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool SceneFile::validTree(const BVHFlatNode *nodes, int nodeCount, int surfaceCount)
+{
+    for (int i = 0; i < nodeCount; i++)
+    {
+        int child = nodes[i].child;
+
+        if (child >= 0 ? child <= i || child >= nodeCount - 1 : -1 - child >= surfaceCount)
+            return false;
+    }
+
+    return true;
+}
+
+bool SceneFile::validMaterial(int32_t materialID, int materialCount)
+{
+    return materialID >= NO_MATERIAL_ID && materialID < materialCount;
+}
+
+const sceneView& SceneFile::getView() const
+{
+    return this->view;
+}
+
+size_t SceneFile::getFileSize() const
+{
+    return this->fileSize;
+}
+
+uint64_t SceneFile::alignOffset(uint64_t offset)
+{
+    return (offset + SCENE_SECTION_ALIGNMENT - 1) / SCENE_SECTION_ALIGNMENT * SCENE_SECTION_ALIGNMENT;
+}
+
+// Pads the file with zeros up to offset, then writes the section
+bool SceneFile::writeSection(FILE *file, uint64_t &written, uint64_t offset, const void *data, size_t size)
+{
+    static const char padding[SCENE_SECTION_ALIGNMENT] = {0};
+
+    if (fwrite(padding, 1, offset - written, file) != offset - written || fwrite(data, 1, size, file) != size)
+        return false;
+
+    written = offset + size;
+    return true;
+}
+
+bool SceneFile::write(const std::string &path, const sceneView &view, const std::vector<sceneChunkData> &chunks)
+{
+    fileHeader header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+    header.hasCamera = view.hasCamera;
+    header.camera = view.camera;
+    header.materialCount = view.materialCount;
+    header.sphereCount = view.sphereCount;
+    header.lightCount = view.lightCount;
+    header.vertexCount = view.vertexCount;
+    header.triangleCount = view.triangleCount;
+    header.treeNodeCount = view.tree ? view.treeNodeCount : 0;
+    header.chunkCount = chunks.size();
+
+    size_t materialsSize = view.materialCount * sizeof(sceneMaterial);
+    size_t spheresSize = view.sphereCount * sizeof(sceneSphere);
+    size_t lightsSize = view.lightCount * sizeof(sceneLight);
+    size_t positionsSize = view.vertexCount * 3 * sizeof(float);
+    size_t triangleVerticesSize = view.triangleCount * 3 * sizeof(int32_t);
+    size_t triangleMaterialsSize = view.triangleCount * sizeof(int32_t);
+    size_t treeSize = header.treeNodeCount * sizeof(BVHFlatNode);
+    size_t chunksSize = chunks.size() * sizeof(sceneChunk);
+
+    header.materialsOffset = alignOffset(sizeof(header));
+    header.spheresOffset = alignOffset(header.materialsOffset + materialsSize);
+    header.lightsOffset = alignOffset(header.spheresOffset + spheresSize);
+    header.positionsOffset = alignOffset(header.lightsOffset + lightsSize);
+    header.triangleVerticesOffset = alignOffset(header.positionsOffset + positionsSize);
+    header.triangleMaterialsOffset = alignOffset(header.triangleVerticesOffset + triangleVerticesSize);
+    header.treeOffset = alignOffset(header.triangleMaterialsOffset + triangleMaterialsSize);
+    header.chunksOffset = alignOffset(header.treeOffset + treeSize);
+
+    std::vector<sceneChunk> chunkTable(chunks.size());
+    uint64_t chunkOffset = header.chunksOffset + chunksSize;
+
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        sceneChunk &entry = chunkTable[i];
+        memset(&entry, 0, sizeof(entry));
+
+        entry.triangleCount = chunks[i].materials.size();
+        entry.treeNodeCount = chunks[i].tree.size();
+        entry.trianglesOffset = alignOffset(chunkOffset);
+        entry.materialsOffset = alignOffset(entry.trianglesOffset + chunks[i].corners.size() * sizeof(float));
+        entry.treeOffset = alignOffset(entry.materialsOffset + chunks[i].materials.size() * sizeof(int32_t));
+        chunkOffset = entry.treeOffset + chunks[i].tree.size() * sizeof(BVHFlatNode);
+
+        // the root of the chunk's tree bounds all of its triangles
+        memcpy(entry.bounds, chunks[i].tree[0].boundingBox, sizeof(entry.bounds));
+    }
+
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file)
+        return false;
+
+    uint64_t written = 0;
+
+    bool complete = writeSection(file, written, 0, &header, sizeof(header)) &&
+        writeSection(file, written, header.materialsOffset, view.materials, materialsSize) &&
+        writeSection(file, written, header.spheresOffset, view.spheres, spheresSize) &&
+        writeSection(file, written, header.lightsOffset, view.lights, lightsSize) &&
+        writeSection(file, written, header.positionsOffset, view.positions, positionsSize) &&
+        writeSection(file, written, header.triangleVerticesOffset, view.triangleVertices, triangleVerticesSize) &&
+        writeSection(file, written, header.triangleMaterialsOffset, view.triangleMaterials, triangleMaterialsSize) &&
+        writeSection(file, written, header.treeOffset, view.tree, treeSize) &&
+        writeSection(file, written, header.chunksOffset, chunkTable.data(), chunksSize);
+
+    for (size_t i = 0; complete && i < chunks.size(); i++)
+    {
+        complete = writeSection(file, written, chunkTable[i].trianglesOffset, chunks[i].corners.data(), chunks[i].corners.size() * sizeof(float)) &&
+            writeSection(file, written, chunkTable[i].materialsOffset, chunks[i].materials.data(), chunks[i].materials.size() * sizeof(int32_t)) &&
+            writeSection(file, written, chunkTable[i].treeOffset, chunks[i].tree.data(), chunks[i].tree.size() * sizeof(BVHFlatNode));
+    }
+
+    return fclose(file) == 0 && complete;
+}
+
+#endif
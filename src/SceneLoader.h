@@ -0,0 +1,283 @@
+#ifndef _SCENE_LOADER_H
+#define _SCENE_LOADER_H
+
+#include "GeometryCache.h"
+#include "Light.h"
+#include "Material.h"
+#include "Scene.h"
+#include "SceneFile.h"
+#include "Sphere.h"
+#include "ThreadPool.h"
+
+#include "libs/Matrix.h"
+#include "libs/objLoader.h"
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Reads the scene to render from an obj file or a binary scene file, told apart
+// by the magic at the start of scene files. An obj scene is turned into the same
+// flat arrays a scene file holds, so both are built and converted alike. The
+// chunks of an out of core scene file are read through a cache as rays need them.
+// Once the scene is built the loaded data can be let go of.
+class SceneLoader
+{
+private:
+    objLoader objData;
+    SceneFile sceneFile;
+
+    // records of the obj scene, the vertices and triangles stay in objData
+    std::vector<sceneMaterial> materials;
+    std::vector<sceneSphere> spheres;
+    std::vector<sceneLight> lights;
+
+    sceneView view;
+    size_t fileSize;
+    std::string path;
+
+    std::unique_ptr<GeometryCache> geometryCache;
+
+    bool loadObj(const std::string &path, ThreadPool &pool, std::string &error);
+
+    static void copyVector(float *to, const float *from);
+
+public:
+    SceneLoader();
+
+    SceneLoader(const SceneLoader&) = delete;
+    SceneLoader& operator=(const SceneLoader&) = delete;
+
+    // Fails with a reason in error if the file can't be read
+    bool load(const std::string &path, ThreadPool &pool, std::string &error);
+
+    const sceneView& getView() const;
+    size_t getFileSize() const;
+
+    // Adds the materials, surfaces and lights to the scene and finalizes it,
+    // taking the stored tree if the file has one. The chunks of the file get
+    // a cache of geometryCacheBytes, owned by the loader.
+    void buildScene(Scene &scene, ThreadPool &pool, size_t geometryCacheBytes);
+
+    // Null unless the scene has chunks
+    GeometryCache* getGeometryCache() const;
+
+    // Frees the parsed or mapped file, the view is empty afterwards. The
+    // geometry cache stays.
+    void release();
+
+    static Material* toMaterial(const sceneMaterial &material);
+};
+
+SceneLoader::SceneLoader()
+    : fileSize(0)
+{
+    memset(&this->view, 0, sizeof(this->view));
+}
+
+bool SceneLoader::load(const std::string &path, ThreadPool &pool, std::string &error)
+{
+    this->path = path;
+
+    if (!SceneFile::isSceneFile(path))
+        return this->loadObj(path, pool, error);
+
+    if (!this->sceneFile.open(path, error))
+        return false;
+
+    this->view = this->sceneFile.getView();
+    this->fileSize = this->sceneFile.getFileSize();
+
+    return true;
+}
+
+bool SceneLoader::loadObj(const std::string &path, ThreadPool &pool, std::string &error)
+{
+    objLoader &obj = this->objData;
+
+    if (!obj.load(path.c_str(), ThreadPool::executor, &pool))
+    {
+        error = "can't read the obj file";
+        return false;
+    }
+
+    // the materials keep their order, so obj material indices are material IDs
+    auto toMaterialID = [](int objMaterialIndex) {
+        return objMaterialIndex < 0 ? NO_MATERIAL_ID : objMaterialIndex;
+    };
+
+    for (int i = 0; i < obj.materialCount; i++)
+    {
+        const obj_material *objMaterial = obj.materialList[i];
+        sceneMaterial material;
+        memset(&material, 0, sizeof(material));
+
+        strncpy(material.name, objMaterial->name, SCENE_NAME_SIZE - 1);
+        strncpy(material.textureFilename, objMaterial->texture_filename, SCENE_PATH_SIZE - 1);
+
+        for (int j = 0; j < 3; j++)
+        {
+            material.amb[j] = objMaterial->amb[j];
+            material.diff[j] = objMaterial->diff[j];
+            material.spec[j] = objMaterial->spec[j];
+        }
+
+        material.reflect = objMaterial->reflect;
+        material.refract = objMaterial->refract;
+        material.trans = objMaterial->trans;
+        material.shiny = objMaterial->shiny;
+        material.glossy = objMaterial->glossy;
+        material.refractIndex = objMaterial->refract_index;
+
+        this->materials.push_back(material);
+    }
+
+    for (int i = 0; i < obj.sphereCount; i++)
+    {
+        sceneSphere sphere;
+        copyVector(sphere.center, obj.vertexList + 3 * obj.sphereList[i]->pos_index);
+        copyVector(sphere.equatorNormal, obj.normalList + 3 * obj.sphereList[i]->equator_normal_index);
+        copyVector(sphere.upNormal, obj.normalList + 3 * obj.sphereList[i]->up_normal_index);
+        sphere.materialID = toMaterialID(obj.sphereList[i]->material_index);
+
+        this->spheres.push_back(sphere);
+    }
+
+    for (int i = 0; i < obj.lightPointCount; i++)
+    {
+        sceneLight light;
+        copyVector(light.position, obj.vertexList + 3 * obj.lightPointList[i]->pos_index);
+        light.materialID = toMaterialID(obj.lightPointList[i]->material_index);
+
+        this->lights.push_back(light);
+    }
+
+    for (int i = 0; i < obj.triangleCount; i++)
+    {
+        obj.triangleMaterialList[i] = toMaterialID(obj.triangleMaterialList[i]);
+    }
+
+    sceneView &view = this->view;
+
+    view.hasCamera = obj.camera != nullptr;
+
+    if (view.hasCamera)
+    {
+        copyVector(view.camera.position, obj.vertexList + 3 * obj.camera->camera_pos_index);
+        copyVector(view.camera.focus, obj.vertexList + 3 * obj.camera->camera_look_point_index);
+        copyVector(view.camera.up, obj.normalList + 3 * obj.camera->camera_up_norm_index);
+    }
+
+    view.materials = this->materials.data();
+    view.materialCount = this->materials.size();
+    view.spheres = this->spheres.data();
+    view.sphereCount = this->spheres.size();
+    view.lights = this->lights.data();
+    view.lightCount = this->lights.size();
+
+    view.positions = obj.vertexList;
+    view.vertexCount = obj.vertexCount;
+    view.triangleVertices = obj.triangleVertexList;
+    view.triangleMaterials = obj.triangleMaterialList;
+    view.triangleCount = obj.triangleCount;
+
+    view.tree = nullptr;
+    view.treeNodeCount = 0;
+
+    this->fileSize = obj.fileSize;
+
+    return true;
+}
+
+const sceneView& SceneLoader::getView() const
+{
+    return this->view;
+}
+
+size_t SceneLoader::getFileSize() const
+{
+    return this->fileSize;
+}
+
+GeometryCache* SceneLoader::getGeometryCache() const
+{
+    return this->geometryCache.get();
+}
+
+void SceneLoader::release()
+{
+    this->objData.release();
+    this->sceneFile.close();
+
+    // clear() would keep the memory
+    std::vector<sceneMaterial>().swap(this->materials);
+    std::vector<sceneSphere>().swap(this->spheres);
+    std::vector<sceneLight>().swap(this->lights);
+
+    memset(&this->view, 0, sizeof(this->view));
+}
+
+void SceneLoader::buildScene(Scene &scene, ThreadPool &pool, size_t geometryCacheBytes)
+{
+    const sceneView &view = this->view;
+
+    for (int i = 0; i < view.materialCount; i++)
+    {
+        scene.addMaterial(toMaterial(view.materials[i]));
+    }
+
+    for (int i = 0; i < view.sphereCount; i++)
+    {
+        const sceneSphere &sphere = view.spheres[i];
+        Vec3 equator(sphere.equatorNormal);
+
+        scene.addSurface(new Sphere(Vec3(sphere.center), equator, Vec3(sphere.upNormal), Mat::magnitude(equator), sphere.materialID));
+    }
+
+    scene.addMesh(view.positions, view.triangleVertices, view.triangleMaterials, view.triangleCount);
+
+    if (view.chunkCount > 0)
+    {
+        this->geometryCache.reset(new GeometryCache(this->path, view.chunks, view.chunkCount, view.materialCount, geometryCacheBytes));
+        scene.setGeometryCache(this->geometryCache.get());
+
+        for (int i = 0; i < view.chunkCount; i++)
+        {
+            scene.addSurface(new ChunkSurface(this->geometryCache.get(), i, view.chunks[i]));
+        }
+    }
+
+    for (int i = 0; i < view.lightCount; i++)
+    {
+        scene.addLight(new Light(Vec3(view.lights[i].position), view.lights[i].materialID));
+    }
+
+    scene.finalizeScene(pool, view.tree);
+}
+
+Material* SceneLoader::toMaterial(const sceneMaterial &material)
+{
+    return new Material{
+        material.name,
+        material.textureFilename,
+        Vec3(material.amb),
+        Vec3(material.diff),
+        Vec3(material.spec),
+        material.reflect,
+        material.refract,
+        material.trans,
+        material.shiny,
+        material.glossy,
+        material.refractIndex
+    };
+}
+
+void SceneLoader::copyVector(float *to, const float *from)
+{
+    to[0] = from[0];
+    to[1] = from[1];
+    to[2] = from[2];
+}
+
+#endif
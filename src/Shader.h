@@ -0,0 +1,451 @@
+#ifndef _SHADER_H
+#define _SHADER_H
+
+#include "Light.h"
+#include "Material.h"
+#include "Ray.h"
+#include "RayPacket.h"
+#include "RayStream.h"
+#include "Scene.h"
+#include "rayHit.h"
+
+#include "libs/Matrix.h"
+
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// Traces rays through a scene and shades what they hit with its lights and
+// reflections, one ray at a time, in bundles of four, in packets or in streams
+class Shader
+{
+private:
+    Scene &scene;
+    // reflections are traced while the depth of a path is at most this
+    int reflectionDepthLimit;
+
+    Vec3 shade(Ray &r, rayHit &surfaceInfo, int currentDepth);
+
+    static void lightingTerms(const Material* surfaceMat, Vec3 lightDir, Vec3 normal, Vec3 rayDirection, float &lDotn, float &spec);
+    static bool prepareLight(Light* light, rayHit &surfaceInfo, const Material* surfaceMat, Vec3 rayDirection,
+        Ray &shadowRay, float &lightDistance, float &lDotn, float &spec);
+    static Vec3 lightColor(const Material* surfaceMat, const Material* lightMat, float lDotn, float spec);
+
+    int prepareBundle(hitBundle &records, int laneMask, Vec3Bundle &vecBundle, const Material* surfaceMats[4]);
+    void reflectBundle(rayBundle &rays, hitBundle &records, const Material* surfaceMats[4], int shadeMask,
+        Vec3Bundle &vecBundle, int currentDepth);
+    void shadeBundle(rayBundle &rays, hitBundle &records, Vec3Bundle &vecBundle, int currentDepth, int laneMask);
+
+public:
+    Shader(Scene &scene, int reflectionDepthLimit);
+
+    Vec3 traceRay(Ray r, int currentDepth = 0);
+
+    // Only the rays whose bit is set in laneMask are traced and written to vecBundle
+    void traceRayBundle(rayBundle rays, Vec3Bundle &vecBundle, int currentDepth = 0, int laneMask = 0xF);
+
+    // Traces a packet of primary rays, shadowPacket being room for its shadow rays
+    void traceRayPacket(rayPacket &packet, rayPacket &shadowPacket, Vec3Bundle *colors);
+
+    // colors is indexed by the rays' pixel and accumulated into
+    void traceRayStream(rayStream &rays, Vec3 *colors);
+};
+
+Shader::Shader(Scene &scene, int reflectionDepthLimit)
+    : scene(scene), reflectionDepthLimit(reflectionDepthLimit)
+{
+}
+
+Vec3 Shader::traceRay(Ray r, int currentDepth)
+{
+    rayHit surfaceInfo;
+
+    if (!this->scene.hitSurface(r, 0, 1000000, &surfaceInfo))
+        return Vec3(0);
+
+    return this->shade(r, surfaceInfo, currentDepth);
+}
+
+void Shader::lightingTerms(const Material* surfaceMat, Vec3 lightDir, Vec3 normal, Vec3 rayDirection, float &lDotn, float &spec)
+{
+    // diffuse lighting
+    lDotn = Mat::dot(lightDir, normal);
+
+    // specular lighting
+    spec = 0;
+
+    if (lDotn > 0)
+    {
+        Vec3 reflectedLight = Mat::normalize(Mat::reflectOut(lightDir, normal));
+        Vec3 view = Mat::normalize(-rayDirection);
+
+        if (Mat::dot(reflectedLight, view) > 0 && surfaceMat->shiny != 0)
+            spec = pow(Mat::dot(reflectedLight, view), surfaceMat->shiny);
+    }
+    else
+    {
+        lDotn = 0;
+    }
+}
+
+// Computes the lighting terms of a light at a hit and the shadow ray that
+// decides whether they apply. Returns false if the point only gets ambient
+// light from it, in which case there is nothing for a shadow to take away.
+bool Shader::prepareLight(Light* light, rayHit &surfaceInfo, const Material* surfaceMat, Vec3 rayDirection,
+    Ray &shadowRay, float &lightDistance, float &lDotn, float &spec)
+{
+    Vec3 lightDir = light->getPosition() - surfaceInfo.intersectionPoint;
+    lightDistance = Mat::magnitude(lightDir);
+    lightDir = Mat::normalize(lightDir);
+
+    lightingTerms(surfaceMat, lightDir, surfaceInfo.surfaceNormal, rayDirection, lDotn, spec);
+
+    if (lDotn == 0 && spec == 0)
+        return false;
+
+    shadowRay = Ray(surfaceInfo.intersectionPoint + surfaceInfo.surfaceNormal * 0.0001f, lightDir);
+    return true;
+}
+
+Vec3 Shader::lightColor(const Material* surfaceMat, const Material* lightMat, float lDotn, float spec)
+{
+    Vec3 surfaceColor(0);
+
+    surfaceColor += surfaceMat->amb * lightMat->amb;
+
+    surfaceColor += surfaceMat->diff * lightMat->diff * lDotn;
+
+    surfaceColor += surfaceMat->spec * surfaceMat->spec * spec;
+
+    return surfaceColor;
+}
+
+Vec3 Shader::shade(Ray &r, rayHit &surfaceInfo, int currentDepth)
+{
+    if (surfaceInfo.materialID == NO_MATERIAL_ID)
+        return surfaceInfo.surfaceNormal / 2 + 0.5;
+
+    const Material* surfaceMat = this->scene.getMaterial(surfaceInfo.materialID);
+
+    Vec3 returnColor(0);
+
+    for (auto* light : this->scene.getLights())
+    {
+        const Material* lightMat = this->scene.getMaterial(light->getMaterialID());
+
+        Ray shadowRay;
+        float lightDistance, lDotn, spec;
+
+        if (prepareLight(light, surfaceInfo, surfaceMat, r.getDirection(), shadowRay, lightDistance, lDotn, spec) &&
+            this->scene.occluded(shadowRay, 0, lightDistance))
+        {
+            lDotn = 0;
+            spec = 0;
+        }
+
+        returnColor += lightColor(surfaceMat, lightMat, lDotn, spec);
+    }
+
+    if (surfaceMat->reflect > 0 && currentDepth <= this->reflectionDepthLimit)
+    {
+        Ray reflectedRay(surfaceInfo.intersectionPoint + surfaceInfo.surfaceNormal * 0.0001f,
+            Mat::reflectIn(r.getDirection(), surfaceInfo.surfaceNormal));
+
+        Vec3 reflectColor = this->traceRay(reflectedRay, currentDepth + 1);
+
+        returnColor = returnColor * (1 - surfaceMat->reflect) + reflectColor * surfaceMat->reflect;
+    }
+
+    return returnColor;
+}
+
+void Shader::traceRayBundle(rayBundle rays, Vec3Bundle &vecBundle, int currentDepth, int laneMask)
+{
+    const float DEFAULT_END_TIME = 1000000;
+
+    hitBundle records;
+
+    this->scene.hitSurface(rays, 0, DEFAULT_END_TIME, &records, laneMask);
+
+    this->shadeBundle(rays, records, vecBundle, currentDepth, laneMask);
+}
+
+// Resolves the lanes of a bundle that missed or have no material, and looks
+// up the materials of the rest. Returns the lanes that still need lighting,
+// their colors are cleared so lights can be added to them.
+int Shader::prepareBundle(hitBundle &records, int laneMask, Vec3Bundle &vecBundle, const Material* surfaceMats[4])
+{
+    const float DEFAULT_END_TIME = 1000000;
+
+    int shadeMask = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(laneMask & (1 << i)))
+            continue;
+
+        if (records[i].intersectionTime == DEFAULT_END_TIME)
+        {
+            vecBundle[i] = Vec3(0);
+            continue;
+        }
+
+        if (records[i].materialID == NO_MATERIAL_ID)
+        {
+            vecBundle[i] = records[i].surfaceNormal / 2 + 0.5;
+            continue;
+        }
+
+        surfaceMats[i] = this->scene.getMaterial(records[i].materialID);
+        vecBundle[i] = Vec3(0);
+        shadeMask |= 1 << i;
+    }
+
+    return shadeMask;
+}
+
+// Traces the reflected rays of all lanes in shadeMask as one bundle and blends them in
+void Shader::reflectBundle(rayBundle &rays, hitBundle &records, const Material* surfaceMats[4], int shadeMask,
+    Vec3Bundle &vecBundle, int currentDepth)
+{
+    rayBundle reflectedRays;
+    int reflectMask = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(shadeMask & (1 << i)))
+            continue;
+
+        if (surfaceMats[i]->reflect > 0 && currentDepth <= this->reflectionDepthLimit)
+        {
+            reflectedRays[i] = Ray(records[i].intersectionPoint + records[i].surfaceNormal * 0.0001f,
+                Mat::reflectIn(rays[i].getDirection(), records[i].surfaceNormal));
+
+            reflectMask |= 1 << i;
+        }
+    }
+
+    if (!reflectMask)
+        return;
+
+    Vec3Bundle reflectColors;
+    this->traceRayBundle(reflectedRays, reflectColors, currentDepth + 1, reflectMask);
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (reflectMask & (1 << i))
+        {
+            float reflect = surfaceMats[i]->reflect;
+            vecBundle[i] = vecBundle[i] * (1 - reflect) + reflectColors[i] * reflect;
+        }
+    }
+}
+
+// Shades the hits of a bundle. The shadow rays toward each light are traced
+// together with the any-hit query, with the lanes that don't need them masked out.
+void Shader::shadeBundle(rayBundle &rays, hitBundle &records, Vec3Bundle &vecBundle, int currentDepth, int laneMask)
+{
+    const Material* surfaceMats[4];
+    int shadeMask = this->prepareBundle(records, laneMask, vecBundle, surfaceMats);
+
+    if (!shadeMask)
+        return;
+
+    for (auto* light : this->scene.getLights())
+    {
+        const Material* lightMat = this->scene.getMaterial(light->getMaterialID());
+
+        rayBundle shadowRays;
+        float lightDistance[4], lDotn[4], spec[4];
+        int shadowMask = 0;
+
+        for (int i = 0; i < 4; i++)
+        {
+            if ((shadeMask & (1 << i)) &&
+                prepareLight(light, records[i], surfaceMats[i], rays[i].getDirection(), shadowRays[i], lightDistance[i], lDotn[i], spec[i]))
+            {
+                shadowMask |= 1 << i;
+            }
+        }
+
+        int occludedMask = shadowMask ? this->scene.occluded(shadowRays, 0, lightDistance, shadowMask) : 0;
+
+        for (int i = 0; i < 4; i++)
+        {
+            if (!(shadeMask & (1 << i)))
+                continue;
+
+            if (occludedMask & (1 << i))
+            {
+                lDotn[i] = 0;
+                spec[i] = 0;
+            }
+
+            vecBundle[i] += lightColor(surfaceMats[i], lightMat, lDotn[i], spec[i]);
+        }
+    }
+
+    this->reflectBundle(rays, records, surfaceMats, shadeMask, vecBundle, currentDepth);
+}
+
+// The shadow rays of every shaded point in the packet toward the same light
+// converge on it, so they are gathered into shadowPacket and traced as one
+// packet with the any-hit query.
+void Shader::traceRayPacket(rayPacket &packet, rayPacket &shadowPacket, Vec3Bundle *colors)
+{
+    const float DEFAULT_END_TIME = 1000000;
+
+    this->scene.hitSurface(packet, 0, DEFAULT_END_TIME);
+
+    const Material* surfaceMats[MAX_PACKET_QUADS][4];
+    int shadeMasks[MAX_PACKET_QUADS];
+    int shadowMasks[MAX_PACKET_QUADS];
+    float lDotn[MAX_PACKET_QUADS][4], spec[MAX_PACKET_QUADS][4];
+
+    for (int q = 0; q < packet.quadCount; q++)
+    {
+        shadeMasks[q] = this->prepareBundle(packet.records[q], packet.laneMasks[q], colors[q], surfaceMats[q]);
+    }
+
+    shadowPacket.width = packet.width;
+    shadowPacket.height = packet.height;
+    shadowPacket.quadCount = packet.quadCount;
+
+    for (auto* light : this->scene.getLights())
+    {
+        const Material* lightMat = this->scene.getMaterial(light->getMaterialID());
+
+        for (int q = 0; q < packet.quadCount; q++)
+        {
+            shadowMasks[q] = 0;
+
+            for (int i = 0; i < 4; i++)
+            {
+                if ((shadeMasks[q] & (1 << i)) &&
+                    prepareLight(light, packet.records[q][i], surfaceMats[q][i], packet.rays[q][i].getDirection(),
+                        shadowPacket.rays[q][i], shadowPacket.records[q][i].intersectionTime, lDotn[q][i], spec[q][i]))
+                {
+                    shadowMasks[q] |= 1 << i;
+                }
+            }
+
+            shadowPacket.laneMasks[q] = shadowMasks[q];
+        }
+
+        this->scene.occluded(shadowPacket, 0);
+
+        for (int q = 0; q < packet.quadCount; q++)
+        {
+            int occludedMask = shadowMasks[q] & ~shadowPacket.laneMasks[q];
+
+            for (int i = 0; i < 4; i++)
+            {
+                if (!(shadeMasks[q] & (1 << i)))
+                    continue;
+
+                if (occludedMask & (1 << i))
+                {
+                    lDotn[q][i] = 0;
+                    spec[q][i] = 0;
+                }
+
+                colors[q][i] += lightColor(surfaceMats[q][i], lightMat, lDotn[q][i], spec[q][i]);
+            }
+        }
+    }
+
+    for (int q = 0; q < packet.quadCount; q++)
+    {
+        this->reflectBundle(packet.rays[q], packet.records[q], surfaceMats[q], shadeMasks[q], colors[q], 0);
+    }
+}
+
+// Traces the stream one bounce at a time instead of recursing per ray. Each
+// bounce is sorted before it is traced, and the shadow and reflection rays it
+// spawns are collected into streams of their own. Out of core chunks are traced
+// once per bounce for all the rays that reach them.
+void Shader::traceRayStream(rayStream &rays, Vec3 *colors)
+{
+    const float DEFAULT_END_TIME = 1000000;
+
+    BoundingBox bounds = this->scene.getBounds();
+    rayStream shadowRays, reflectedRays;
+    std::vector<rayHit> records;
+    std::vector<char> occluded;
+
+    for (int currentDepth = 0; rays.size() > 0; currentDepth++)
+    {
+        rays.sort(bounds);
+        records.resize(rays.size());
+        this->scene.hitSurface(rays, 0, records.data());
+
+        shadowRays.clear();
+        reflectedRays.clear();
+
+        for (int i = 0; i < rays.size(); i++)
+        {
+            rayHit &surfaceInfo = records[i];
+            int pixel = rays.pixel[i];
+
+            if (surfaceInfo.intersectionTime == DEFAULT_END_TIME)
+                continue;
+
+            if (surfaceInfo.materialID == NO_MATERIAL_ID)
+            {
+                colors[pixel] += (surfaceInfo.surfaceNormal / 2 + 0.5) * rays.weight[i];
+                continue;
+            }
+
+            const Material* surfaceMat = this->scene.getMaterial(surfaceInfo.materialID);
+            Ray r = rays.getRay(i);
+
+            bool reflects = surfaceMat->reflect > 0 && currentDepth <= this->reflectionDepthLimit;
+            Vec3 localWeight = reflects ? rays.weight[i] * (1 - surfaceMat->reflect) : rays.weight[i];
+
+            for (auto* light : this->scene.getLights())
+            {
+                const Material* lightMat = this->scene.getMaterial(light->getMaterialID());
+
+                Vec3 lightDir = light->getPosition() - surfaceInfo.intersectionPoint;
+                float lightDistance = Mat::magnitude(lightDir);
+                lightDir = Mat::normalize(lightDir);
+
+                float lDotn, spec;
+                lightingTerms(surfaceMat, lightDir, surfaceInfo.surfaceNormal, r.getDirection(), lDotn, spec);
+
+                // ambient light can't be shadowed, the rest waits for the shadow ray
+                colors[pixel] += surfaceMat->amb * lightMat->amb * localWeight;
+
+                if (lDotn == 0 && spec == 0)
+                    continue;
+
+                Vec3 direct = surfaceMat->diff * lightMat->diff * lDotn + surfaceMat->spec * surfaceMat->spec * spec;
+
+                Ray shadowRay(surfaceInfo.intersectionPoint + surfaceInfo.surfaceNormal * 0.0001f, lightDir);
+                shadowRays.push(shadowRay, lightDistance, pixel, direct * localWeight);
+            }
+
+            if (reflects)
+            {
+                Ray reflectedRay(surfaceInfo.intersectionPoint + surfaceInfo.surfaceNormal * 0.0001f,
+                    Mat::reflectIn(r.getDirection(), surfaceInfo.surfaceNormal));
+
+                reflectedRays.push(reflectedRay, DEFAULT_END_TIME, pixel, rays.weight[i] * surfaceMat->reflect);
+            }
+        }
+
+        shadowRays.sort(bounds);
+        occluded.resize(shadowRays.size());
+        this->scene.occluded(shadowRays, 0, occluded.data());
+
+        for (int i = 0; i < shadowRays.size(); i++)
+        {
+            if (!occluded[i])
+                colors[shadowRays.pixel[i]] += shadowRays.weight[i];
+        }
+
+        std::swap(rays, reflectedRays);
+    }
+}
+
+#endif
@@ -9,7 +9,6 @@
 #include "libs/Matrix.h"
 
 #include <math.h>
-#include <string>
 
 #define VOXEL_SIZE -0.1f
 
@@ -22,7 +21,7 @@ private:
     float radius;
 
 public:
-    Sphere(Vec3 center, Vec3 equatorNormal, Vec3 upNormal, float radius, std::string materialID);
+    Sphere(Vec3 center, Vec3 equatorNormal, Vec3 upNormal, float radius, int materialID);
 
     virtual bool hit(Ray ray, float startTime, rayHit *record);
 
@@ -30,7 +29,7 @@ public:
     virtual BoundingBox getBoundingBox();
 };
 
-Sphere::Sphere(Vec3 center, Vec3 equatorNormal, Vec3 upNormal, float radius, std::string materialID)
+Sphere::Sphere(Vec3 center, Vec3 equatorNormal, Vec3 upNormal, float radius, int materialID)
     : Surface(materialID), center(center), radius(radius)
 {
     this->equatorNormal = Mat::normalize(equatorNormal);
@@ -72,7 +71,7 @@ bool Sphere::hit(Ray ray, float startTime, rayHit *record)
         record->intersectionTime = time;
         record->intersectionPoint = ray.positionAtTime(time);
         record->surfaceNormal = Mat::normalize(record->intersectionPoint - this->center);
-        record->materialID = this->materialName;
+        record->materialID = this->materialID;
         return true;
     }
 
@@ -155,7 +154,7 @@ bool Sphere::hit(Ray ray, float startTime, rayHit *record)
 
     *record = voxelInfo;
     
-    record->materialID = this->materialName;
+    record->materialID = this->materialID;
     
     return true;
 }
@@ -5,15 +5,13 @@
 #include "Ray.h"
 #include "rayHit.h"
 
-#include <string>
-
 class Surface
 {
 protected:
-    std::string materialName;
+    int materialID;
 
 public:
-    Surface(std::string materialID);
+    Surface(int materialID);
     virtual ~Surface() = default;
 
     virtual bool hit(Ray ray, float startTime, rayHit *record) = 0;
@@ -22,8 +20,8 @@ public:
     virtual BoundingBox getBoundingBox() = 0;
 };
 
-Surface::Surface(std::string materialID)
-    : materialName(materialID)
+Surface::Surface(int materialID)
+    : materialID(materialID)
 {}
 
 #endif 
@@ -0,0 +1,164 @@
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads created once and reused by every parallel phase, so
+// short renders don't pay for spawning and joining threads in each of them.
+// The calling thread takes part in the work as thread 0. Calls must not be
+// nested and only one thread may submit work at a time.
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable workReady;
+    std::condition_variable workDone;
+
+    const std::function<void(int)> *task;
+    // bumped for every task, so a worker can tell a new task from a spurious wake up
+    unsigned int generation;
+    int busyWorkers;
+    bool stopping;
+
+    void workerLoop(int thread);
+
+public:
+    // threadCount includes the calling thread
+    ThreadPool(int threadCount);
+    ~ThreadPool();
+
+    int getThreadCount() const;
+
+    // Runs task(thread) once on every thread of the pool and waits for all of them
+    void run(const std::function<void(int)> &task);
+
+    // Splits [begin, end) into chunks of at most grainSize that are handed out to
+    // the threads as they become free, body gets called with each chunk's bounds
+    void parallelFor(int begin, int end, int grainSize, const std::function<void(int, int)> &body);
+
+    // Runs job(0) to job(count - 1) on the pool passed as executorData, for the
+    // C style libraries that take their parallelism as an executor function
+    static void executor(size_t count, void (*job)(size_t, void*), void *context, void *executorData);
+};
+
+ThreadPool::ThreadPool(int threadCount)
+    : task(nullptr), generation(0), busyWorkers(0), stopping(false)
+{
+    for (int i = 1; i < threadCount; i++)
+    {
+        this->workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(this->mutex);
+        this->stopping = true;
+    }
+    this->workReady.notify_all();
+
+    for (auto &worker : this->workers)
+    {
+        worker.join();
+    }
+}
+
+int ThreadPool::getThreadCount() const
+{
+    return this->workers.size() + 1;
+}
+
+void ThreadPool::run(const std::function<void(int)> &task)
+{
+    if (this->workers.empty())
+    {
+        task(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(this->mutex);
+        this->task = &task;
+        this->busyWorkers = this->workers.size();
+        this->generation++;
+    }
+    this->workReady.notify_all();
+
+    task(0);
+
+    std::unique_lock<std::mutex> lk(this->mutex);
+    this->workDone.wait(lk, [this]{ return this->busyWorkers == 0; });
+    this->task = nullptr;
+}
+
+void ThreadPool::parallelFor(int begin, int end, int grainSize, const std::function<void(int, int)> &body)
+{
+    grainSize = std::max(1, grainSize);
+
+    if (end - begin <= grainSize)
+    {
+        if (begin < end)
+            body(begin, end);
+        return;
+    }
+
+    std::atomic<int> nextChunk(begin);
+
+    this->run([&](int) {
+        for (int chunk = nextChunk.fetch_add(grainSize); chunk < end; chunk = nextChunk.fetch_add(grainSize))
+        {
+            body(chunk, std::min(chunk + grainSize, end));
+        }
+    });
+}
+
+void ThreadPool::executor(size_t count, void (*job)(size_t, void*), void *context, void *executorData)
+{
+    static_cast<ThreadPool*>(executorData)->parallelFor(0, count, 1, [job, context](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            job(i, context);
+        }
+    });
+}
+
+void ThreadPool::workerLoop(int thread)
+{
+    unsigned int seenGeneration = 0;
+
+    while (true)
+    {
+        const std::function<void(int)> *task;
+
+        {
+            std::unique_lock<std::mutex> lk(this->mutex);
+            this->workReady.wait(lk, [&]{ return this->stopping || this->generation != seenGeneration; });
+
+            if (this->stopping)
+                return;
+
+            seenGeneration = this->generation;
+            task = this->task;
+        }
+
+        (*task)(thread);
+
+        {
+            std::lock_guard<std::mutex> lk(this->mutex);
+            this->busyWorkers--;
+        }
+        this->workDone.notify_one();
+    }
+}
+
+#endif
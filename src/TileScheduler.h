@@ -0,0 +1,303 @@
+#ifndef _TILE_SCHEDULER_H
+#define _TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Order in which the tiles are laid out before being split between the threads
+enum TileOrder
+{
+    TILE_ORDER_SCANLINE,
+    // rows from the top of the image down, the order pngs are written in
+    TILE_ORDER_TOP_DOWN,
+    TILE_ORDER_MORTON,
+    TILE_ORDER_HILBERT
+};
+
+// Rectangle of pixels rendered as one unit of work, clipped to the image
+struct renderTile
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Hands out the tiles of an image to a fixed set of threads. Every thread starts
+// with a contiguous run of the tile order, so neighbouring tiles tend to be
+// rendered by the same thread, and steals the back half of another thread's run
+// once its own is empty. All queue updates are single compare and swaps.
+// Top down tiles are all taken from one queue instead, so they are handed out
+// strictly in order and rows of tiles finish from the top down.
+class TileScheduler
+{
+private:
+    // The run of a thread is the tile indices [head, tail), packed into one word
+    // so the owner popping the head and a thief cutting the tail can't race.
+    // Padded so that two threads never write to the same cache line.
+    struct threadQueue
+    {
+        std::atomic<uint64_t> range;
+        double busyTime;
+        int tilesRendered;
+        int tilesStolen;
+        char padding[64];
+    };
+
+    std::vector<renderTile> tiles;
+    std::vector<threadQueue> queues;
+    // every thread takes its tiles from the first queue
+    bool shared;
+
+    static uint64_t packRange(uint32_t head, uint32_t tail);
+    static uint32_t rangeHead(uint64_t range);
+    static uint32_t rangeTail(uint64_t range);
+
+    static uint32_t mortonIndex(uint32_t x, uint32_t y);
+    static uint32_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y);
+
+    bool pop(int thread, int &index);
+    bool steal(int thread, int &index);
+
+public:
+    TileScheduler(int imageWidth, int imageHeight, int tileSize, TileOrder order, int threadCount);
+
+    int getTileCount() const;
+    int getThreadCount() const;
+
+    // Hands out every tile again, for another pass over the image. Must not be
+    // called while threads are taking tiles, the statistics keep adding up.
+    void reset();
+
+    // Gets the next tile for a thread, false once every tile has been handed out
+    bool nextTile(int thread, renderTile &tile);
+
+    // Time a thread spent rendering, only to be called by that thread
+    void addBusyTime(int thread, double seconds);
+
+    double getBusyTime(int thread) const;
+    int getTilesRendered(int thread) const;
+    int getTilesStolen(int thread) const;
+};
+
+TileScheduler::TileScheduler(int imageWidth, int imageHeight, int tileSize, TileOrder order, int threadCount)
+    : queues(threadCount), shared(order == TILE_ORDER_TOP_DOWN)
+{
+    int tilesX = (imageWidth + tileSize - 1) / tileSize;
+    int tilesY = (imageHeight + tileSize - 1) / tileSize;
+
+    // side of the smallest power of two grid covering all tiles, for the curve orders
+    uint32_t gridSize = 1;
+    while (gridSize < static_cast<uint32_t>(std::max(tilesX, tilesY)))
+        gridSize *= 2;
+
+    std::vector<std::pair<uint32_t, renderTile>> ordered;
+
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            renderTile tile;
+            tile.x = tx * tileSize;
+            tile.y = ty * tileSize;
+            tile.width = std::min(tileSize, imageWidth - tile.x);
+            tile.height = std::min(tileSize, imageHeight - tile.y);
+
+            uint32_t key = ty * tilesX + tx;
+
+            if (order == TILE_ORDER_TOP_DOWN)
+                key = (tilesY - 1 - ty) * tilesX + tx;
+            else if (order == TILE_ORDER_MORTON)
+                key = mortonIndex(tx, ty);
+            else if (order == TILE_ORDER_HILBERT)
+                key = hilbertIndex(gridSize, tx, ty);
+
+            ordered.push_back(std::make_pair(key, tile));
+        }
+    }
+
+    std::stable_sort(ordered.begin(), ordered.end(),
+        [](const std::pair<uint32_t, renderTile> &a, const std::pair<uint32_t, renderTile> &b) {
+            return a.first < b.first;
+        });
+
+    for (auto &entry : ordered)
+    {
+        this->tiles.push_back(entry.second);
+    }
+
+    for (auto &queue : this->queues)
+    {
+        queue.busyTime = 0;
+        queue.tilesRendered = 0;
+        queue.tilesStolen = 0;
+    }
+
+    this->reset();
+}
+
+void TileScheduler::reset()
+{
+    int tileCount = this->tiles.size();
+    int threadCount = this->queues.size();
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        if (this->shared)
+            this->queues[i].range = i == 0 ? packRange(0, tileCount) : packRange(tileCount, tileCount);
+        else
+            this->queues[i].range = packRange(tileCount * i / threadCount, tileCount * (i + 1) / threadCount);
+    }
+}
+
+int TileScheduler::getTileCount() const
+{
+    return this->tiles.size();
+}
+
+int TileScheduler::getThreadCount() const
+{
+    return this->queues.size();
+}
+
+bool TileScheduler::nextTile(int thread, renderTile &tile)
+{
+    int index;
+
+    if (this->shared)
+    {
+        if (!this->pop(0, index))
+            return false;
+    }
+    else if (!this->pop(thread, index) && !this->steal(thread, index))
+        return false;
+
+    tile = this->tiles[index];
+    this->queues[thread].tilesRendered++;
+
+    return true;
+}
+
+void TileScheduler::addBusyTime(int thread, double seconds)
+{
+    this->queues[thread].busyTime += seconds;
+}
+
+double TileScheduler::getBusyTime(int thread) const
+{
+    return this->queues[thread].busyTime;
+}
+
+int TileScheduler::getTilesRendered(int thread) const
+{
+    return this->queues[thread].tilesRendered;
+}
+
+int TileScheduler::getTilesStolen(int thread) const
+{
+    return this->queues[thread].tilesStolen;
+}
+
+bool TileScheduler::pop(int thread, int &index)
+{
+    std::atomic<uint64_t> &range = this->queues[thread].range;
+    uint64_t current = range.load();
+
+    while (rangeHead(current) < rangeTail(current))
+    {
+        if (range.compare_exchange_weak(current, packRange(rangeHead(current) + 1, rangeTail(current))))
+        {
+            index = rangeHead(current);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool TileScheduler::steal(int thread, int &index)
+{
+    int threadCount = this->queues.size();
+
+    for (int i = 1; i < threadCount; i++)
+    {
+        std::atomic<uint64_t> &range = this->queues[(thread + i) % threadCount].range;
+        uint64_t current = range.load();
+
+        while (rangeHead(current) < rangeTail(current))
+        {
+            uint32_t head = rangeHead(current);
+            uint32_t tail = rangeTail(current);
+            // the back half, rounded up so a single remaining tile can be taken too
+            uint32_t split = tail - (tail - head + 1) / 2;
+
+            if (range.compare_exchange_weak(current, packRange(head, split)))
+            {
+                // nobody touches an empty run, so the stolen tiles can simply be stored
+                index = split;
+                this->queues[thread].range.store(packRange(split + 1, tail));
+                this->queues[thread].tilesStolen += tail - split;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+uint64_t TileScheduler::packRange(uint32_t head, uint32_t tail)
+{
+    return (static_cast<uint64_t>(tail) << 32) | head;
+}
+
+uint32_t TileScheduler::rangeHead(uint64_t range)
+{
+    return range & 0xFFFFFFFF;
+}
+
+uint32_t TileScheduler::rangeTail(uint64_t range)
+{
+    return range >> 32;
+}
+
+uint32_t TileScheduler::mortonIndex(uint32_t x, uint32_t y)
+{
+    uint32_t index = 0;
+
+    for (int bit = 0; bit < 16; bit++)
+    {
+        index |= ((x >> bit) & 1) << (2 * bit);
+        index |= ((y >> bit) & 1) << (2 * bit + 1);
+    }
+
+    return index;
+}
+
+uint32_t TileScheduler::hilbertIndex(uint32_t n, uint32_t x, uint32_t y)
+{
+    uint32_t index = 0;
+
+    for (uint32_t s = n / 2; s > 0; s /= 2)
+    {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        index += s * s * ((3 * rx) ^ ry);
+
+        // rotate the quadrant so the curve continues where the last one ended
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+
+    return index;
+}
+
+#endif
@@ -0,0 +1,464 @@
+#ifndef _TILE_TRACER_H
+#define _TILE_TRACER_H
+
+#include "Checkpoint.h"
+#include "PixelSampler.h"
+#include "Ray.h"
+#include "RayGenerator.h"
+#include "RayPacket.h"
+#include "RayStream.h"
+#include "Shader.h"
+#include "TileScheduler.h"
+
+#include "libs/Matrix.h"
+
+#include <algorithm>
+#include <vector>
+
+// Primary rays are traced one at a time unless one of these is defined, the later ones take precedence.
+// Packets are the default, they are the fastest mode on every test scene.
+//#define BUNDLE_RENDER
+#define PACKET_RENDER
+//#define STREAM_RENDER
+
+// Side length in pixels of the square tiles traced as one packet, must be even and at most 16
+#define PACKET_DIM 8
+
+// How the primary rays of a tile are grouped
+enum RenderMode
+{
+    // one ray at a time
+    RENDER_MODE_SCALAR,
+    // 2x2 quads of pixels
+    RENDER_MODE_BUNDLE,
+    // PACKET_DIM square blocks of pixels
+    RENDER_MODE_PACKET,
+    // the rays of a whole tile together, bounce by bounce
+    RENDER_MODE_STREAM
+};
+
+#if defined(STREAM_RENDER)
+#define DEFAULT_RENDER_MODE RENDER_MODE_STREAM
+#elif defined(PACKET_RENDER)
+#define DEFAULT_RENDER_MODE RENDER_MODE_PACKET
+#elif defined(BUNDLE_RENDER)
+#define DEFAULT_RENDER_MODE RENDER_MODE_BUNDLE
+#else
+#define DEFAULT_RENDER_MODE RENDER_MODE_SCALAR
+#endif
+
+// Traces the samples of the pixels of a tile, in the grouping of its render
+// mode, and adds them up per pixel. Each render thread has one, so it holds
+// the scratch arrays of every pass it traces.
+class TileTracer
+{
+private:
+    RenderMode mode;
+    Shader &shader;
+    RayGenerator &generator;
+    const PixelSampler &sampler;
+    // sample arrays hold this many per pixel
+    int paddedSamples;
+
+    // Sample offsets and weights of the pixels being traced, paddedSamples per pixel
+    std::vector<float> sampleX, sampleY, sampleWeight;
+
+    // Samples of the sparse refinement passes, listed pixel by pixel
+    std::vector<int> entryPixels;
+    std::vector<float> entryX, entryY, entryWeights;
+
+    rayPacket packet, shadowPacket;
+    Vec3Bundle packetColors[MAX_PACKET_QUADS];
+    float packetX[MAX_PACKET_QUADS * 4], packetY[MAX_PACKET_QUADS * 4];
+    // the tile pixel of each ray of the packet, -1 if it isn't traced
+    int rayPixels[MAX_PACKET_QUADS * 4];
+
+    rayStream stream;
+    std::vector<Vec3> streamColors;
+    // the pixel of each sample in the stream
+    std::vector<int> samplePixels;
+    std::vector<float> sampleWeights;
+
+    void addSample(int pixel, float weight, Vec3 c);
+
+    // Samples a pixel already has, pixels hanging over the tile edge are traced but never used
+    int firstSampleOf(const renderTile &tile, int x, int y) const;
+
+    void listSamples(const renderTile &tile, int count);
+    // Fills a bundle with four consecutive listed samples, returns the lanes that hold one
+    int getListedBundle(const renderTile &tile, int first, rayBundle &bundle);
+
+    void traceListed(const renderTile &tile, int count);
+    void traceRays(const renderTile &tile, int count);
+    void traceBundles(const renderTile &tile, int count);
+    void tracePackets(const renderTile &tile, int count);
+    void traceStream(const renderTile &tile, int count);
+
+public:
+    // Sums over the samples of each pixel of the tile, indexed by py * tile.width + px
+    std::vector<pixelSums> sums;
+    // pixels that take part in the next pass
+    std::vector<char> activePixels;
+
+    TileTracer(RenderMode mode, Shader &shader, RayGenerator &generator, const PixelSampler &sampler, int tileSize, int paddedSamples);
+
+    // Traces count more samples of every active pixel of the tile, each pixel
+    // carrying on with its sequence from the samples it already has
+    void tracePass(const renderTile &tile, int count);
+};
+
+TileTracer::TileTracer(RenderMode mode, Shader &shader, RayGenerator &generator, const PixelSampler &sampler, int tileSize, int paddedSamples)
+    : mode(mode), shader(shader), generator(generator), sampler(sampler), paddedSamples(paddedSamples),
+    sums(tileSize * tileSize), activePixels(tileSize * tileSize)
+{
+    // the pixels traced together each have their samples in the arrays
+    int pixelsTogether = mode == RENDER_MODE_PACKET ? MAX_PACKET_QUADS * 4 : mode == RENDER_MODE_BUNDLE ? 4 : 1;
+
+    this->sampleX.resize(pixelsTogether * paddedSamples);
+    this->sampleY.resize(pixelsTogether * paddedSamples);
+    this->sampleWeight.resize(pixelsTogether * paddedSamples);
+}
+
+void TileTracer::addSample(int pixel, float weight, Vec3 c)
+{
+    // the error estimate ignores the filter weights
+    float luminance = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+
+    this->sums[pixel].weightedSum += weight * c;
+    this->sums[pixel].weightSum += weight;
+    this->sums[pixel].luminanceSum += luminance;
+    this->sums[pixel].luminanceSquareSum += luminance * luminance;
+    this->sums[pixel].sampleCount++;
+}
+
+int TileTracer::firstSampleOf(const renderTile &tile, int x, int y) const
+{
+    return x < tile.x + tile.width && y < tile.y + tile.height ? this->sums[(y - tile.y) * tile.width + x - tile.x].sampleCount : 0;
+}
+
+void TileTracer::tracePass(const renderTile &tile, int count)
+{
+    // Once pixels drop out, or in the preview, only scattered pixels are left,
+    // which would make for mostly empty bundles and packets on the pixel grid
+    auto tileActive = this->activePixels.begin() + tile.width * tile.height;
+
+    if ((this->mode == RENDER_MODE_BUNDLE || this->mode == RENDER_MODE_PACKET) &&
+        std::find(this->activePixels.begin(), tileActive, 0) != tileActive)
+    {
+        this->traceListed(tile, count);
+        return;
+    }
+
+    switch (this->mode)
+    {
+    case RENDER_MODE_SCALAR:
+        this->traceRays(tile, count);
+        break;
+    case RENDER_MODE_BUNDLE:
+        this->traceBundles(tile, count);
+        break;
+    case RENDER_MODE_PACKET:
+        this->tracePackets(tile, count);
+        break;
+    case RENDER_MODE_STREAM:
+        this->traceStream(tile, count);
+        break;
+    }
+}
+
+void TileTracer::listSamples(const renderTile &tile, int count)
+{
+    this->entryPixels.clear();
+    this->entryX.clear();
+    this->entryY.clear();
+    this->entryWeights.clear();
+
+    for (int p = 0; p < tile.width * tile.height; p++)
+    {
+        if (!this->activePixels[p])
+            continue;
+
+        this->sampler.getPixelSamples(tile.x + p % tile.width, tile.y + p / tile.width, this->sums[p].sampleCount, count,
+            &this->sampleX[0], &this->sampleY[0], &this->sampleWeight[0]);
+
+        for (int s = 0; s < count; s++)
+        {
+            this->entryPixels.push_back(p);
+            this->entryX.push_back(this->sampleX[s]);
+            this->entryY.push_back(this->sampleY[s]);
+            this->entryWeights.push_back(this->sampleWeight[s]);
+        }
+    }
+}
+
+int TileTracer::getListedBundle(const renderTile &tile, int first, rayBundle &bundle)
+{
+    const int entryCount = this->entryPixels.size();
+
+    int pixelX[4], pixelY[4];
+    float offsetX[4], offsetY[4];
+    int laneMask = 0;
+
+    for (int j = 0; j < 4; j++)
+    {
+        // past the end of the list the last sample is repeated
+        int entry = std::min(first + j, entryCount - 1);
+
+        pixelX[j] = tile.x + this->entryPixels[entry] % tile.width;
+        pixelY[j] = tile.y + this->entryPixels[entry] / tile.width;
+        offsetX[j] = this->entryX[entry];
+        offsetY[j] = this->entryY[entry];
+
+        if (first + j < entryCount)
+            laneMask |= 1 << j;
+    }
+
+    this->generator.getRayBundle(pixelX, pixelY, offsetX, offsetY, bundle);
+    return laneMask;
+}
+
+// The samples of the active pixels are packed densely, each quad holding
+// neighbouring samples of a pixel
+void TileTracer::traceListed(const renderTile &tile, int count)
+{
+    this->listSamples(tile, count);
+
+    const int entryCount = this->entryPixels.size();
+
+    for (int first = 0; first < entryCount; first += MAX_PACKET_QUADS * 4)
+    {
+        if (this->mode == RENDER_MODE_PACKET)
+        {
+            this->packet.quadCount = std::min(MAX_PACKET_QUADS, (entryCount - first + 3) / 4);
+            this->packet.width = this->packet.quadCount * 2;
+            this->packet.height = 2;
+
+            int listedMasks[MAX_PACKET_QUADS];
+
+            for (int q = 0; q < this->packet.quadCount; q++)
+            {
+                listedMasks[q] = this->packet.laneMasks[q] = this->getListedBundle(tile, first + q * 4, this->packet.rays[q]);
+            }
+
+            this->shader.traceRayPacket(this->packet, this->shadowPacket, this->packetColors);
+
+            for (int q = 0; q < this->packet.quadCount; q++)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    if (listedMasks[q] & (1 << j))
+                        this->addSample(this->entryPixels[first + q * 4 + j], this->entryWeights[first + q * 4 + j], this->packetColors[q][j]);
+                }
+            }
+
+            continue;
+        }
+
+        int end = std::min(first + MAX_PACKET_QUADS * 4, entryCount);
+
+        for (int bundleStart = first; bundleStart < end; bundleStart += 4)
+        {
+            rayBundle rayBundle;
+            int laneMask = this->getListedBundle(tile, bundleStart, rayBundle);
+
+            Vec3Bundle vecBundle;
+            this->shader.traceRayBundle(rayBundle, vecBundle, 0, laneMask);
+
+            for (int j = 0; j < 4; j++)
+            {
+                if (laneMask & (1 << j))
+                    this->addSample(this->entryPixels[bundleStart + j], this->entryWeights[bundleStart + j], vecBundle[j]);
+            }
+        }
+    }
+}
+
+void TileTracer::traceRays(const renderTile &tile, int count)
+{
+    for (int y = tile.y; y < tile.y + tile.height; y++)
+    {
+        for (int x = tile.x; x < tile.x + tile.width; x++)
+        {
+            int pixel = (y - tile.y) * tile.width + x - tile.x;
+
+            if (!this->activePixels[pixel])
+                continue;
+
+            this->sampler.getPixelSamples(x, y, this->firstSampleOf(tile, x, y), count, this->sampleX.data(), this->sampleY.data(),
+                this->sampleWeight.data());
+
+            for (int s = 0; s < count; s++)
+            {
+                Ray r = this->generator.getRay(x, y, this->sampleX[s], this->sampleY[s]);
+
+                this->addSample(pixel, this->sampleWeight[s], this->shader.traceRay(r));
+            }
+        }
+    }
+}
+
+void TileTracer::traceBundles(const renderTile &tile, int count)
+{
+    const int tileEndX = tile.x + tile.width;
+    const int tileEndY = tile.y + tile.height;
+    const int padded = this->paddedSamples;
+
+    for (int y = tile.y; y < tileEndY; y += 2)
+    {
+        for (int x = tile.x; x < tileEndX; x += 2)
+        {
+            int pixelX[4] = {x, x + 1, x, x + 1};
+            int pixelY[4] = {y, y, y + 1, y + 1};
+            int laneMask = 0;
+
+            for (int j = 0; j < 4; j++)
+            {
+                if (pixelX[j] < tileEndX && pixelY[j] < tileEndY && this->activePixels[(pixelY[j] - tile.y) * tile.width + pixelX[j] - tile.x])
+                    laneMask |= 1 << j;
+
+                this->sampler.getPixelSamples(pixelX[j], pixelY[j], this->firstSampleOf(tile, pixelX[j], pixelY[j]), count,
+                    &this->sampleX[j * padded], &this->sampleY[j * padded], &this->sampleWeight[j * padded]);
+            }
+
+            if (!laneMask)
+                continue;
+
+            // each lane takes the same sample of its own pixel
+            for (int s = 0; s < count; s++)
+            {
+                float offsetX[4], offsetY[4];
+
+                for (int j = 0; j < 4; j++)
+                {
+                    offsetX[j] = this->sampleX[j * padded + s];
+                    offsetY[j] = this->sampleY[j * padded + s];
+                }
+
+                rayBundle rayBundle;
+                this->generator.getRayBundle(pixelX, pixelY, offsetX, offsetY, rayBundle);
+
+                Vec3Bundle vecBundle;
+                this->shader.traceRayBundle(rayBundle, vecBundle, 0, laneMask);
+
+                for (int j = 0; j < 4; j++)
+                {
+                    if (laneMask & (1 << j))
+                        this->addSample((pixelY[j] - tile.y) * tile.width + pixelX[j] - tile.x, this->sampleWeight[j * padded + s], vecBundle[j]);
+                }
+            }
+        }
+    }
+}
+
+void TileTracer::tracePackets(const renderTile &tile, int count)
+{
+    const int tileEndX = tile.x + tile.width;
+    const int tileEndY = tile.y + tile.height;
+    const int padded = this->paddedSamples;
+
+    for (int y = tile.y; y < tileEndY; y += PACKET_DIM)
+    {
+        for (int x = tile.x; x < tileEndX; x += PACKET_DIM)
+        {
+            // packets are cut down to the tile, but stay even for the quads
+            int width = std::min(PACKET_DIM, tileEndX - x);
+            int height = std::min(PACKET_DIM, tileEndY - y);
+            width += width % 2;
+            height += height % 2;
+
+            int rayCount = width * height;
+            bool anyActive = false;
+
+            this->packet.width = width;
+
+            // rays are numbered in quad order, 4 per quad
+            for (int r = 0; r < rayCount; r++)
+            {
+                int px = x + this->packet.quadX(r / 4) + (r % 2);
+                int py = y + this->packet.quadY(r / 4) + (r % 4 / 2);
+                int pixel = (py - tile.y) * tile.width + px - tile.x;
+
+                // quads along the right and top edges of odd sized tiles hang over them
+                bool inTile = px < tileEndX && py < tileEndY;
+                this->rayPixels[r] = inTile && this->activePixels[pixel] ? pixel : -1;
+                anyActive |= this->rayPixels[r] >= 0;
+
+                this->sampler.getPixelSamples(px, py, this->firstSampleOf(tile, px, py), count, &this->sampleX[r * padded],
+                    &this->sampleY[r * padded], &this->sampleWeight[r * padded]);
+            }
+
+            if (!anyActive)
+                continue;
+
+            // one packet per sample, each ray taking that sample of its pixel
+            for (int s = 0; s < count; s++)
+            {
+                for (int r = 0; r < rayCount; r++)
+                {
+                    this->packetX[r] = this->sampleX[r * padded + s];
+                    this->packetY[r] = this->sampleY[r * padded + s];
+                }
+
+                this->generator.getRayPacket(x, y, width, height, this->packetX, this->packetY, this->packet);
+
+                for (int q = 0; q < this->packet.quadCount; q++)
+                {
+                    this->packet.laneMasks[q] = 0;
+
+                    for (int j = 0; j < 4; j++)
+                    {
+                        if (this->rayPixels[q * 4 + j] >= 0)
+                            this->packet.laneMasks[q] |= 1 << j;
+                    }
+                }
+
+                this->shader.traceRayPacket(this->packet, this->shadowPacket, this->packetColors);
+
+                for (int r = 0; r < rayCount; r++)
+                {
+                    if (this->rayPixels[r] >= 0)
+                        this->addSample(this->rayPixels[r], this->sampleWeight[r * padded + s], this->packetColors[r / 4][r % 4]);
+                }
+            }
+        }
+    }
+}
+
+// All samples of the pass go into one stream, each with a color of its own
+void TileTracer::traceStream(const renderTile &tile, int count)
+{
+    this->stream.clear();
+    this->samplePixels.clear();
+    this->sampleWeights.clear();
+
+    for (int py = 0; py < tile.height; py++)
+    {
+        for (int px = 0; px < tile.width; px++)
+        {
+            if (!this->activePixels[py * tile.width + px])
+                continue;
+
+            this->sampler.getPixelSamples(tile.x + px, tile.y + py, this->sums[py * tile.width + px].sampleCount, count,
+                this->sampleX.data(), this->sampleY.data(), this->sampleWeight.data());
+
+            for (int s = 0; s < count; s++)
+            {
+                Ray r = this->generator.getRay(tile.x + px, tile.y + py, this->sampleX[s], this->sampleY[s]);
+                this->stream.push(r, 1000000, this->samplePixels.size(), Vec3(1));
+
+                this->samplePixels.push_back(py * tile.width + px);
+                this->sampleWeights.push_back(this->sampleWeight[s]);
+            }
+        }
+    }
+
+    this->streamColors.assign(this->samplePixels.size(), Vec3(0));
+    this->shader.traceRayStream(this->stream, this->streamColors.data());
+
+    for (size_t i = 0; i < this->samplePixels.size(); i++)
+    {
+        this->addSample(this->samplePixels[i], this->sampleWeights[i], this->streamColors[i]);
+    }
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef _TONE_MAPPER_H
+#define _TONE_MAPPER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+// steps of the table linear values from 0 to 1 are sRGB encoded with
+#define SRGB_TABLE_SIZE (1 << 14)
+
+// How linear colours are brought into the range of a png
+enum ToneOperator
+{
+    // divided by the brightest component of the image, stored linear
+    TONE_MAP_MAX,
+    // x / (1 + x) on each channel
+    TONE_MAP_REINHARD,
+    // Narkowicz's fit of the ACES filmic curve
+    TONE_MAP_ACES,
+    // clipped at 1
+    TONE_MAP_EXPOSURE
+};
+
+// Turns rows of linear colours into 8-bit pixels in one pass, four channels at
+// a time. Apart from max, the operators take the colours times the exposure
+// and sRGB encode their result.
+class ToneMapper
+{
+private:
+    ToneOperator op;
+    float exposure;
+    std::vector<uint8_t> srgbTable;
+
+    static float srgbEncode(float linear);
+
+public:
+    ToneMapper(ToneOperator op, float exposure);
+
+    // Whether mapRow needs the brightest component of the whole image
+    bool needsMax() const;
+
+    // Floats a row of count channels has to have room for, rounded up to whole groups of four
+    static int paddedSize(int count);
+
+    // Maps count interleaved channels to bytes. The channels are overwritten, up
+    // to paddedSize(count) of them. maxComponent is only used by max, which
+    // clips what is above it.
+    void mapRow(float *channels, int count, float maxComponent, uint8_t *out) const;
+};
+
+ToneMapper::ToneMapper(ToneOperator op, float exposure)
+    : op(op), exposure(exposure), srgbTable(SRGB_TABLE_SIZE)
+{
+    for (int i = 0; i < SRGB_TABLE_SIZE; i++)
+    {
+        this->srgbTable[i] = static_cast<uint8_t>(srgbEncode(i / static_cast<float>(SRGB_TABLE_SIZE - 1)) * 255 + 0.5f);
+    }
+}
+
+float ToneMapper::srgbEncode(float linear)
+{
+    if (linear <= 0.0031308f)
+        return 12.92f * linear;
+
+    return 1.055f * std::pow(linear, 1 / 2.4f) - 0.055f;
+}
+
+bool ToneMapper::needsMax() const
+{
+    return this->op == TONE_MAP_MAX;
+}
+
+int ToneMapper::paddedSize(int count)
+{
+    return (count + 3) & ~3;
+}
+
+void ToneMapper::mapRow(float *channels, int count, float maxComponent, uint8_t *out) const
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 exposure = _mm_set1_ps(this->exposure);
+
+    if (this->op == TONE_MAP_MAX)
+    {
+        const __m128 scale = _mm_set1_ps(255);
+        const __m128 max = _mm_set1_ps(maxComponent);
+
+        for (int i = 0; i < count; i += 4)
+        {
+            //the same rounding as scaling each colour, so the image stays as it always was, nans becoming 0
+            __m128 x = _mm_min_ps(_mm_div_ps(_mm_mul_ps(_mm_max_ps(_mm_loadu_ps(channels + i), zero), scale), max), scale);
+            __m128i bytes = _mm_cvttps_epi32(x);
+            bytes = _mm_packus_epi16(_mm_packs_epi32(bytes, bytes), bytes);
+
+            if (i + 4 <= count)
+            {
+                int32_t packed = _mm_cvtsi128_si32(bytes);
+                memcpy(out + i, &packed, 4);
+            }
+            else
+            {
+                uint8_t packed[16];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(packed), bytes);
+                memcpy(out + i, packed, count - i);
+            }
+        }
+
+        return;
+    }
+
+    for (int i = 0; i < count; i += 4)
+    {
+        //nans become 0
+        __m128 x = _mm_max_ps(_mm_loadu_ps(channels + i), zero);
+
+        switch (this->op)
+        {
+        case TONE_MAP_REINHARD:
+            x = _mm_mul_ps(x, exposure);
+            x = _mm_div_ps(x, _mm_add_ps(one, x));
+            break;
+        case TONE_MAP_ACES:
+            x = _mm_mul_ps(x, exposure);
+            x = _mm_div_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f))),
+                _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f)));
+            break;
+        case TONE_MAP_EXPOSURE:
+            x = _mm_mul_ps(x, exposure);
+            break;
+        default:
+            break;
+        }
+
+        //into the range of the table, infinity over infinity included
+        _mm_storeu_ps(channels + i, _mm_min_ps(_mm_max_ps(x, zero), one));
+    }
+
+    //table indices, rounded to the nearest step
+    const __m128 steps = _mm_set1_ps(SRGB_TABLE_SIZE - 1);
+    const __m128 half = _mm_set1_ps(0.5f);
+    int32_t indices[4];
+
+    for (int i = 0; i < count; i += 4)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(indices), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(channels + i), steps), half)));
+
+        for (int j = 0; j < 4 && i + j < count; j++)
+        {
+            out[i + j] = this->srgbTable[indices[j]];
+        }
+    }
+}
+
+#endif
@@ -7,7 +7,6 @@
 #include "libs/Matrix.h"
 
 #include <algorithm>
-#include <string>
 
 class Triangle : public Surface
 {
@@ -19,7 +18,7 @@ private:
     Vec3 normal;
 
 public:
-    Triangle(Vec3 a, Vec3 b, Vec3 c, std::string materialID);
+    Triangle(Vec3 a, Vec3 b, Vec3 c, int materialID);
 
     virtual bool hit(Ray ray, float startTime, rayHit *record);
 
@@ -27,7 +26,7 @@ public:
     virtual BoundingBox getBoundingBox();
 };
 
-Triangle::Triangle(Vec3 a, Vec3 b, Vec3 c, std::string materialID)
+Triangle::Triangle(Vec3 a, Vec3 b, Vec3 c, int materialID)
     : Surface(materialID), a(a), b(b), c(c)
 {
     this->normal = Mat::normalize(Mat::cross(b - a, c - b));
@@ -63,7 +62,7 @@ bool Triangle::hit(Ray ray, float startTime, rayHit *record)
     record->intersectionTime = t;
     record->intersectionPoint = x;
     record->surfaceNormal = this->normal;
-    record->materialID = this->materialName;
+    record->materialID = this->materialID;
 
     return true;
 
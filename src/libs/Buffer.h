@@ -2,7 +2,25 @@
 #define __BUFFER
 
 #include <stdlib.h>
+#include <cstddef>
+#include <iterator>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+//alignment of the memory of every buffer, a cache line
+#define BUFFER_ALIGNMENT 64
+
+enum BufferLayout
+{
+	//row after row
+	BUFFER_LAYOUT_ROWS,
+	//square tiles row after row, each tile holding its 2x2 quads one after another,
+	//so a tile and a quad of it are both in one piece of memory
+	BUFFER_LAYOUT_TILES
+};
 
+//Buffers move instead of copying, copies have to be asked for with clone
 template<class T = int>
 class Buffer
 {
@@ -11,46 +29,82 @@ public:
 	{
 		this->w = 0;
 		this->h = 0;
+		this->layout = BUFFER_LAYOUT_ROWS;
+		this->tileDim = 0;
+		this->tileShift = -1;
+		this->tilesX = 0;
+		this->size = 0;
 		this->data = NULL;
 	}
 
-	Buffer(unsigned int w, unsigned int h)
+	//tileDim is the side of the tiles of the tiled layout, rounded up to be even and at least 2
+	Buffer(unsigned int w, unsigned int h, BufferLayout layout = BUFFER_LAYOUT_ROWS, unsigned int tileDim = 0)
 	{
 		this->w = w;
 		this->h = h;
+		this->layout = layout;
+		this->tileDim = 0;
+		this->tileShift = -1;
+		this->tilesX = 0;
+		this->size = (size_t)w * h;
+
+		if(layout == BUFFER_LAYOUT_TILES)
+		{
+			//the tiles at the edges are padded to full ones
+			this->tileDim = tileDim < 2 ? 2 : tileDim + tileDim % 2;
+			this->tilesX = (w + this->tileDim - 1) / this->tileDim;
+			this->size = (size_t)this->tilesX * this->tileDim * ((h + this->tileDim - 1) / this->tileDim) * this->tileDim;
+
+			//powers of two are shifted instead of divided by
+			if((this->tileDim & (this->tileDim - 1)) == 0)
+				for(this->tileShift = 0; (1u << this->tileShift) < this->tileDim; this->tileShift++);
+		}
 
 		alloc();
 	}
 
-	Buffer(Buffer const & buffer)
+	Buffer(Buffer && buffer)
 	{
-		copy(buffer);
+		take(buffer);
 	}
 
-	Buffer & operator=(Buffer const & buffer)
+	Buffer & operator=(Buffer && buffer)
 	{
 		if(this == &buffer)
 			return *this;
 
 		dealloc();
-		copy(buffer);
+		take(buffer);
 
 		return *this;
 	}
 
+	Buffer(Buffer const & buffer) = delete;
+	Buffer & operator=(Buffer const & buffer) = delete;
+
 	~Buffer()
 	{
 		dealloc();
 	}
 
+	Buffer clone() const
+	{
+		Buffer copy(this->w, this->h, this->layout, this->tileDim);
+
+		for(size_t i=0; i<this->size; i++)
+			copy.data[i] = this->data[i];
+
+		return copy;
+	}
+
 	T at(unsigned int x, unsigned int y) const
 	{
-		return data[x+y*this->w];
+		return data[index(x, y)];
 	}
 
 	T & at(unsigned int x, unsigned int y)
 	{
-		return data[x+y*this->w];
+		return data[index(x, y)];
 	}
 
 	size_t getWidth() const
@@ -59,34 +113,145 @@ public:
 	size_t getHeight() const
 	{ return this->h; }
 
+	BufferLayout getLayout() const
+	{ return this->layout; }
+
+	//the elements in the order of the layout, padding included
+	T * getData()
+	{ return this->data; }
+
+	const T * getData() const
+	{ return this->data; }
+
+	size_t getSize() const
+	{ return this->size; }
+
+	//Walks the elements row after row whatever the layout, for exporting them
+	class const_iterator
+	{
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef T value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef T const * pointer;
+		typedef T const & reference;
+
+		const_iterator(Buffer const * buffer, unsigned int x, unsigned int y)
+		{
+			this->buffer = buffer;
+			this->x = x;
+			this->y = y;
+		}
+
+		T const & operator*() const
+		{ return this->buffer->data[this->buffer->index(this->x, this->y)]; }
+
+		T const * operator->() const
+		{ return &**this; }
+
+		const_iterator & operator++()
+		{
+			if(++this->x == this->buffer->w)
+			{
+				this->x = 0;
+				this->y++;
+			}
+
+			return *this;
+		}
+
+		const_iterator operator++(int)
+		{
+			const_iterator previous = *this;
+			++*this;
+			return previous;
+		}
+
+		bool operator==(const_iterator const & other) const
+		{ return this->x == other.x && this->y == other.y; }
+
+		bool operator!=(const_iterator const & other) const
+		{ return !(*this == other); }
+
+	private:
+		Buffer const * buffer;
+		unsigned int x;
+		unsigned int y;
+	};
+
+	const_iterator begin() const
+	{ return const_iterator(this, 0, 0); }
+
+	const_iterator end() const
+	{ return const_iterator(this, 0, this->w > 0 ? this->h : 0); }
+
 private:
 	unsigned int w;
 	unsigned int h;
+	BufferLayout layout;
+	unsigned int tileDim;
+	int tileShift;
+	unsigned int tilesX;
+	size_t size;
 	T * data;
 
+	size_t index(unsigned int x, unsigned int y) const
+	{
+		if(this->layout == BUFFER_LAYOUT_ROWS)
+			return x + (size_t)y * this->w;
+
+		unsigned int tx = this->tileShift >= 0 ? x >> this->tileShift : x / this->tileDim;
+		unsigned int ty = this->tileShift >= 0 ? y >> this->tileShift : y / this->tileDim;
+		unsigned int px = x - tx * this->tileDim;
+		unsigned int py = y - ty * this->tileDim;
+
+		size_t tile = ((size_t)ty * this->tilesX + tx) * this->tileDim * this->tileDim;
+		return tile + ((py >> 1) * (this->tileDim >> 1) + (px >> 1)) * 4 + (py & 1) * 2 + (px & 1);
+	}
+
 	void alloc()
 	{
-		size_t size = this->w * this->h;
-		if(size == 0)
+		this->data = NULL;
+		if(this->size == 0)
 			return;
 
-		data = (T*) malloc(this->w * this->h * sizeof(T) );
+#ifdef _WIN32
+		data = (T*) _aligned_malloc(this->size * sizeof(T), BUFFER_ALIGNMENT);
+#else
+		void * memory = NULL;
+		if(posix_memalign(&memory, BUFFER_ALIGNMENT, this->size * sizeof(T)) == 0)
+			data = (T*) memory;
+#endif
 	}
 
 	void dealloc()
 	{
-		if(this->data != NULL)
-			free(data);
+		if(this->data == NULL)
+			return;
+
+#ifdef _WIN32
+		_aligned_free(data);
+#else
+		free(data);
+#endif
+		this->data = NULL;
 	}
 
-	void copy(Buffer const & buffer)
+	void take(Buffer & buffer)
 	{
 		this->w = buffer.w;
 		this->h = buffer.h;
+		this->layout = buffer.layout;
+		this->tileDim = buffer.tileDim;
+		this->tileShift = buffer.tileShift;
+		this->tilesX = buffer.tilesX;
+		this->size = buffer.size;
+		this->data = buffer.data;
 
-		alloc();
-		for(size_t i=0; i<this->w*this->h; i++)
-			this->data[i] = buffer.data[i];
+		buffer.w = 0;
+		buffer.h = 0;
+		buffer.size = 0;
+		buffer.data = NULL;
 	}
 };
 
@@ -6,17 +6,24 @@
 class objLoader
 {
 public:
-	objLoader() {}
+	objLoader()
+	{
+		memset(&data, 0, sizeof(data));
+		copyData();
+	}
 	~objLoader()
 	{
 		delete_obj_data(&data);
 	}
 
-	obj_vector **vertexList;
-	obj_vector **normalList;
-	obj_vector **textureList;
+	//three floats per vertex
+	float *vertexList;
+	float *normalList;
+	float *textureList;
 	
-	obj_face **faceList;
+	//three vertex indices per triangle
+	int *triangleVertexList;
+	int *triangleMaterialList;
 	obj_sphere **sphereList;
 	obj_plane **planeList;
 	
@@ -30,7 +37,7 @@ public:
 	int normalCount;
 	int textureCount;
 
-	int faceCount;
+	int triangleCount;
 	int sphereCount;
 	int planeCount;
 
@@ -42,48 +49,70 @@ public:
 
 	obj_camera *camera;
 	
+	size_t fileSize;
+	
 	int load(const char *filename)
+	{
+		return load(filename, obj_serial_executor, NULL);
+	}
+	
+	//parses the file in chunks run by executor
+	int load(const char *filename, obj_executor executor, void *executor_data)
 	{
 		int no_error = 1;
-		no_error = parse_obj_scene(&data, filename);
+		no_error = parse_obj_scene_parallel(&data, filename, executor, executor_data);
 		if(no_error)
-		{
-			this->vertexCount = data.vertex_count;
-			this->normalCount = data.vertex_normal_count;
-			this->textureCount = data.vertex_texture_count;
-			
-			this->faceCount = data.face_count;
-			this->sphereCount = data.sphere_count;
-			this->planeCount = data.plane_count;
-			
-			this->lightPointCount = data.light_point_count;
-			this->lightDiscCount = data.light_disc_count;
-			this->lightQuadCount = data.light_quad_count;
-			
-			this->materialCount = data.material_count;
-			
-			this->vertexList = data.vertex_list;
-			this->normalList = data.vertex_normal_list;
-			this->textureList = data.vertex_texture_list;
-			
-			this->faceList = data.face_list;
-			this->sphereList = data.sphere_list;
-			this->planeList = data.plane_list;
-			
-			this->lightPointList = data.light_point_list;
-			this->lightDiscList = data.light_disc_list;
-			this->lightQuadList = data.light_quad_list;
-			
-			this->materialList = data.material_list;
-			
-			this->camera = data.camera;
-		}
+			copyData();
 		
 		return no_error;
 	}
 	
+	//frees the parsed scene, once it has been copied out
+	void release()
+	{
+		delete_obj_data(&data);
+		memset(&data, 0, sizeof(data));
+		copyData();
+	}
+	
 private:
 	obj_scene_data data;
+	
+	void copyData()
+	{
+		this->vertexCount = data.vertex_count;
+		this->normalCount = data.vertex_normal_count;
+		this->textureCount = data.vertex_texture_count;
+		
+		this->triangleCount = data.triangle_count;
+		this->sphereCount = data.sphere_count;
+		this->planeCount = data.plane_count;
+		
+		this->lightPointCount = data.light_point_count;
+		this->lightDiscCount = data.light_disc_count;
+		this->lightQuadCount = data.light_quad_count;
+		
+		this->materialCount = data.material_count;
+		
+		this->vertexList = data.vertex_list;
+		this->normalList = data.vertex_normal_list;
+		this->textureList = data.vertex_texture_list;
+		
+		this->triangleVertexList = data.triangle_vertex_list;
+		this->triangleMaterialList = data.triangle_material_list;
+		this->sphereList = data.sphere_list;
+		this->planeList = data.plane_list;
+		
+		this->lightPointList = data.light_point_list;
+		this->lightDiscList = data.light_disc_list;
+		this->lightQuadList = data.light_quad_list;
+		
+		this->materialList = data.material_list;
+		
+		this->camera = data.camera;
+		
+		this->fileSize = data.file_size;
+	}
 };
 
 #endif
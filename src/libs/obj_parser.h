@@ -11,7 +11,6 @@
 extern "C"
 {
 static char strequal(const char *s1, const char *s2);
-static char contains(const char *haystack, const char *needle);
 
 static char strequal(const char *s1, const char *s2)
 {
@@ -20,13 +19,6 @@ static char strequal(const char *s1, const char *s2)
 	return 0;
 }
 
-static char contains(const char *haystack, const char *needle)
-{
-	if(strstr(haystack, needle) == NULL)
-		return 0;
-	return 1;
-}
-
 }
 
 // list //
@@ -268,6 +260,49 @@ static void list_print_list(list *listo)
 	
 }
 
+// array //
+
+extern "C"
+{
+
+// Growable array of fixed size items stored back to back, for the long lists
+// of the scene that would otherwise take an allocation per item
+typedef struct
+{
+	int item_count;
+	int current_max_size;
+	size_t item_size;
+	
+	char *items;
+} obj_array;
+
+static void obj_array_make(obj_array *arrayo, int start_size, size_t item_size)
+{
+	arrayo->items = (char*) malloc(item_size * start_size);
+	arrayo->item_count = 0;
+	arrayo->current_max_size = start_size;
+	arrayo->item_size = item_size;
+}
+
+//returns the space of a new item at the end
+static void* obj_array_add_item(obj_array *arrayo)
+{
+	if(arrayo->item_count == arrayo->current_max_size)
+	{
+		arrayo->current_max_size *= 2;
+		arrayo->items = (char*) realloc(arrayo->items, arrayo->item_size * arrayo->current_max_size);
+	}
+	
+	return arrayo->items + arrayo->item_size * arrayo->item_count++;
+}
+
+static void obj_array_free(obj_array *arrayo)
+{
+	free(arrayo->items);
+}
+
+}
+
 // obj_parser //
 
 #define _CRT_SECURE_NO_WARNINGS
@@ -275,20 +310,29 @@ static void list_print_list(list *listo)
 #include <string.h>
 #include <stdlib.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define OBJ_FILENAME_LENGTH 500
 #define MATERIAL_NAME_SIZE 255
 #define OBJ_LINE_SIZE 500
 #define MAX_VERTEX_COUNT 4 //can only handle quads or triangles
 #define WHITESPACE " \t\n\r"
 
-typedef struct obj_face
-{
-	int vertex_index[MAX_VERTEX_COUNT];
-	int normal_index[MAX_VERTEX_COUNT];
-	int texture_index[MAX_VERTEX_COUNT];
-	int vertex_count;
-	int material_index;
-} obj_face;
+//bytes of the obj file parsed as one job, rounded to the next line break
+#ifndef OBJ_PARSE_CHUNK_SIZE
+#define OBJ_PARSE_CHUNK_SIZE (1 << 18)
+#endif
+//longest number handed to atof when it can't be parsed exactly
+#define OBJ_NUMBER_SIZE 64
+//most digits that fit the 64 bit mantissa of the fast number parser
+#define OBJ_MAX_FAST_DIGITS 19
+//relative indices are stored below this while the chunks are parsed
+#define OBJ_RELATIVE_INDEX_BIAS (1 << 30)
 
 typedef struct obj_sphere
 {
@@ -308,11 +352,6 @@ typedef struct obj_plane
 	int material_index;
 } obj_plane;
 
-typedef struct obj_vector
-{
-	double e[3];
-} obj_vector;
-
 typedef struct obj_material
 {
 	char name[MATERIAL_NAME_SIZE];
@@ -360,11 +399,12 @@ typedef struct obj_growable_scene_data
 	char scene_filename[OBJ_FILENAME_LENGTH];
 	char material_filename[OBJ_FILENAME_LENGTH];
 	
-	list vertex_list;
-	list vertex_normal_list;
-	list vertex_texture_list;
+	obj_array vertex_list;
+	obj_array vertex_normal_list;
+	obj_array vertex_texture_list;
 	
-	list face_list;
+	obj_array triangle_vertex_list;
+	obj_array triangle_material_list;
 	list sphere_list;
 	list plane_list;
 	
@@ -377,13 +417,16 @@ typedef struct obj_growable_scene_data
 	obj_camera *camera;
 } obj_growable_scene_data;
 
+// The vertices and triangles are stored back to back, ready to be handed to the
+// renderer as they are. The other objects are few and get an allocation each.
 typedef struct obj_scene_data
 {
-	obj_vector **vertex_list;
-	obj_vector **vertex_normal_list;
-	obj_vector **vertex_texture_list;
+	float *vertex_list;  //x, y and z of each vertex
+	float *vertex_normal_list;
+	float *vertex_texture_list;
 	
-	obj_face **face_list;
+	int *triangle_vertex_list;  //three vertex indices per triangle, faces are split into fans
+	int *triangle_material_list;
 	obj_sphere **sphere_list;
 	obj_plane **plane_list;
 	
@@ -397,7 +440,7 @@ typedef struct obj_scene_data
 	int vertex_normal_count;
 	int vertex_texture_count;
 
-	int face_count;
+	int triangle_count;
 	int sphere_count;
 	int plane_count;
 
@@ -408,11 +451,18 @@ typedef struct obj_scene_data
 	int material_count;
 
 	obj_camera *camera;
+	
+	size_t file_size;
 } obj_scene_data;
 
+//same as simplePNG, runs job(0) to job(count-1), in parallel if it likes
+typedef void (*obj_job)(size_t index, void *context);
+typedef void (*obj_executor)(size_t count, obj_job job, void *context, void *executor_data);
+
 extern "C"
 {
-static int parse_obj_scene(obj_scene_data *data_out, const char *filename);
+//parses chunks of the file as jobs of the executor, the mtl files are read serially
+static int parse_obj_scene_parallel(obj_scene_data *data_out, const char *filename, obj_executor executor, void *executor_data);
 static void delete_obj_data(obj_scene_data *data_out);
 }
 
@@ -434,10 +484,28 @@ static int obj_convert_to_list_index(int current_max, int index)
 	return index - 1;  //normal counting index
 }
 
-static void obj_convert_to_list_index_v(int current_max, int *indices)
+//a list index in the chunk, or one relative to the end of the chunk's list minus OBJ_RELATIVE_INDEX_BIAS
+static int obj_convert_to_chunk_index(int current_max, int index)
+{
+	if(index < 0)
+		return current_max + index - OBJ_RELATIVE_INDEX_BIAS;
+	
+	return obj_convert_to_list_index(current_max, index);
+}
+
+static void obj_convert_to_chunk_index_v(int current_max, int *indices)
 {
 	for(int i=0; i<MAX_VERTEX_COUNT; i++)
-		indices[i] = obj_convert_to_list_index(current_max, indices[i]);
+		indices[i] = obj_convert_to_chunk_index(current_max, indices[i]);
+}
+
+//moves a chunk index to the merged list, chunk_first being where the chunk's items start
+static int obj_fix_chunk_index(int chunk_first, int index)
+{
+	if(index < -1)
+		return index + OBJ_RELATIVE_INDEX_BIAS + chunk_first;
+	
+	return index;
 }
 
 static void obj_set_material_defaults(obj_material *mtl)
@@ -459,137 +527,272 @@ static void obj_set_material_defaults(obj_material *mtl)
 	mtl->texture_filename[0] = '\0';
 }
 
-static int obj_parse_vertex_index(int *vertex_index, int *texture_index, int *normal_index)
+// Lines are parsed straight from the memory of the file, which isn't NUL
+// terminated, so tokens are [begin, end) ranges instead of strtok strings
+
+static char obj_is_space(char c)
 {
-	char *temp_str;
-	char *token;
-	int vertex_count = 0;
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static const char* obj_skip_space(const char *p, const char *end)
+{
+	while(p < end && obj_is_space(*p))
+		p++;
+	return p;
+}
+
+static const char* obj_token_end(const char *p, const char *end)
+{
+	while(p < end && !obj_is_space(*p))
+		p++;
+	return p;
+}
+
+static char obj_token_equal(const char *begin, const char *end, const char *word)
+{
+	size_t length = strlen(word);
+	return (size_t)(end - begin) == length && strncmp(begin, word, length) == 0;
+}
+
+//copies a token to a NUL terminated buffer, cutting it to the buffer's size
+static void obj_copy_token(char *buffer, size_t size, const char *begin, const char *end)
+{
+	size_t length = end - begin;
+	if(length > size - 1)
+		length = size - 1;
+	
+	memcpy(buffer, begin, length);
+	buffer[length] = '\0';
+}
+
+//atoi of the start of a token
+static int obj_parse_int(const char *p, const char *end)
+{
+	int negative = 0;
+	int value = 0;
 	
+	if(p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
 	
-	while( (token = strtok(NULL, WHITESPACE)) != NULL)
+	while(p < end && *p >= '0' && *p <= '9')
+		value = value * 10 + (*p++ - '0');
+	
+	return negative ? -value : value;
+}
+
+//atof of the start of a token. Numbers of up to 19 significant digits with a
+//small exponent are a product or quotient of two exactly representable doubles,
+//which is rounded correctly. Anything else goes through atof.
+static double obj_parse_double(const char *begin, const char *end)
+{
+	static const double powers_of_ten[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	
+	const char *p = begin;
+	unsigned long long mantissa = 0;
+	int significant_digits = 0;
+	int digits = 0;
+	int exponent = 0;
+	int negative = 0;
+	char truncated = 0;
+	
+	if(p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	
+	for(; p < end && *p >= '0' && *p <= '9'; p++, digits++)
 	{
+		if(significant_digits < OBJ_MAX_FAST_DIGITS)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			significant_digits += mantissa != 0;
+		}
+		else
+			truncated = 1;
+	}
+	
+	if(p < end && *p == '.')
+	{
+		for(p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		{
+			if(significant_digits < OBJ_MAX_FAST_DIGITS)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				significant_digits += mantissa != 0;
+				exponent--;
+			}
+			else
+				truncated = 1;
+		}
+	}
+	
+	if(digits > 0 && p + 1 < end && (*p == 'e' || *p == 'E'))
+	{
+		const char *e = p + 1;
+		int exponent_negative = 0;
+		int value = 0;
+		
+		if(*e == '-' || *e == '+')
+			exponent_negative = *e++ == '-';
+		
+		for(; e < end && *e >= '0' && *e <= '9'; e++)
+		{
+			if(value < 10000)
+				value = value * 10 + (*e - '0');
+		}
+		
+		exponent += exponent_negative ? -value : value;
+	}
+	
+	if(digits == 0 || truncated || mantissa > (1ULL << 53) || exponent < -22 || exponent > 22)
+	{
+		char buffer[OBJ_NUMBER_SIZE];
+		obj_copy_token(buffer, sizeof(buffer), begin, obj_token_end(begin, end));
+		return atof(buffer);
+	}
+	
+	double value = (double)mantissa;
+	value = exponent < 0 ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+	
+	return negative ? -value : value;
+}
+
+//reads the v, v/t, v/t/n or v//n tokens of a line, indices that are left out are 0
+static int obj_parse_vertex_index(const char *p, const char *end, int *vertex_index, int *texture_index, int *normal_index)
+{
+	int vertex_count = 0;
+	
+	for(p = obj_skip_space(p, end); p < end && vertex_count < MAX_VERTEX_COUNT; p = obj_skip_space(p, end))
+	{
+		const char *token_end = obj_token_end(p, end);
+		const char *slash = (const char*)memchr(p, '/', token_end - p);
+		
 		if(texture_index != NULL)
 			texture_index[vertex_count] = 0;
 		if(normal_index != NULL)
 			normal_index[vertex_count] = 0;
 		
-		vertex_index[vertex_count] = atoi( token );
+		vertex_index[vertex_count] = obj_parse_int(p, token_end);
 		
-		if(contains(token, "//"))  //normal only
+		if(slash != NULL)
 		{
-			temp_str = strchr(token, '/');
-			temp_str++;
-			normal_index[vertex_count] = atoi( ++temp_str );
-		}
-		else if(contains(token, "/"))
-		{
-			temp_str = strchr(token, '/');
-			texture_index[vertex_count] = atoi( ++temp_str );
+			const char *second_slash = (const char*)memchr(slash + 1, '/', token_end - slash - 1);
 			
-			if(contains(temp_str, "/"))
+			if(second_slash == slash + 1)  //normal only
 			{
-				temp_str = strchr(temp_str, '/');
-				normal_index[vertex_count] = atoi( ++temp_str );
+				if(normal_index != NULL)
+					normal_index[vertex_count] = obj_parse_int(second_slash + 1, token_end);
+			}
+			else
+			{
+				if(texture_index != NULL)
+					texture_index[vertex_count] = obj_parse_int(slash + 1, token_end);
+				
+				if(second_slash != NULL && normal_index != NULL)
+					normal_index[vertex_count] = obj_parse_int(second_slash + 1, token_end);
 			}
 		}
 		
 		vertex_count++;
+		p = token_end;
 	}
 	
 	return vertex_count;
 }
 
-static obj_face* obj_parse_face(obj_growable_scene_data *scene)
+//splits the face into a fan of triangles, its texture and normal indices aren't kept
+static void obj_parse_face(obj_growable_scene_data *scene, const char *p, const char *end, int material_index)
 {
-	int vertex_count;
-	obj_face *face = (obj_face*)calloc(1, sizeof(obj_face));
-	
-	vertex_count = obj_parse_vertex_index(face->vertex_index, face->texture_index, face->normal_index);
-	obj_convert_to_list_index_v(scene->vertex_list.item_count, face->vertex_index);
-	obj_convert_to_list_index_v(scene->vertex_texture_list.item_count, face->texture_index);
-	obj_convert_to_list_index_v(scene->vertex_normal_list.item_count, face->normal_index);
-	face->vertex_count = vertex_count;
+	int vertex_index[MAX_VERTEX_COUNT] = {0};
+	int vertex_count = obj_parse_vertex_index(p, end, vertex_index, NULL, NULL);
+	obj_convert_to_chunk_index_v(scene->vertex_list.item_count, vertex_index);
 	
-	return face;
+	for(int i=2; i<vertex_count; i++)
+	{
+		int *triangle = (int*)obj_array_add_item(&scene->triangle_vertex_list);
+		triangle[0] = vertex_index[0];
+		triangle[1] = vertex_index[i-1];
+		triangle[2] = vertex_index[i];
+		
+		*(int*)obj_array_add_item(&scene->triangle_material_list) = material_index;
+	}
 }
 
-static obj_sphere* obj_parse_sphere(obj_growable_scene_data *scene)
+static obj_sphere* obj_parse_sphere(obj_growable_scene_data *scene, const char *p, const char *end)
 {
-	int temp_indices[MAX_VERTEX_COUNT];
+	int temp_indices[MAX_VERTEX_COUNT] = {0};
 	
-	obj_sphere *obj = (obj_sphere*)malloc(sizeof(obj_sphere));
-	obj_parse_vertex_index(temp_indices, obj->texture_index, NULL);
-	obj_convert_to_list_index_v(scene->vertex_texture_list.item_count, obj->texture_index);
-	obj->pos_index = obj_convert_to_list_index(scene->vertex_list.item_count, temp_indices[0]);
-	obj->up_normal_index = obj_convert_to_list_index(scene->vertex_normal_list.item_count, temp_indices[1]);
-	obj->equator_normal_index = obj_convert_to_list_index(scene->vertex_normal_list.item_count, temp_indices[2]);
+	obj_sphere *obj = (obj_sphere*)calloc(1, sizeof(obj_sphere));
+	obj_parse_vertex_index(p, end, temp_indices, obj->texture_index, NULL);
+	obj_convert_to_chunk_index_v(scene->vertex_texture_list.item_count, obj->texture_index);
+	obj->pos_index = obj_convert_to_chunk_index(scene->vertex_list.item_count, temp_indices[0]);
+	obj->up_normal_index = obj_convert_to_chunk_index(scene->vertex_normal_list.item_count, temp_indices[1]);
+	obj->equator_normal_index = obj_convert_to_chunk_index(scene->vertex_normal_list.item_count, temp_indices[2]);
 	
 	return obj;
 }
 
-static obj_plane* obj_parse_plane(obj_growable_scene_data *scene)
+static obj_plane* obj_parse_plane(obj_growable_scene_data *scene, const char *p, const char *end)
 {
-	int temp_indices[MAX_VERTEX_COUNT];
+	int temp_indices[MAX_VERTEX_COUNT] = {0};
 	
-	obj_plane *obj = (obj_plane*)malloc(sizeof(obj_plane));
-	obj_parse_vertex_index(temp_indices, obj->texture_index, NULL);
-	obj_convert_to_list_index_v(scene->vertex_texture_list.item_count, obj->texture_index);
-	obj->pos_index = obj_convert_to_list_index(scene->vertex_list.item_count, temp_indices[0]);
-	obj->normal_index = obj_convert_to_list_index(scene->vertex_normal_list.item_count, temp_indices[1]);
-	obj->rotation_normal_index = obj_convert_to_list_index(scene->vertex_normal_list.item_count, temp_indices[2]);
+	obj_plane *obj = (obj_plane*)calloc(1, sizeof(obj_plane));
+	obj_parse_vertex_index(p, end, temp_indices, obj->texture_index, NULL);
+	obj_convert_to_chunk_index_v(scene->vertex_texture_list.item_count, obj->texture_index);
+	obj->pos_index = obj_convert_to_chunk_index(scene->vertex_list.item_count, temp_indices[0]);
+	obj->normal_index = obj_convert_to_chunk_index(scene->vertex_normal_list.item_count, temp_indices[1]);
+	obj->rotation_normal_index = obj_convert_to_chunk_index(scene->vertex_normal_list.item_count, temp_indices[2]);
 	
 	return obj;
 }
 
-static obj_light_point* obj_parse_light_point(obj_growable_scene_data *scene)
+static obj_light_point* obj_parse_light_point(obj_growable_scene_data *scene, const char *p, const char *end)
 {
 	obj_light_point *o= (obj_light_point*)malloc(sizeof(obj_light_point));
-	o->pos_index = obj_convert_to_list_index(scene->vertex_list.item_count, atoi( strtok(NULL, WHITESPACE)) );
+	o->pos_index = obj_convert_to_chunk_index(scene->vertex_list.item_count, obj_parse_int(obj_skip_space(p, end), end));
 	return o;
 }
 
-static obj_light_quad* obj_parse_light_quad(obj_growable_scene_data *scene)
+static obj_light_quad* obj_parse_light_quad(obj_growable_scene_data *scene, const char *p, const char *end)
 {
-	obj_light_quad *o = (obj_light_quad*)malloc(sizeof(obj_light_quad));
-	obj_parse_vertex_index(o->vertex_index, NULL, NULL);
-	obj_convert_to_list_index_v(scene->vertex_list.item_count, o->vertex_index);
+	obj_light_quad *o = (obj_light_quad*)calloc(1, sizeof(obj_light_quad));
+	obj_parse_vertex_index(p, end, o->vertex_index, NULL, NULL);
+	obj_convert_to_chunk_index_v(scene->vertex_list.item_count, o->vertex_index);
 	
 	return o;
 }
 
-static obj_light_disc* obj_parse_light_disc(obj_growable_scene_data *scene)
+static obj_light_disc* obj_parse_light_disc(obj_growable_scene_data *scene, const char *p, const char *end)
 {
-	int temp_indices[MAX_VERTEX_COUNT];
+	int temp_indices[MAX_VERTEX_COUNT] = {0};
 	
 	obj_light_disc *obj = (obj_light_disc*)malloc(sizeof(obj_light_disc));
-	obj_parse_vertex_index(temp_indices, NULL, NULL);
-	obj->pos_index = obj_convert_to_list_index(scene->vertex_list.item_count, temp_indices[0]);
-	obj->normal_index = obj_convert_to_list_index(scene->vertex_normal_list.item_count, temp_indices[1]);
+	obj_parse_vertex_index(p, end, temp_indices, NULL, NULL);
+	obj->pos_index = obj_convert_to_chunk_index(scene->vertex_list.item_count, temp_indices[0]);
+	obj->normal_index = obj_convert_to_chunk_index(scene->vertex_normal_list.item_count, temp_indices[1]);
 	
 	return obj;
 }
 
-static obj_vector* obj_parse_vector()
+static void obj_parse_vector(float *v, const char *p, const char *end)
 {
-	obj_vector *v = (obj_vector*)malloc(sizeof(obj_vector));
-	size_t const tokCount = 3;
-	char const * tok;
-	for(size_t i=0; i<tokCount; i++) {
-		tok = strtok(NULL, WHITESPACE);
-		if(tok != NULL)
-			v->e[i] = atof( tok );
+	for(int i=0; i<3; i++)
+	{
+		p = obj_skip_space(p, end);
+		v[i] = p < end ? (float)obj_parse_double(p, end) : 0;
+		p = obj_token_end(p, end);
 	}
-	
-	return v;
 }
 
-static void obj_parse_camera(obj_growable_scene_data *scene, obj_camera *camera)
+static void obj_parse_camera(obj_growable_scene_data *scene, obj_camera *camera, const char *p, const char *end)
 {
-	int indices[3];
-	obj_parse_vertex_index(indices, NULL, NULL);
-	camera->camera_pos_index = obj_convert_to_list_index(scene->vertex_list.item_count, indices[0]);
-	camera->camera_look_point_index = obj_convert_to_list_index(scene->vertex_list.item_count, indices[1]);
-	camera->camera_up_norm_index = obj_convert_to_list_index(scene->vertex_normal_list.item_count, indices[2]);
+	int indices[MAX_VERTEX_COUNT] = {0};
+	obj_parse_vertex_index(p, end, indices, NULL, NULL);
+	camera->camera_pos_index = obj_convert_to_chunk_index(scene->vertex_list.item_count, indices[0]);
+	camera->camera_look_point_index = obj_convert_to_chunk_index(scene->vertex_list.item_count, indices[1]);
+	camera->camera_up_norm_index = obj_convert_to_chunk_index(scene->vertex_normal_list.item_count, indices[2]);
 }
 
 static int obj_parse_mtl_file(const char *filename, list *material_list)
@@ -702,203 +905,527 @@ static int obj_parse_mtl_file(const char *filename, list *material_list)
 	
 }
 
-static int obj_parse_obj_file(obj_growable_scene_data *growable_data, const char *filename)
+static void obj_init_temp_storage(obj_growable_scene_data *growable_data)
 {
-	FILE* obj_file_stream;
-	int current_material = -1;
-	char *current_token = NULL;
-	char current_line[OBJ_LINE_SIZE];
-	int line_number = 0;
-	// open scene
-	obj_file_stream = fopen( filename, "r");
-	if(obj_file_stream == 0)
+	obj_array_make(&growable_data->vertex_list, 64, 3 * sizeof(float));
+	obj_array_make(&growable_data->vertex_normal_list, 64, 3 * sizeof(float));
+	obj_array_make(&growable_data->vertex_texture_list, 64, 3 * sizeof(float));
+	
+	obj_array_make(&growable_data->triangle_vertex_list, 64, 3 * sizeof(int));
+	obj_array_make(&growable_data->triangle_material_list, 64, sizeof(int));
+	list_make(&growable_data->sphere_list, 10, 1);
+	list_make(&growable_data->plane_list, 10, 1);
+	
+	list_make(&growable_data->light_point_list, 10, 1);
+	list_make(&growable_data->light_quad_list, 10, 1);
+	list_make(&growable_data->light_disc_list, 10, 1);
+	
+	list_make(&growable_data->material_list, 10, 1);
+	
+	growable_data->camera = NULL;
+}
+
+static void obj_free_temp_storage(obj_growable_scene_data *growable_data)
+{
+	obj_array_free(&growable_data->vertex_list);
+	obj_array_free(&growable_data->vertex_normal_list);
+	obj_array_free(&growable_data->vertex_texture_list);
+	
+	obj_array_free(&growable_data->triangle_vertex_list);
+	obj_array_free(&growable_data->triangle_material_list);
+	obj_free_half_list(&growable_data->sphere_list);
+	obj_free_half_list(&growable_data->plane_list);
+	
+	obj_free_half_list(&growable_data->light_point_list);
+	obj_free_half_list(&growable_data->light_quad_list);
+	obj_free_half_list(&growable_data->light_disc_list);
+	
+	obj_free_half_list(&growable_data->material_list);
+}
+
+// A usemtl or mtllib line. Materials are only known once the libraries before
+// them are loaded, so these are replayed in file order after the chunks are parsed.
+typedef struct obj_chunk_event
+{
+	char is_library;
+	char name[OBJ_FILENAME_LENGTH];
+	int material_index;  //picked by a usemtl, set when replaying
+} obj_chunk_event;
+
+typedef struct obj_chunk_message
+{
+	int line_number;  //in the chunk
+	char command[OBJ_LINE_SIZE];
+	char line[OBJ_LINE_SIZE];  //cut short if it's longer
+} obj_chunk_message;
+
+// Piece of the obj file starting at a line, parsed on its own. Indices relative
+// to the end of a list can point into earlier chunks, so they are kept relative
+// until the chunks are merged, and the material of an object is the index of the
+// usemtl event picking it, or -1 for the material in use at the chunk's start.
+typedef struct obj_chunk
+{
+	const char *begin;
+	const char *end;
+	int line_count;
+	
+	obj_growable_scene_data data;
+	list events;
+	list messages;
+	
+	//set when merging
+	int start_material;
+	int first_vertex;
+	int first_normal;
+	int first_texture;
+	int first_triangle;
+	int first_sphere;
+	int first_plane;
+	int first_light_point;
+	int first_light_quad;
+	int first_light_disc;
+} obj_chunk;
+
+typedef struct obj_parse_context
+{
+	obj_chunk *chunks;
+	obj_scene_data *data_out;
+} obj_parse_context;
+
+typedef struct obj_file_map
+{
+	const char *data;
+	size_t size;
+} obj_file_map;
+
+//maps up to length bytes from the start of the file, all of which are read
+//soon, so the system is asked to read them in at once
+static int obj_map_file_prefix(obj_file_map *map, const char *filename, size_t length)
+{
+	map->data = NULL;
+	map->size = 0;
+	
+#ifdef _WIN32
+	FILE *file = fopen(filename, "rb");
+	if(file == 0)
+		return 0;
+	
+	_fseeki64(file, 0, SEEK_END);
+	__int64 size = _ftelli64(file);
+	_fseeki64(file, 0, SEEK_SET);
+	
+	if(size > 0 && (unsigned __int64)size > length)
+		size = length;
+	
+	if(size > 0)
 	{
-		fprintf(stderr, "Error reading file: %s\n", filename);
+		char *data = (char*)malloc(size);
+		map->size = fread(data, 1, size, file);
+		map->data = data;
+	}
+	
+	fclose(file);
+	return 1;
+#else
+	struct stat info;
+	int file = open(filename, O_RDONLY);
+	if(file < 0)
+		return 0;
+	
+	if(fstat(file, &info) != 0)
+	{
+		close(file);
 		return 0;
 	}
 	
-	char const * lastSlash = filename;
-	while( NULL != strstr(lastSlash, "/"))
-		lastSlash = strstr(lastSlash, "/")+1;
-	size_t slashPos = lastSlash - filename;
+	size_t size = (size_t)info.st_size < length ? (size_t)info.st_size : length;
+	
+	if(size > 0)
+	{
+		void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+		if(data == MAP_FAILED)
+		{
+			close(file);
+			return 0;
+		}
+		
+		madvise(data, size, MADV_WILLNEED);
+		map->data = (const char*)data;
+		map->size = size;
+	}
 	
-	/*
-	 extreme_dimensions[0].x = INFINITY; extreme_dimensions[0].y = INFINITY; extreme_dimensions[0].z = INFINITY;
-	 extreme_dimensions[1].x = -INFINITY; extreme_dimensions[1].y = -INFINITY; extreme_dimensions[1].z = -INFINITY;
-	 
-	 if(v->x < extreme_dimensions[0].x) extreme_dimensions[0].x = v->x;
-	 if(v->x > extreme_dimensions[1].x) extreme_dimensions[1].x = v->x;
-	 if(v->y < extreme_dimensions[0].y) extreme_dimensions[0].y = v->y;
-	 if(v->y > extreme_dimensions[1].y) extreme_dimensions[1].y = v->y;
-	 if(v->z < extreme_dimensions[0].z) extreme_dimensions[0].z = v->z;
-	 if(v->z > extreme_dimensions[1].z) extreme_dimensions[1].z = v->z;*/
+	//the mapping outlives the descriptor
+	close(file);
+	return 1;
+#endif
+}
+
+//every chunk of an obj file is parsed at once
+static int obj_map_file(obj_file_map *map, const char *filename)
+{
+	return obj_map_file_prefix(map, filename, (size_t)-1);
+}
+
+static void obj_unmap_file(obj_file_map *map)
+{
+	if(map->size == 0)
+		return;
 	
+#ifdef _WIN32
+	free((void*)map->data);
+#else
+	munmap((void*)map->data, map->size);
+#endif
+}
+
+static void obj_serial_executor(size_t count, obj_job job, void *context, void *executor_data)
+{
+	(void)executor_data;
+	
+	for(size_t i=0; i<count; i++)
+		job(i, context);
+}
+
+static void obj_parse_chunk(size_t index, void *context)
+{
+	obj_chunk *chunk = ((obj_parse_context*)context)->chunks + index;
+	obj_growable_scene_data *growable_data = &chunk->data;
+	int current_event = -1;
+	const char *line = chunk->begin;
+	
+	obj_init_temp_storage(growable_data);
+	list_make(&chunk->events, 10, 1);
+	list_make(&chunk->messages, 10, 1);
+	chunk->line_count = 0;
 	
 	//parser loop
-	while( fgets(current_line, OBJ_LINE_SIZE, obj_file_stream) )
+	while(line < chunk->end)
 	{
-		current_token = strtok( current_line, " \t\n\r");
-		line_number++;
+		const char *line_start = line;
+		const char *line_end = (const char*)memchr(line, '\n', chunk->end - line);
+		if(line_end == NULL)
+			line_end = chunk->end;
+		
+		const char *current_token = obj_skip_space(line, line_end);
+		const char *token_end = obj_token_end(current_token, line_end);
+		
+		line = line_end < chunk->end ? line_end + 1 : line_end;
+		chunk->line_count++;
 		
 		//skip comments
-		if( current_token == NULL || current_token[0] == '#')
+		if( current_token == token_end || current_token[0] == '#')
 			continue;
 		
 		//parse objects
-		else if( strequal(current_token, "v") ) //process vertex
+		else if( obj_token_equal(current_token, token_end, "v") ) //process vertex
 		{
-			list_add_item(&growable_data->vertex_list,  obj_parse_vector(), NULL);
+			obj_parse_vector((float*)obj_array_add_item(&growable_data->vertex_list), token_end, line_end);
 		}
 		
-		else if( strequal(current_token, "vn") ) //process vertex normal
+		else if( obj_token_equal(current_token, token_end, "vn") ) //process vertex normal
 		{
-			list_add_item(&growable_data->vertex_normal_list,  obj_parse_vector(), NULL);
+			obj_parse_vector((float*)obj_array_add_item(&growable_data->vertex_normal_list), token_end, line_end);
 		}
 		
-		else if( strequal(current_token, "vt") ) //process vertex texture
+		else if( obj_token_equal(current_token, token_end, "vt") ) //process vertex texture
 		{
-			list_add_item(&growable_data->vertex_texture_list,  obj_parse_vector(), NULL);
+			obj_parse_vector((float*)obj_array_add_item(&growable_data->vertex_texture_list), token_end, line_end);
 		}
 		
-		else if( strequal(current_token, "f") ) //process face
+		else if( obj_token_equal(current_token, token_end, "f") ) //process face
 		{
-			obj_face *face = obj_parse_face(growable_data);
-			face->material_index = current_material;
-			list_add_item(&growable_data->face_list, face, NULL);
+			obj_parse_face(growable_data, token_end, line_end, current_event);
 		}
 		
-		else if( strequal(current_token, "sp") ) //process sphere
+		else if( obj_token_equal(current_token, token_end, "sp") ) //process sphere
 		{
-			obj_sphere *sphr = obj_parse_sphere(growable_data);
-			sphr->material_index = current_material;
+			obj_sphere *sphr = obj_parse_sphere(growable_data, token_end, line_end);
+			sphr->material_index = current_event;
 			list_add_item(&growable_data->sphere_list, sphr, NULL);
 		}
 		
-		else if( strequal(current_token, "pl") ) //process plane
+		else if( obj_token_equal(current_token, token_end, "pl") ) //process plane
 		{
-			obj_plane *pl = obj_parse_plane(growable_data);
-			pl->material_index = current_material;
+			obj_plane *pl = obj_parse_plane(growable_data, token_end, line_end);
+			pl->material_index = current_event;
 			list_add_item(&growable_data->plane_list, pl, NULL);
 		}
 		
-		else if( strequal(current_token, "p") ) //process point
+		else if( obj_token_equal(current_token, token_end, "p") ) //process point
 		{
 			//make a small sphere to represent the point?
 		}
 		
-		else if( strequal(current_token, "lp") ) //light point source
+		else if( obj_token_equal(current_token, token_end, "lp") ) //light point source
 		{
-			obj_light_point *o = obj_parse_light_point(growable_data);
-			o->material_index = current_material;
+			obj_light_point *o = obj_parse_light_point(growable_data, token_end, line_end);
+			o->material_index = current_event;
 			list_add_item(&growable_data->light_point_list, o, NULL);
 		}
 		
-		else if( strequal(current_token, "ld") ) //process light disc
+		else if( obj_token_equal(current_token, token_end, "ld") ) //process light disc
 		{
-			obj_light_disc *o = obj_parse_light_disc(growable_data);
-			o->material_index = current_material;
+			obj_light_disc *o = obj_parse_light_disc(growable_data, token_end, line_end);
+			o->material_index = current_event;
 			list_add_item(&growable_data->light_disc_list, o, NULL);
 		}
 		
-		else if( strequal(current_token, "lq") ) //process light quad
+		else if( obj_token_equal(current_token, token_end, "lq") ) //process light quad
 		{
-			obj_light_quad *o = obj_parse_light_quad(growable_data);
-			o->material_index = current_material;
+			obj_light_quad *o = obj_parse_light_quad(growable_data, token_end, line_end);
+			o->material_index = current_event;
 			list_add_item(&growable_data->light_quad_list, o, NULL);
 		}
 		
-		else if( strequal(current_token, "c") ) //camera
+		else if( obj_token_equal(current_token, token_end, "c") ) //camera
 		{
-			growable_data->camera = (obj_camera*) malloc(sizeof(obj_camera));
-			obj_parse_camera(growable_data, growable_data->camera);
+			if(growable_data->camera == NULL)
+				growable_data->camera = (obj_camera*) malloc(sizeof(obj_camera));
+			obj_parse_camera(growable_data, growable_data->camera, token_end, line_end);
 		}
 		
-		else if( strequal(current_token, "usemtl") ) // usemtl
+		else if( obj_token_equal(current_token, token_end, "usemtl") || obj_token_equal(current_token, token_end, "mtllib") )
 		{
-			current_material = list_find(&growable_data->material_list, strtok(NULL, WHITESPACE));
-		}
-		
-		else if( strequal(current_token, "mtllib") ) // mtllib
-		{
-			strncpy(growable_data->material_filename, filename, slashPos);
-			strncpy(growable_data->material_filename+slashPos, strtok(NULL, WHITESPACE), OBJ_FILENAME_LENGTH-slashPos);
-			obj_parse_mtl_file(growable_data->material_filename, &growable_data->material_list);
-			continue;
+			const char *name = obj_skip_space(token_end, line_end);
+			obj_chunk_event *event = (obj_chunk_event*) malloc(sizeof(obj_chunk_event));
+			
+			event->is_library = current_token[0] == 'm';
+			event->material_index = -1;
+			obj_copy_token(event->name, sizeof(event->name), name, obj_token_end(name, line_end));
+			
+			int event_index = list_add_item(&chunk->events, event, NULL);
+			if(!event->is_library)
+				current_event = event_index;
 		}
 		
-		else if( strequal(current_token, "o") ) //object name
+		else if( obj_token_equal(current_token, token_end, "o") ) //object name
 		{ }
-		else if( strequal(current_token, "s") ) //smoothing
+		else if( obj_token_equal(current_token, token_end, "s") ) //smoothing
 		{ }
-		else if( strequal(current_token, "g") ) // group
+		else if( obj_token_equal(current_token, token_end, "g") ) // group
 		{ }
 		
 		else
 		{
-			printf("Unknown command '%s' in scene code at line %i: \"%s\".\n",
-				   current_token, line_number, current_line);
+			obj_chunk_message *message = (obj_chunk_message*) malloc(sizeof(obj_chunk_message));
+			message->line_number = chunk->line_count;
+			obj_copy_token(message->command, sizeof(message->command), current_token, token_end);
+			obj_copy_token(message->line, sizeof(message->line), line_start, line_end);
+			list_add_item(&chunk->messages, message, NULL);
 		}
 	}
-	
-	fclose(obj_file_stream);
-	
-	return 1;
 }
 
+static void obj_free_chunk_items(list *listo)
+{
+	for(int i=0; i<listo->item_count; i++)
+		free(listo->items[i]);
+	list_free(listo);
+}
 
-static void obj_init_temp_storage(obj_growable_scene_data *growable_data)
+static void obj_fix_chunk_index_v(int chunk_first, int *indices)
+{
+	for(int i=0; i<MAX_VERTEX_COUNT; i++)
+		indices[i] = obj_fix_chunk_index(chunk_first, indices[i]);
+}
+
+static int obj_fix_chunk_material(obj_chunk *chunk, int material_index)
+{
+	if(material_index < 0)
+		return chunk->start_material;
+	return ((obj_chunk_event*)chunk->events.items[material_index])->material_index;
+}
+
+//moves the items of a chunk to their place in the merged lists
+static void obj_merge_chunk(size_t index, void *context)
 {
-	list_make(&growable_data->vertex_list, 10, 1);
-	list_make(&growable_data->vertex_normal_list, 10, 1);
-	list_make(&growable_data->vertex_texture_list, 10, 1);
+	obj_chunk *chunk = ((obj_parse_context*)context)->chunks + index;
+	obj_scene_data *data_out = ((obj_parse_context*)context)->data_out;
+	obj_growable_scene_data *growable_data = &chunk->data;
+	int i;
 	
-	list_make(&growable_data->face_list, 10, 1);
-	list_make(&growable_data->sphere_list, 10, 1);
-	list_make(&growable_data->plane_list, 10, 1);
+	memcpy(data_out->vertex_list + 3 * chunk->first_vertex, growable_data->vertex_list.items,
+		growable_data->vertex_list.item_count * 3 * sizeof(float));
+	memcpy(data_out->vertex_normal_list + 3 * chunk->first_normal, growable_data->vertex_normal_list.items,
+		growable_data->vertex_normal_list.item_count * 3 * sizeof(float));
+	memcpy(data_out->vertex_texture_list + 3 * chunk->first_texture, growable_data->vertex_texture_list.items,
+		growable_data->vertex_texture_list.item_count * 3 * sizeof(float));
 	
-	list_make(&growable_data->light_point_list, 10, 1);
-	list_make(&growable_data->light_quad_list, 10, 1);
-	list_make(&growable_data->light_disc_list, 10, 1);
+	int *chunk_triangles = (int*)growable_data->triangle_vertex_list.items;
+	int *chunk_materials = (int*)growable_data->triangle_material_list.items;
+	int *triangles = data_out->triangle_vertex_list + 3 * chunk->first_triangle;
+	int *materials = data_out->triangle_material_list + chunk->first_triangle;
 	
-	list_make(&growable_data->material_list, 10, 1);
+	for(i=0; i<growable_data->triangle_vertex_list.item_count; i++)
+	{
+		triangles[3*i] = obj_fix_chunk_index(chunk->first_vertex, chunk_triangles[3*i]);
+		triangles[3*i+1] = obj_fix_chunk_index(chunk->first_vertex, chunk_triangles[3*i+1]);
+		triangles[3*i+2] = obj_fix_chunk_index(chunk->first_vertex, chunk_triangles[3*i+2]);
+		materials[i] = obj_fix_chunk_material(chunk, chunk_materials[i]);
+	}
 	
-	growable_data->camera = NULL;
+	for(i=0; i<growable_data->sphere_list.item_count; i++)
+	{
+		obj_sphere *sphr = (obj_sphere*)growable_data->sphere_list.items[i];
+		sphr->pos_index = obj_fix_chunk_index(chunk->first_vertex, sphr->pos_index);
+		sphr->up_normal_index = obj_fix_chunk_index(chunk->first_normal, sphr->up_normal_index);
+		sphr->equator_normal_index = obj_fix_chunk_index(chunk->first_normal, sphr->equator_normal_index);
+		obj_fix_chunk_index_v(chunk->first_texture, sphr->texture_index);
+		sphr->material_index = obj_fix_chunk_material(chunk, sphr->material_index);
+		data_out->sphere_list[chunk->first_sphere + i] = sphr;
+	}
+	
+	for(i=0; i<growable_data->plane_list.item_count; i++)
+	{
+		obj_plane *pl = (obj_plane*)growable_data->plane_list.items[i];
+		pl->pos_index = obj_fix_chunk_index(chunk->first_vertex, pl->pos_index);
+		pl->normal_index = obj_fix_chunk_index(chunk->first_normal, pl->normal_index);
+		pl->rotation_normal_index = obj_fix_chunk_index(chunk->first_normal, pl->rotation_normal_index);
+		obj_fix_chunk_index_v(chunk->first_texture, pl->texture_index);
+		pl->material_index = obj_fix_chunk_material(chunk, pl->material_index);
+		data_out->plane_list[chunk->first_plane + i] = pl;
+	}
+	
+	for(i=0; i<growable_data->light_point_list.item_count; i++)
+	{
+		obj_light_point *o = (obj_light_point*)growable_data->light_point_list.items[i];
+		o->pos_index = obj_fix_chunk_index(chunk->first_vertex, o->pos_index);
+		o->material_index = obj_fix_chunk_material(chunk, o->material_index);
+		data_out->light_point_list[chunk->first_light_point + i] = o;
+	}
+	
+	for(i=0; i<growable_data->light_quad_list.item_count; i++)
+	{
+		obj_light_quad *o = (obj_light_quad*)growable_data->light_quad_list.items[i];
+		obj_fix_chunk_index_v(chunk->first_vertex, o->vertex_index);
+		o->material_index = obj_fix_chunk_material(chunk, o->material_index);
+		data_out->light_quad_list[chunk->first_light_quad + i] = o;
+	}
+	
+	for(i=0; i<growable_data->light_disc_list.item_count; i++)
+	{
+		obj_light_disc *o = (obj_light_disc*)growable_data->light_disc_list.items[i];
+		o->pos_index = obj_fix_chunk_index(chunk->first_vertex, o->pos_index);
+		o->normal_index = obj_fix_chunk_index(chunk->first_normal, o->normal_index);
+		o->material_index = obj_fix_chunk_material(chunk, o->material_index);
+		data_out->light_disc_list[chunk->first_light_disc + i] = o;
+	}
+	
+	//the items belong to data_out now, only the lists go
+	obj_free_temp_storage(growable_data);
+	obj_free_chunk_items(&chunk->events);
+	obj_free_chunk_items(&chunk->messages);
 }
 
-static void obj_free_temp_storage(obj_growable_scene_data *growable_data)
+//hands the material and camera lines to the chunks in file order and places their items
+static void obj_replay_chunks(obj_scene_data *data_out, obj_chunk *chunks, size_t chunk_count, const char *filename)
 {
-	obj_free_half_list(&growable_data->vertex_list);
-	obj_free_half_list(&growable_data->vertex_normal_list);
-	obj_free_half_list(&growable_data->vertex_texture_list);
+	list material_list;
+	char material_filename[OBJ_FILENAME_LENGTH];
+	int current_material = -1;
+	int line_number = 0;
+	obj_camera *camera = NULL;
 	
-	obj_free_half_list(&growable_data->face_list);
-	obj_free_half_list(&growable_data->sphere_list);
-	obj_free_half_list(&growable_data->plane_list);
+	char const * lastSlash = filename;
+	while( NULL != strstr(lastSlash, "/"))
+		lastSlash = strstr(lastSlash, "/")+1;
+	size_t slashPos = lastSlash - filename;
 	
-	obj_free_half_list(&growable_data->light_point_list);
-	obj_free_half_list(&growable_data->light_quad_list);
-	obj_free_half_list(&growable_data->light_disc_list);
+	list_make(&material_list, 10, 1);
 	
-	obj_free_half_list(&growable_data->material_list);
+	memset(data_out, 0, sizeof(obj_scene_data));
+	
+	for(size_t c=0; c<chunk_count; c++)
+	{
+		obj_chunk *chunk = chunks + c;
+		obj_growable_scene_data *growable_data = &chunk->data;
+		
+		chunk->first_vertex = data_out->vertex_count;
+		chunk->first_normal = data_out->vertex_normal_count;
+		chunk->first_texture = data_out->vertex_texture_count;
+		chunk->first_triangle = data_out->triangle_count;
+		chunk->first_sphere = data_out->sphere_count;
+		chunk->first_plane = data_out->plane_count;
+		chunk->first_light_point = data_out->light_point_count;
+		chunk->first_light_quad = data_out->light_quad_count;
+		chunk->first_light_disc = data_out->light_disc_count;
+		
+		data_out->vertex_count += growable_data->vertex_list.item_count;
+		data_out->vertex_normal_count += growable_data->vertex_normal_list.item_count;
+		data_out->vertex_texture_count += growable_data->vertex_texture_list.item_count;
+		data_out->triangle_count += growable_data->triangle_vertex_list.item_count;
+		data_out->sphere_count += growable_data->sphere_list.item_count;
+		data_out->plane_count += growable_data->plane_list.item_count;
+		data_out->light_point_count += growable_data->light_point_list.item_count;
+		data_out->light_quad_count += growable_data->light_quad_list.item_count;
+		data_out->light_disc_count += growable_data->light_disc_list.item_count;
+		
+		chunk->start_material = current_material;
+		
+		for(int i=0; i<chunk->events.item_count; i++)
+		{
+			obj_chunk_event *event = (obj_chunk_event*)chunk->events.items[i];
+			
+			if(event->is_library)
+			{
+				strncpy(material_filename, filename, slashPos);
+				strncpy(material_filename+slashPos, event->name, OBJ_FILENAME_LENGTH-slashPos);
+				obj_parse_mtl_file(material_filename, &material_list);
+			}
+			else
+				event->material_index = current_material = list_find(&material_list, event->name);
+		}
+		
+		for(int i=0; i<chunk->messages.item_count; i++)
+		{
+			obj_chunk_message *message = (obj_chunk_message*)chunk->messages.items[i];
+			printf("Unknown command '%s' in scene code at line %i: \"%s\".\n",
+				   message->command, line_number + message->line_number, message->line);
+		}
+		
+		//the last camera of the file wins
+		if(growable_data->camera != NULL)
+		{
+			free(camera);
+			camera = growable_data->camera;
+			camera->camera_pos_index = obj_fix_chunk_index(chunk->first_vertex, camera->camera_pos_index);
+			camera->camera_look_point_index = obj_fix_chunk_index(chunk->first_vertex, camera->camera_look_point_index);
+			camera->camera_up_norm_index = obj_fix_chunk_index(chunk->first_normal, camera->camera_up_norm_index);
+		}
+		
+		line_number += chunk->line_count;
+	}
+	
+	data_out->vertex_list = (float*)malloc(data_out->vertex_count * 3 * sizeof(float));
+	data_out->vertex_normal_list = (float*)malloc(data_out->vertex_normal_count * 3 * sizeof(float));
+	data_out->vertex_texture_list = (float*)malloc(data_out->vertex_texture_count * 3 * sizeof(float));
+	
+	data_out->triangle_vertex_list = (int*)malloc(data_out->triangle_count * 3 * sizeof(int));
+	data_out->triangle_material_list = (int*)malloc(data_out->triangle_count * sizeof(int));
+	data_out->sphere_list = (obj_sphere**)malloc(data_out->sphere_count * sizeof(obj_sphere*));
+	data_out->plane_list = (obj_plane**)malloc(data_out->plane_count * sizeof(obj_plane*));
+	
+	data_out->light_point_list = (obj_light_point**)malloc(data_out->light_point_count * sizeof(obj_light_point*));
+	data_out->light_quad_list = (obj_light_quad**)malloc(data_out->light_quad_count * sizeof(obj_light_quad*));
+	data_out->light_disc_list = (obj_light_disc**)malloc(data_out->light_disc_count * sizeof(obj_light_disc*));
+	
+	data_out->material_count = material_list.item_count;
+	data_out->material_list = (obj_material**)material_list.items;
+	obj_free_half_list(&material_list);
+	
+	data_out->camera = camera;
 }
 
 static void delete_obj_data(obj_scene_data *data_out)
 {
 	int i;
 	
-	for(i=0; i<data_out->vertex_count; i++)
-		free(data_out->vertex_list[i]);
 	free(data_out->vertex_list);
-	for(i=0; i<data_out->vertex_normal_count; i++)
-		free(data_out->vertex_normal_list[i]);
 	free(data_out->vertex_normal_list);
-	for(i=0; i<data_out->vertex_texture_count; i++)
-		free(data_out->vertex_texture_list[i]);
 	free(data_out->vertex_texture_list);
 	
-	for(i=0; i<data_out->face_count; i++)
-		free(data_out->face_list[i]);
-	free(data_out->face_list);
+	free(data_out->triangle_vertex_list);
+	free(data_out->triangle_material_list);
 	for(i=0; i<data_out->sphere_count; i++)
 		free(data_out->sphere_list[i]);
 	free(data_out->sphere_list);
@@ -923,52 +1450,52 @@ static void delete_obj_data(obj_scene_data *data_out)
 	free(data_out->camera);
 }
 
-static void obj_copy_to_out_storage(obj_scene_data *data_out, obj_growable_scene_data *growable_data)
+static int parse_obj_scene_parallel(obj_scene_data *data_out, const char *filename, obj_executor executor, void *executor_data)
 {
-	data_out->vertex_count = growable_data->vertex_list.item_count;
-	data_out->vertex_normal_count = growable_data->vertex_normal_list.item_count;
-	data_out->vertex_texture_count = growable_data->vertex_texture_list.item_count;
-	
-	data_out->face_count = growable_data->face_list.item_count;
-	data_out->sphere_count = growable_data->sphere_list.item_count;
-	data_out->plane_count = growable_data->plane_list.item_count;
+	obj_file_map map;
+	obj_parse_context context;
 	
-	data_out->light_point_count = growable_data->light_point_list.item_count;
-	data_out->light_disc_count = growable_data->light_disc_list.item_count;
-	data_out->light_quad_count = growable_data->light_quad_list.item_count;
-	
-	data_out->material_count = growable_data->material_list.item_count;
-	
-	data_out->vertex_list = (obj_vector**)growable_data->vertex_list.items;
-	data_out->vertex_normal_list = (obj_vector**)growable_data->vertex_normal_list.items;
-	data_out->vertex_texture_list = (obj_vector**)growable_data->vertex_texture_list.items;
-	
-	data_out->face_list = (obj_face**)growable_data->face_list.items;
-	data_out->sphere_list = (obj_sphere**)growable_data->sphere_list.items;
-	data_out->plane_list = (obj_plane**)growable_data->plane_list.items;
+	// open scene
+	if( obj_map_file(&map, filename) == 0)
+	{
+		fprintf(stderr, "Error reading file: %s\n", filename);
+		return 0;
+	}
 	
-	data_out->light_point_list = (obj_light_point**)growable_data->light_point_list.items;
-	data_out->light_disc_list = (obj_light_disc**)growable_data->light_disc_list.items;
-	data_out->light_quad_list = (obj_light_quad**)growable_data->light_quad_list.items;
+	//cut the file into chunks of about OBJ_PARSE_CHUNK_SIZE, ending after a line break
+	size_t chunk_count = (map.size + OBJ_PARSE_CHUNK_SIZE - 1) / OBJ_PARSE_CHUNK_SIZE;
+	const char *file_end = map.data + map.size;
+	const char *chunk_begin = map.data;
 	
-	data_out->material_list = (obj_material**)growable_data->material_list.items;
+	context.chunks = (obj_chunk*) calloc(chunk_count > 0 ? chunk_count : 1, sizeof(obj_chunk));
+	context.data_out = data_out;
 	
-	data_out->camera = growable_data->camera;
-}
-
-static int parse_obj_scene(obj_scene_data *data_out, const char *filename)
-{
-	obj_growable_scene_data growable_data;
+	for(size_t i=0; i<chunk_count; i++)
+	{
+		const char *cut = map.data + (i+1 < chunk_count ? (i+1) * OBJ_PARSE_CHUNK_SIZE : map.size);
+		const char *line_break = NULL;
+		
+		if(chunk_begin < file_end)
+		{
+			//a line longer than a chunk leaves the next chunks empty
+			if(cut <= chunk_begin)
+				cut = chunk_begin + 1;
+			line_break = (const char*)memchr(cut - 1, '\n', file_end - (cut - 1));
+		}
+		
+		context.chunks[i].begin = chunk_begin;
+		context.chunks[i].end = line_break != NULL ? line_break + 1 : file_end;
+		chunk_begin = context.chunks[i].end;
+	}
 	
-	obj_init_temp_storage(&growable_data);
-	if( obj_parse_obj_file(&growable_data, filename) == 0)
-		return 0;
+	executor(chunk_count, obj_parse_chunk, &context, executor_data);
+	obj_replay_chunks(data_out, context.chunks, chunk_count, filename);
+	executor(chunk_count, obj_merge_chunk, &context, executor_data);
 	
-	//print_vector(NORMAL, "Max bounds are: ", &growable_data->extreme_dimensions[1]);
-	//print_vector(NORMAL, "Min bounds are: ", &growable_data->extreme_dimensions[0]);
+	data_out->file_size = map.size;
 	
-	obj_copy_to_out_storage(data_out, &growable_data);
-	obj_free_temp_storage(&growable_data);
+	free(context.chunks);
+	obj_unmap_file(&map);
 	return 1;
 }
 
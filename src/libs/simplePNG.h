@@ -21,6 +21,16 @@
 #define __SIMPLE_PNG_IEND_SIZE 0
 #define __SIMPLE_PNG_DEFLATE_BLOCK_SIZE 0xffff
 #define __SIMPLE_PNG_NUM_CHANNELS 3
+#define __SIMPLE_PNG_ROWS_PER_JOB 16
+#define __SIMPLE_PNG_IDAT_CHUNK_SIZE (1 << 17) //the zlib stream is split over idat chunks of this size so their crcs can be computed in parallel
+#define __SIMPLE_PNG_SEGMENT_SIZE (1 << 18) //filtered bytes compressed by each parallel job
+#define SIMPLE_PNG_DEFAULT_LEVEL 6 //compression levels go from 0, storing, to 9, smallest
+
+/*************** Parallel execution ***************/
+//job(index, context) is called once for every index below count, possibly concurrently and in any order
+typedef void (*simplePNG_job)(size_t index, void *context);
+//executor_data is passed through untouched, e.g. a thread pool to run the jobs on
+typedef void (*simplePNG_executor)(size_t count, simplePNG_job job, void *context, void *executor_data);
 
 /*************** Endian functions ***************/
 __SIMPLE_PNG_REQUIRE_STATIC
@@ -45,15 +55,6 @@ void __simplePNG_swap(void *data, size_t size)
 	}
 }
 
-__SIMPLE_PNG_REQUIRE_STATIC
-void __simplePNG_to_lendian(void *data, size_t size)
-{
-	if(__simplePNG_is_little_endian())
-		return;
-	else
-		__simplePNG_swap(data, size);
-}
-
 __SIMPLE_PNG_REQUIRE_STATIC
 void __simplePNG_to_bendian(void *data, size_t size)
 {
@@ -113,22 +114,37 @@ uint32_t __simplePNG_end_crc(uint32_t initial_crc, uint8_t const * data, size_t
 }
 
 /*************** zlib + deflate functions ***************/
+#define __SIMPLE_PNG_ADLER_MOD 65521 //large prime from spec
+
+//adler sums of a block as if it started the stream with a = 0, so blocks can be summed separately
 __SIMPLE_PNG_REQUIRE_STATIC
-uint32_t __simplePNG__adler32(const uint8_t* data, size_t size)
+void __simplePNG__adler32_partial(const uint8_t* data, size_t size, uint32_t* a, uint32_t* b)
 {
 	// adler sum: http://www.rfc-editor.org/rfc/rfc1950.txt
-	
-	uint16_t a = 1;
-	uint16_t b = 0;
-	uint16_t m = 65521;  //large prime from spec
+	*a = 0;
+	*b = 0;
 
 	for(size_t i=0; i<size; i++)
 	{
-		
-		uint8_t v = data[i];
-		a = (a + v) % m;
-		b = (b + a) % m;
+		*a = (*a + data[i]) % __SIMPLE_PNG_ADLER_MOD;
+		*b = (*b + *a) % __SIMPLE_PNG_ADLER_MOD;
 	}
+}
+
+//appends the partial sums of the following block of block_size bytes to a running sum
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__adler32_append(uint32_t* a, uint32_t* b, uint32_t block_a, uint32_t block_b, size_t block_size)
+{
+	//every byte of the block also adds the sum of all earlier bytes to b
+	*b = (uint32_t)((*b + (uint64_t)(block_size % __SIMPLE_PNG_ADLER_MOD) * *a + block_b) % __SIMPLE_PNG_ADLER_MOD);
+	*a = (*a + block_a) % __SIMPLE_PNG_ADLER_MOD;
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+uint32_t __simplePNG__adler32_pack(uint32_t sum_a, uint32_t sum_b)
+{
+	uint16_t a = sum_a;
+	uint16_t b = sum_b;
 
 	__simplePNG_to_bendian(&a, sizeof(a));
 	__simplePNG_to_bendian(&b, sizeof(b));
@@ -141,109 +157,672 @@ uint32_t __simplePNG__adler32(const uint8_t* data, size_t size)
 	return final;
 }
 
+/*************** deflate compression ***************/
+//deflate format: http://www.rfc-editor.org/rfc/rfc1951.txt
+#define __SIMPLE_PNG_WINDOW_SIZE 32768
+#define __SIMPLE_PNG_HASH_BITS 15
+#define __SIMPLE_PNG_MIN_MATCH 3
+#define __SIMPLE_PNG_MAX_MATCH 258
+#define __SIMPLE_PNG_BLOCK_SYMBOLS 16384 //literals and matches gathered into one deflate block
+#define __SIMPLE_PNG_LITLEN_CODES 288 //the last two are never used but take part in the fixed codes
+#define __SIMPLE_PNG_DIST_CODES 30
+#define __SIMPLE_PNG_CODE_LENGTH_CODES 19
+#define __SIMPLE_PNG_MAX_CODE_BITS 15
+#define __SIMPLE_PNG_MAX_CODE_LENGTH_BITS 7
+#define __SIMPLE_PNG_END_OF_BLOCK 256
+
+static const uint16_t __simplePNG_length_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const uint8_t __simplePNG_length_extra[31] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0};
+static const uint16_t __simplePNG_dist_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const uint8_t __simplePNG_dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+static const uint8_t __simplePNG_code_length_order[__SIMPLE_PNG_CODE_LENGTH_CODES] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+//how hard each level looks for matches, level 0 only stores. These are zlib's.
+typedef struct
+{
+	int max_chain; //candidates tried per position
+	int nice_length; //a match this long ends the search
+	int max_lazy; //matches shorter than this are dropped if the next position has a longer one, 0 for none
+	int good_length; //the next position gets a quarter of the chain after a match this long
+} __simplePNG_level_settings;
+
+static const __simplePNG_level_settings __simplePNG_levels[10] = {
+	{0, 0, 0, 0}, {4, 8, 0, 4}, {8, 16, 0, 4}, {32, 32, 0, 4}, {16, 16, 4, 4},
+	{32, 32, 16, 8}, {128, 128, 16, 8}, {256, 128, 32, 8}, {1024, 258, 128, 32}, {4096, 258, 258, 32}
+};
+
+typedef struct
+{
+	uint8_t * data;
+	size_t size;
+	size_t capacity;
+	uint64_t bits;
+	int bit_count;
+} __simplePNG_bit_writer;
+
+//a literal byte, or a match of length litlen at distance dist
+typedef struct
+{
+	uint16_t litlen;
+	uint16_t dist;
+} __simplePNG_symbol;
+
 __SIMPLE_PNG_REQUIRE_STATIC
-size_t __simplePNG__final_deflate_block_size(size_t size)
+void __simplePNG__reserve(__simplePNG_bit_writer* w, size_t extra)
 {
-	size_t def_final_block_size = size % __SIMPLE_PNG_DEFLATE_BLOCK_SIZE;
-	return def_final_block_size;
+	if(w->size + extra <= w->capacity)
+		return;
+
+	while(w->size + extra > w->capacity)
+		w->capacity = w->capacity ? w->capacity*2 : 4096;
+
+	w->data = (uint8_t*)realloc(w->data, w->capacity);
 }
 
+//deflate packs bits starting at the least significant one
 __SIMPLE_PNG_REQUIRE_STATIC
-size_t __simplePNG__deflate_block_count(size_t size)
+void __simplePNG__put_bits(__simplePNG_bit_writer* w, uint32_t value, int count)
 {
-	size_t num_deflate_blocks = size / __SIMPLE_PNG_DEFLATE_BLOCK_SIZE;
-	size_t def_final_block_size = __simplePNG__final_deflate_block_size(size);
-	if(def_final_block_size > 0)
-		num_deflate_blocks++;
+	w->bits |= (uint64_t)value << w->bit_count;
+	w->bit_count += count;
 
-	return num_deflate_blocks;
+	if(w->bit_count < 32)
+		return;
+
+	__simplePNG__reserve(w, 4);
+	while(w->bit_count >= 8)
+	{
+		w->data[w->size++] = (uint8_t)w->bits;
+		w->bits >>= 8;
+		w->bit_count -= 8;
+	}
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__align_bits(__simplePNG_bit_writer* w)
+{
+	__simplePNG__reserve(w, 8);
+	while(w->bit_count > 0)
+	{
+		w->data[w->size++] = (uint8_t)w->bits;
+		w->bits >>= 8;
+		w->bit_count -= w->bit_count < 8 ? w->bit_count : 8;
+	}
+	w->bits = 0;
 }
 
 __SIMPLE_PNG_REQUIRE_STATIC
-size_t __simplePNG__store_deflate_blocks(uint8_t* dst, const uint8_t* src, size_t size)
+int __simplePNG__floor_log2(uint32_t x)
 {
-	size_t dst_offset = 0;
-	size_t img_offset = 0;
-	size_t num_deflate_blocks = __simplePNG__deflate_block_count(size);
-	size_t def_final_block_size = __simplePNG__final_deflate_block_size(size);
-	uint16_t* u16_ptr;
+	int l = 0;
+	while(x >> (l+1))
+		l++;
+	return l;
+}
 
-	for(size_t i=0; i<num_deflate_blocks; i++)
+__SIMPLE_PNG_REQUIRE_STATIC
+int __simplePNG__length_code(int length)
+{
+	int x = length - __SIMPLE_PNG_MIN_MATCH;
+	if(x < 8)
+		return x;
+	if(length == __SIMPLE_PNG_MAX_MATCH)
+		return 28;
+
+	int l = __simplePNG__floor_log2(x);
+	return 4*(l-1) + ((x >> (l-2)) & 3);
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+int __simplePNG__dist_code(int dist)
+{
+	int x = dist - 1;
+	if(x < 4)
+		return x;
+
+	int l = __simplePNG__floor_log2(x);
+	return 2*l + ((x >> (l-1)) & 1);
+}
+
+//code lengths of an optimal prefix code for freqs that are no longer than max_bits, 0 for unused symbols
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__huffman_lengths(uint32_t const * freqs, int count, int max_bits, uint8_t * lengths)
+{
+	uint32_t weights[2*__SIMPLE_PNG_LITLEN_CODES];
+	int symbols[__SIMPLE_PNG_LITLEN_CODES];
+	int parents[2*__SIMPLE_PNG_LITLEN_CODES];
+	int depths[2*__SIMPLE_PNG_LITLEN_CODES];
+	int n = 0;
+
+	memset(lengths, 0, count);
+
+	//leaves sorted by weight
+	for(int i=0; i<count; i++)
+	{
+		if(freqs[i] == 0)
+			continue;
+
+		int j = n++;
+		for(; j>0 && weights[j-1] > freqs[i]; j--)
+		{
+			weights[j] = weights[j-1];
+			symbols[j] = symbols[j-1];
+		}
+		weights[j] = freqs[i];
+		symbols[j] = i;
+	}
+
+	if(n == 0)
+		return;
+	if(n == 1)
+	{
+		lengths[symbols[0]] = 1;
+		return;
+	}
+
+	while(1)
 	{
-		//deflate header: http://www.rfc-editor.org/rfc/rfc1951.txt
-		//1 bit : final block
-		//2 bit : type = 00 no compression
-		//next byte boundary
-		uint8_t def_final = 0x00;
-		uint8_t is_last_block = i+1 == num_deflate_blocks;
-		if(is_last_block)
-			def_final = 0x01; //first bit 1 means last block
-		uint8_t def_compression = 0x00; //no compression
-		uint8_t def_header = def_final | def_compression;
+		//the leaves and the merged nodes both come out in order of weight, so
+		//the two lightest nodes are always at the front of one of the two queues
+		int next_leaf = 0;
+		int next_node = n;
 
-		//deflate uncompressed block format
-		//2 byte : len
-		size_t block_size = __SIMPLE_PNG_DEFLATE_BLOCK_SIZE;
-		if(is_last_block)
-			block_size = def_final_block_size;
-		uint16_t def_len = block_size;
-		__simplePNG_to_lendian(&def_len, sizeof(def_len));
-		//2 byte : bitwise_not(len)
-		uint16_t def_nlen = ~def_len;
+		for(int k=n; k<2*n-1; k++)
+		{
+			int pick[2];
+			for(int p=0; p<2; p++)
+			{
+				if(next_leaf < n && (next_node >= k || weights[next_leaf] <= weights[next_node]))
+					pick[p] = next_leaf++;
+				else
+					pick[p] = next_node++;
+			}
+			weights[k] = weights[pick[0]] + weights[pick[1]];
+			parents[pick[0]] = k;
+			parents[pick[1]] = k;
+		}
 
-		dst[dst_offset] = def_header;
-		dst_offset++;
-		u16_ptr = (uint16_t*) (dst+dst_offset);
-		u16_ptr[0] = def_len;
-		u16_ptr[1] = def_nlen;
-		dst_offset += sizeof(uint16_t) * 2;
+		int max_depth = 0;
+		depths[2*n-2] = 0;
+		for(int k=2*n-3; k>=0; k--)
+		{
+			depths[k] = depths[parents[k]] + 1;
+			if(depths[k] > max_depth)
+				max_depth = depths[k];
+		}
 
-		//block data
-		memcpy(dst+dst_offset, src+img_offset, block_size);
-		img_offset += block_size;
-		dst_offset += block_size;
+		if(max_depth <= max_bits)
+			break;
+
+		//flatten the weights until the tree is shallow enough, they stay sorted
+		for(int i=0; i<n; i++)
+			weights[i] = (weights[i] + 1) / 2;
 	}
 
-	return dst_offset;
+	for(int i=0; i<n; i++)
+		lengths[symbols[i]] = depths[i];
 }
 
-/*************** fopen function ***************/
+//canonical codes for the lengths, bit reversed to be written least significant bit first
 __SIMPLE_PNG_REQUIRE_STATIC
-FILE* __simplePNG__sfopen(char const * name, char const * mode)
+void __simplePNG__huffman_codes(uint8_t const * lengths, int count, uint16_t * codes)
 {
-	FILE *file = NULL;
-	file = fopen(name, mode);
-	
-	if(file == NULL)
+	uint16_t length_count[__SIMPLE_PNG_MAX_CODE_BITS+1] = {0};
+	uint16_t next_code[__SIMPLE_PNG_MAX_CODE_BITS+1];
+
+	for(int i=0; i<count; i++)
+		length_count[lengths[i]]++;
+	length_count[0] = 0;
+
+	uint16_t code = 0;
+	for(int bits=1; bits<=__SIMPLE_PNG_MAX_CODE_BITS; bits++)
 	{
-		fprintf(stderr, "Unable to open file '%s' in mode '%s'.\n", name, mode);
-		exit(2);
+		code = (code + length_count[bits-1]) << 1;
+		next_code[bits] = code;
+	}
+
+	for(int i=0; i<count; i++)
+	{
+		int length = lengths[i];
+		if(length == 0)
+			continue;
+
+		uint16_t c = next_code[length]++;
+		uint16_t reversed = 0;
+		for(int b=0; b<length; b++)
+			reversed |= ((c >> b) & 1) << (length-1-b);
+		codes[i] = reversed;
 	}
-	
-	return file;
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__fixed_lengths(uint8_t * lit_lengths, uint8_t * dist_lengths)
+{
+	for(int i=0; i<__SIMPLE_PNG_LITLEN_CODES; i++)
+		lit_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	for(int i=0; i<__SIMPLE_PNG_DIST_CODES; i++)
+		dist_lengths[i] = 5;
+}
+
+//bits the symbols of a block take with the given lengths, including the extra bits
+__SIMPLE_PNG_REQUIRE_STATIC
+size_t __simplePNG__symbol_bits(uint32_t const * lit_freqs, uint32_t const * dist_freqs, uint8_t const * lit_lengths, uint8_t const * dist_lengths)
+{
+	size_t bits = 0;
+	for(int i=0; i<__SIMPLE_PNG_LITLEN_CODES; i++)
+	{
+		bits += (size_t)lit_freqs[i] * lit_lengths[i];
+		if(i > __SIMPLE_PNG_END_OF_BLOCK)
+			bits += (size_t)lit_freqs[i] * __simplePNG_length_extra[i - __SIMPLE_PNG_END_OF_BLOCK - 1];
+	}
+	for(int i=0; i<__SIMPLE_PNG_DIST_CODES; i++)
+		bits += (size_t)dist_freqs[i] * (dist_lengths[i] + __simplePNG_dist_extra[i]);
+	return bits;
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__write_symbols(__simplePNG_bit_writer* w, __simplePNG_symbol const * symbols, size_t count, 
+	uint8_t const * lit_lengths, uint8_t const * dist_lengths)
+{
+	uint16_t lit_codes[__SIMPLE_PNG_LITLEN_CODES];
+	uint16_t dist_codes[__SIMPLE_PNG_DIST_CODES];
+	__simplePNG__huffman_codes(lit_lengths, __SIMPLE_PNG_LITLEN_CODES, lit_codes);
+	__simplePNG__huffman_codes(dist_lengths, __SIMPLE_PNG_DIST_CODES, dist_codes);
+
+	for(size_t i=0; i<count; i++)
+	{
+		if(symbols[i].dist == 0)
+		{
+			__simplePNG__put_bits(w, lit_codes[symbols[i].litlen], lit_lengths[symbols[i].litlen]);
+			continue;
+		}
+
+		int length_code = __simplePNG__length_code(symbols[i].litlen);
+		int lit = __SIMPLE_PNG_END_OF_BLOCK + 1 + length_code;
+		__simplePNG__put_bits(w, lit_codes[lit], lit_lengths[lit]);
+		__simplePNG__put_bits(w, symbols[i].litlen - __simplePNG_length_base[length_code], __simplePNG_length_extra[length_code]);
+
+		int dist_code = __simplePNG__dist_code(symbols[i].dist);
+		__simplePNG__put_bits(w, dist_codes[dist_code], dist_lengths[dist_code]);
+		__simplePNG__put_bits(w, symbols[i].dist - __simplePNG_dist_base[dist_code], __simplePNG_dist_extra[dist_code]);
+	}
+
+	__simplePNG__put_bits(w, lit_codes[__SIMPLE_PNG_END_OF_BLOCK], lit_lengths[__SIMPLE_PNG_END_OF_BLOCK]);
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__write_stored(__simplePNG_bit_writer* w, uint8_t const * data, size_t size, int is_final)
+{
+	//an empty final block still has to be written
+	do
+	{
+		size_t block_size = size < __SIMPLE_PNG_DEFLATE_BLOCK_SIZE ? size : __SIMPLE_PNG_DEFLATE_BLOCK_SIZE;
+		int is_last_block = block_size == size;
+
+		//1 bit : final block, 2 bits : type 00 no compression, then the next byte boundary
+		__simplePNG__put_bits(w, is_final && is_last_block, 1);
+		__simplePNG__put_bits(w, 0, 2);
+		__simplePNG__align_bits(w);
+
+		//2 bytes : len, 2 bytes : bitwise_not(len)
+		__simplePNG__reserve(w, 4 + block_size);
+		w->data[w->size++] = block_size & 0xff;
+		w->data[w->size++] = block_size >> 8;
+		w->data[w->size++] = ~block_size & 0xff;
+		w->data[w->size++] = (~block_size >> 8) & 0xff;
+
+		if(block_size > 0)
+			memcpy(w->data + w->size, data, block_size);
+		w->size += block_size;
+		data += block_size;
+		size -= block_size;
+	}
+	while(size > 0);
+}
+
+//writes the symbols covering data as whichever of a dynamic, fixed or stored block is smallest
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__write_block(__simplePNG_bit_writer* w, __simplePNG_symbol const * symbols, size_t count, 
+	uint8_t const * data, size_t size, int is_final)
+{
+	uint32_t lit_freqs[__SIMPLE_PNG_LITLEN_CODES] = {0};
+	uint32_t dist_freqs[__SIMPLE_PNG_DIST_CODES] = {0};
+
+	for(size_t i=0; i<count; i++)
+	{
+		if(symbols[i].dist == 0)
+			lit_freqs[symbols[i].litlen]++;
+		else
+		{
+			lit_freqs[__SIMPLE_PNG_END_OF_BLOCK + 1 + __simplePNG__length_code(symbols[i].litlen)]++;
+			dist_freqs[__simplePNG__dist_code(symbols[i].dist)]++;
+		}
+	}
+	lit_freqs[__SIMPLE_PNG_END_OF_BLOCK] = 1;
+
+	uint8_t lit_lengths[__SIMPLE_PNG_LITLEN_CODES];
+	uint8_t dist_lengths[__SIMPLE_PNG_DIST_CODES];
+	__simplePNG__huffman_lengths(lit_freqs, __SIMPLE_PNG_LITLEN_CODES, __SIMPLE_PNG_MAX_CODE_BITS, lit_lengths);
+	__simplePNG__huffman_lengths(dist_freqs, __SIMPLE_PNG_DIST_CODES, __SIMPLE_PNG_MAX_CODE_BITS, dist_lengths);
+
+	//a block of literals still needs one distance code
+	int dist_used = 0;
+	for(int i=0; i<__SIMPLE_PNG_DIST_CODES; i++)
+		dist_used |= dist_lengths[i];
+	if(!dist_used)
+		dist_lengths[0] = 1;
+
+	int lit_count = __SIMPLE_PNG_LITLEN_CODES;
+	while(lit_count > 257 && lit_lengths[lit_count-1] == 0)
+		lit_count--;
+	int dist_count = __SIMPLE_PNG_DIST_CODES;
+	while(dist_count > 1 && dist_lengths[dist_count-1] == 0)
+		dist_count--;
+
+	//the code lengths of both codes, run length coded with symbols 16 to 18
+	uint8_t all_lengths[__SIMPLE_PNG_LITLEN_CODES + __SIMPLE_PNG_DIST_CODES];
+	memcpy(all_lengths, lit_lengths, lit_count);
+	memcpy(all_lengths + lit_count, dist_lengths, dist_count);
+	int all_count = lit_count + dist_count;
+
+	uint8_t runs[__SIMPLE_PNG_LITLEN_CODES + __SIMPLE_PNG_DIST_CODES];
+	uint8_t run_extras[__SIMPLE_PNG_LITLEN_CODES + __SIMPLE_PNG_DIST_CODES];
+	int run_count = 0;
+	uint32_t cl_freqs[__SIMPLE_PNG_CODE_LENGTH_CODES] = {0};
+
+	for(int i=0; i<all_count;)
+	{
+		int length = all_lengths[i];
+		int repeat = 1;
+		while(i + repeat < all_count && all_lengths[i + repeat] == length)
+			repeat++;
+
+		if(length == 0 && repeat >= 11)
+		{
+			repeat = repeat > 138 ? 138 : repeat;
+			runs[run_count] = 18;
+			run_extras[run_count++] = repeat - 11;
+		}
+		else if(length == 0 && repeat >= 3)
+		{
+			runs[run_count] = 17;
+			run_extras[run_count++] = repeat - 3;
+		}
+		else if(length != 0 && repeat >= 4)
+		{
+			//the first one is written out, the rest repeat it
+			repeat = repeat > 7 ? 7 : repeat;
+			runs[run_count] = length;
+			run_extras[run_count++] = 0;
+			cl_freqs[length]++;
+			runs[run_count] = 16;
+			run_extras[run_count++] = repeat - 4;
+		}
+		else
+		{
+			repeat = 1;
+			runs[run_count] = length;
+			run_extras[run_count++] = 0;
+		}
+
+		cl_freqs[runs[run_count-1]]++;
+		i += repeat;
+	}
+
+	uint8_t cl_lengths[__SIMPLE_PNG_CODE_LENGTH_CODES];
+	__simplePNG__huffman_lengths(cl_freqs, __SIMPLE_PNG_CODE_LENGTH_CODES, __SIMPLE_PNG_MAX_CODE_LENGTH_BITS, cl_lengths);
+
+	int cl_count = __SIMPLE_PNG_CODE_LENGTH_CODES;
+	while(cl_count > 4 && cl_lengths[__simplePNG_code_length_order[cl_count-1]] == 0)
+		cl_count--;
+
+	size_t dynamic_bits = 3 + 5 + 5 + 4 + 3*cl_count + __simplePNG__symbol_bits(lit_freqs, dist_freqs, lit_lengths, dist_lengths);
+	for(int i=0; i<run_count; i++)
+		dynamic_bits += cl_lengths[runs[i]] + (runs[i] == 16 ? 2 : runs[i] == 17 ? 3 : runs[i] == 18 ? 7 : 0);
+
+	uint8_t fixed_lit_lengths[__SIMPLE_PNG_LITLEN_CODES];
+	uint8_t fixed_dist_lengths[__SIMPLE_PNG_DIST_CODES];
+	__simplePNG__fixed_lengths(fixed_lit_lengths, fixed_dist_lengths);
+	size_t fixed_bits = 3 + __simplePNG__symbol_bits(lit_freqs, dist_freqs, fixed_lit_lengths, fixed_dist_lengths);
+
+	size_t stored_bits = (size + 5*(size / __SIMPLE_PNG_DEFLATE_BLOCK_SIZE + 1)) * 8 + 7;
+
+	if(stored_bits <= dynamic_bits && stored_bits <= fixed_bits)
+	{
+		__simplePNG__write_stored(w, data, size, is_final);
+		return;
+	}
+
+	__simplePNG__put_bits(w, is_final, 1);
+
+	if(fixed_bits <= dynamic_bits)
+	{
+		__simplePNG__put_bits(w, 1, 2); //type 01 fixed codes
+		__simplePNG__write_symbols(w, symbols, count, fixed_lit_lengths, fixed_dist_lengths);
+		return;
+	}
+
+	__simplePNG__put_bits(w, 2, 2); //type 10 dynamic codes
+	__simplePNG__put_bits(w, lit_count - 257, 5);
+	__simplePNG__put_bits(w, dist_count - 1, 5);
+	__simplePNG__put_bits(w, cl_count - 4, 4);
+
+	for(int i=0; i<cl_count; i++)
+		__simplePNG__put_bits(w, cl_lengths[__simplePNG_code_length_order[i]], 3);
+
+	uint16_t cl_codes[__SIMPLE_PNG_CODE_LENGTH_CODES];
+	__simplePNG__huffman_codes(cl_lengths, __SIMPLE_PNG_CODE_LENGTH_CODES, cl_codes);
+
+	for(int i=0; i<run_count; i++)
+	{
+		__simplePNG__put_bits(w, cl_codes[runs[i]], cl_lengths[runs[i]]);
+		if(runs[i] >= 16)
+			__simplePNG__put_bits(w, run_extras[i], runs[i] == 16 ? 2 : runs[i] == 17 ? 3 : 7);
+	}
+
+	__simplePNG__write_symbols(w, symbols, count, lit_lengths, dist_lengths);
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+uint32_t __simplePNG__hash(uint8_t const * p)
+{
+	return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << __SIMPLE_PNG_HASH_BITS) - 1);
+}
+
+//hash chains over the window before the position being compressed
+typedef struct
+{
+	uint8_t const * data;
+	size_t end;
+	int32_t * head;
+	int32_t * prev;
+	size_t next_insert;
+} __simplePNG_matcher;
+
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__insert_until(__simplePNG_matcher* m, size_t pos)
+{
+	for(; m->next_insert < pos && m->next_insert + __SIMPLE_PNG_MIN_MATCH <= m->end; m->next_insert++)
+	{
+		uint32_t h = __simplePNG__hash(m->data + m->next_insert);
+		m->prev[m->next_insert & (__SIMPLE_PNG_WINDOW_SIZE-1)] = m->head[h];
+		m->head[h] = (int32_t)m->next_insert;
+	}
+}
+
+//longest match for pos among the earlier positions, its length is below the minimum if there is none
+__SIMPLE_PNG_REQUIRE_STATIC
+int __simplePNG__find_match(__simplePNG_matcher* m, size_t pos, __simplePNG_level_settings const * settings, int max_chain, int* dist)
+{
+	int best_length = __SIMPLE_PNG_MIN_MATCH - 1;
+	size_t max_length = m->end - pos;
+	if(max_length > __SIMPLE_PNG_MAX_MATCH)
+		max_length = __SIMPLE_PNG_MAX_MATCH;
+	if(max_length < __SIMPLE_PNG_MIN_MATCH)
+		return 0;
+
+	__simplePNG__insert_until(m, pos);
+
+	uint8_t const * current = m->data + pos;
+	int32_t candidate = m->head[__simplePNG__hash(current)];
+
+	for(int chain=max_chain; candidate >= 0 && chain > 0; chain--)
+	{
+		if(pos - candidate > __SIMPLE_PNG_WINDOW_SIZE)
+			break;
+
+		//most candidates differ in their first bytes or can't beat the best match
+		uint8_t const * earlier = m->data + candidate;
+		if(earlier[best_length] == current[best_length] && earlier[best_length-1] == current[best_length-1] && 
+			earlier[0] == current[0] && earlier[1] == current[1])
+		{
+			size_t length = 0;
+			while(length < max_length && earlier[length] == current[length])
+				length++;
+
+			if((int)length > best_length)
+			{
+				best_length = length;
+				*dist = pos - candidate;
+				if(best_length >= settings->nice_length || length == max_length)
+					break;
+			}
+		}
+
+		//the slot may have been reused by a later position once the chain leaves the window
+		int32_t next = m->prev[candidate & (__SIMPLE_PNG_WINDOW_SIZE-1)];
+		if(next >= candidate)
+			break;
+		candidate = next;
+	}
+
+	return best_length;
+}
+
+//compresses data[start, end) into deflate blocks, data[dict_start, start) being
+//the window matches can reach back into
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__deflate(__simplePNG_bit_writer* w, uint8_t const * data, size_t dict_start, size_t start, size_t end, 
+	int level, int is_final)
+{
+	if(level == 0 || start == end)
+	{
+		__simplePNG__write_stored(w, data + start, end - start, is_final);
+		return;
+	}
+
+	__simplePNG_level_settings const * settings = &__simplePNG_levels[level];
+
+	__simplePNG_matcher m;
+	m.data = data + dict_start;
+	m.end = end - dict_start;
+	m.head = (int32_t*)malloc(sizeof(int32_t) << __SIMPLE_PNG_HASH_BITS);
+	m.prev = (int32_t*)malloc(sizeof(int32_t) * __SIMPLE_PNG_WINDOW_SIZE);
+	m.next_insert = 0;
+	memset(m.head, 0xff, sizeof(int32_t) << __SIMPLE_PNG_HASH_BITS);
+
+	__simplePNG_symbol* symbols = (__simplePNG_symbol*)malloc(sizeof(__simplePNG_symbol) * __SIMPLE_PNG_BLOCK_SYMBOLS);
+	size_t symbol_count = 0;
+	size_t block_start = start - dict_start;
+	size_t pos = block_start;
+	//the match found for pos while looking ahead from the position before, if any
+	int next_length = -1;
+	int next_dist = 0;
+
+	while(pos < m.end)
+	{
+		int dist = next_dist;
+		int length = next_length >= 0 ? next_length : __simplePNG__find_match(&m, pos, settings, settings->max_chain, &dist);
+		next_length = -1;
+
+		if(length >= __SIMPLE_PNG_MIN_MATCH && length < settings->max_lazy)
+		{
+			int next_chain = length >= settings->good_length ? settings->max_chain / 4 : settings->max_chain;
+			next_length = __simplePNG__find_match(&m, pos+1, settings, next_chain, &next_dist);
+
+			if(next_length > length)
+				length = 0;
+			else
+				next_length = -1;
+		}
+
+		if(length >= __SIMPLE_PNG_MIN_MATCH)
+		{
+			symbols[symbol_count].litlen = length;
+			symbols[symbol_count].dist = dist;
+			pos += length;
+		}
+		else
+		{
+			symbols[symbol_count].litlen = m.data[pos];
+			symbols[symbol_count].dist = 0;
+			pos++;
+		}
+		symbol_count++;
+
+		if(symbol_count == __SIMPLE_PNG_BLOCK_SYMBOLS || pos == m.end)
+		{
+			__simplePNG__write_block(w, symbols, symbol_count, m.data + block_start, pos - block_start, is_final && pos == m.end);
+			symbol_count = 0;
+			block_start = pos;
+		}
+	}
+
+	free(m.head);
+	free(m.prev);
+	free(symbols);
+}
+
+//like __simplePNG__deflate, but ends on a byte boundary so that the output of
+//the next call can simply be put after it
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__deflate_aligned(__simplePNG_bit_writer* w, uint8_t const * data, size_t dict_start, size_t start, size_t end, 
+	int level, int is_final)
+{
+	__simplePNG__deflate(w, data, dict_start, start, end, level, is_final);
+
+	//an empty stored block brings a segment that ends in the middle of a byte to the next boundary
+	if(!is_final && w->bit_count > 0)
+		__simplePNG__write_stored(w, NULL, 0, 0);
+	__simplePNG__align_bits(w);
 }
 
 /*************** PNG functions ***************/
 __SIMPLE_PNG_REQUIRE_STATIC
-void __simplePNG__write_chunk(FILE * f, uint8_t const chunk_type[__SIMPLE_PNG_CHUNK_NAME_SIZE], uint8_t const * chunk_data, uint32_t length)
+uint32_t __simplePNG__chunk_crc(uint8_t const chunk_type[__SIMPLE_PNG_CHUNK_NAME_SIZE], uint8_t const * chunk_data, uint32_t length)
+{
+	uint32_t crc_val = __simplePNG_start_crc( chunk_type, __SIMPLE_PNG_CHUNK_NAME_SIZE);
+	return __simplePNG_end_crc(crc_val, chunk_data, length);
+}
+
+//returns -1 if the chunk could not be written in full
+__SIMPLE_PNG_REQUIRE_STATIC
+int __simplePNG__write_chunk_with_crc(FILE * f, uint8_t const chunk_type[__SIMPLE_PNG_CHUNK_NAME_SIZE], uint8_t const * chunk_data, uint32_t length, uint32_t crc_val)
 {	
 	uint32_t endian_length = length;
+	int ok = 1;
 	
 	__simplePNG_to_bendian(&endian_length, sizeof(endian_length));
-	fwrite(&endian_length, sizeof(endian_length), 1, f);
+	ok &= fwrite(&endian_length, sizeof(endian_length), 1, f) == 1;
 	
-	fwrite(chunk_type, sizeof(uint8_t), __SIMPLE_PNG_CHUNK_NAME_SIZE, f);
+	ok &= fwrite(chunk_type, sizeof(uint8_t), __SIMPLE_PNG_CHUNK_NAME_SIZE, f) == __SIMPLE_PNG_CHUNK_NAME_SIZE;
 	
-	fwrite(chunk_data, sizeof(uint8_t), length, f);
+	ok &= fwrite(chunk_data, sizeof(uint8_t), length, f) == length;
 	
-	uint32_t crc_val = __simplePNG_start_crc( chunk_type, __SIMPLE_PNG_CHUNK_NAME_SIZE);
-	crc_val = __simplePNG_end_crc(crc_val, chunk_data, length);
 	__simplePNG_to_bendian(&crc_val, sizeof(crc_val));
-	fwrite(&crc_val, sizeof(crc_val), 1, f);
+	ok &= fwrite(&crc_val, sizeof(crc_val), 1, f) == 1;
+
+	return ok ? 0 : -1;
 }
 
 __SIMPLE_PNG_REQUIRE_STATIC
-void __simplePNG_write_IHDR(FILE * f, uint32_t width, uint32_t height, uint8_t const * rgb_image)
+int __simplePNG__write_chunk(FILE * f, uint8_t const chunk_type[__SIMPLE_PNG_CHUNK_NAME_SIZE], uint8_t const * chunk_data, uint32_t length)
+{
+	return __simplePNG__write_chunk_with_crc(f, chunk_type, chunk_data, length, __simplePNG__chunk_crc(chunk_type, chunk_data, length));
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+int __simplePNG_write_IHDR(FILE * f, uint32_t width, uint32_t height)
 {
 	uint8_t chunk_type[__SIMPLE_PNG_CHUNK_NAME_SIZE];
 	uint32_t* u32_ptr;
@@ -274,32 +853,226 @@ void __simplePNG_write_IHDR(FILE * f, uint32_t width, uint32_t height, uint8_t c
 	ihdr_chunk[11] = filter;
 	ihdr_chunk[12] = interlace;
 	
-	__simplePNG__write_chunk(f, chunk_type, ihdr_chunk, __SIMPLE_PNG_IHDR_SIZE);
+	return __simplePNG__write_chunk(f, chunk_type, ihdr_chunk, __SIMPLE_PNG_IHDR_SIZE);
+}
+
+typedef struct
+{
+	uint32_t width;
+	uint32_t height;
+	uint8_t const * rgb_image;
+	int level;
+	uint8_t * img_with_filter;
+	//adler sums of the filtered rows of each job
+	uint32_t * adler_a;
+	uint32_t * adler_b;
+} __simplePNG_filter_context;
+
+__SIMPLE_PNG_REQUIRE_STATIC
+uint8_t __simplePNG__paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if(pa <= pb && pa <= pc)
+		return a;
+	if(pb <= pc)
+		return b;
+	return c;
+}
+
+//filters a scanline with filter type 0 to 4, prev is the unfiltered row above or NULL for the first row
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__filter_row(uint8_t type, uint8_t const * row, uint8_t const * prev, size_t row_size, uint8_t * out)
+{
+	for(size_t x=0; x<row_size; x++)
+	{
+		uint8_t a = x >= __SIMPLE_PNG_NUM_CHANNELS ? row[x-__SIMPLE_PNG_NUM_CHANNELS] : 0;
+		uint8_t b = prev ? prev[x] : 0;
+		uint8_t c = prev && x >= __SIMPLE_PNG_NUM_CHANNELS ? prev[x-__SIMPLE_PNG_NUM_CHANNELS] : 0;
+		uint8_t predicted = 0;
+
+		switch(type)
+		{
+			case 1: predicted = a; break;
+			case 2: predicted = b; break;
+			case 3: predicted = (a + b) >> 1; break;
+			case 4: predicted = __simplePNG__paeth(a, b, c); break;
+		}
+
+		out[x] = row[x] - predicted;
+	}
+}
+
+//writes the filter byte and the filtered row to out, picking the filter for the compression level
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__filter_scanline(int level, uint8_t const * row, uint8_t const * prev, size_t row_size, uint8_t * out)
+{
+	//stored images aren't worth filtering
+	if(level == 0)
+	{
+		out[0] = 0x00; //no filter
+		memcpy(out + 1, row, row_size);
+		return;
+	}
+
+	//the filter whose output has the smallest sum as signed bytes tends to compress best
+	uint8_t best_type = 0;
+	size_t best_sum = (size_t)-1;
+	for(uint8_t type=0; type<5; type++)
+	{
+		__simplePNG__filter_row(type, row, prev, row_size, out + 1);
+
+		size_t sum = 0;
+		for(size_t x=0; x<row_size; x++)
+			sum += abs((int8_t)out[1+x]);
+
+		if(sum < best_sum)
+		{
+			best_sum = sum;
+			best_type = type;
+		}
+	}
+
+	out[0] = best_type;
+	if(best_type != 4)
+		__simplePNG__filter_row(best_type, row, prev, row_size, out + 1);
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__filter_rows(size_t job, void *context)
+{
+	__simplePNG_filter_context* ctx = (__simplePNG_filter_context*)context;
+	size_t row_size = ctx->width*__SIMPLE_PNG_NUM_CHANNELS;
+	size_t first_row = job*__SIMPLE_PNG_ROWS_PER_JOB;
+	size_t end_row = first_row + __SIMPLE_PNG_ROWS_PER_JOB;
+	if(end_row > ctx->height)
+		end_row = ctx->height;
+
+	for(size_t i=first_row; i<end_row; i++)
+	{
+		uint8_t const * row = ctx->rgb_image + i*row_size;
+		__simplePNG__filter_scanline(ctx->level, row, i > 0 ? row - row_size : NULL, row_size, ctx->img_with_filter + i*row_size+i);
+	}
+
+	__simplePNG__adler32_partial(ctx->img_with_filter + first_row*(row_size+1), (end_row-first_row)*(row_size+1), 
+		&ctx->adler_a[job], &ctx->adler_b[job]);
+}
+
+typedef struct
+{
+	uint8_t const * data;
+	size_t size;
+	int level;
+	__simplePNG_bit_writer * segments;
+} __simplePNG_deflate_context;
+
+//segments are compressed separately but may refer back into the segment before
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__deflate_segment(size_t job, void *context)
+{
+	__simplePNG_deflate_context* ctx = (__simplePNG_deflate_context*)context;
+	size_t start = job*__SIMPLE_PNG_SEGMENT_SIZE;
+	size_t end = start + __SIMPLE_PNG_SEGMENT_SIZE;
+	if(end > ctx->size)
+		end = ctx->size;
+	size_t dict_start = start > __SIMPLE_PNG_WINDOW_SIZE ? start - __SIMPLE_PNG_WINDOW_SIZE : 0;
+	int is_final = end == ctx->size;
+
+	__simplePNG__deflate_aligned(&ctx->segments[job], ctx->data, dict_start, start, end, ctx->level, is_final);
+}
+
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__zlib_header(int level, uint8_t header[2])
+{
+	//zlib header: http://www.rfc-editor.org/rfc/rfc1950.txt
+	//window & compression: 0x78, a 32k window for deflate
+	//flags: compression level, no dict 0, check bits making cmf & flg a multiple of 31
+	uint8_t zlib_compression = 0x08; //8 = deflate
+	uint8_t zlib_window = 0x07; //7 = 32k window
+	uint8_t zlib_cmf = zlib_window << 4 | zlib_compression;
+	uint8_t zlib_dict = 0x00; //no dict
+	uint8_t zlib_flevel = (level == 0 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+	uint8_t zlib_fcheck = 31 - ((zlib_cmf << 8 | zlib_dict | zlib_flevel) % 31);
+	if(zlib_fcheck == 31)
+		zlib_fcheck = 0;
+	uint8_t zlib_flg = zlib_dict | zlib_flevel | zlib_fcheck;
+
+	header[0] = zlib_cmf;
+	header[1] = zlib_flg;
 }
 
+typedef struct
+{
+	uint8_t const * chunk_type;
+	uint8_t const * data;
+	size_t size;
+	uint32_t * crcs;
+} __simplePNG_crc_context;
+
 __SIMPLE_PNG_REQUIRE_STATIC
-void __simplePNG_write_IDAT(FILE * f, uint32_t width, uint32_t height, uint8_t const * rgb_image)
+void __simplePNG__idat_crc(size_t job, void *context)
+{
+	__simplePNG_crc_context* ctx = (__simplePNG_crc_context*)context;
+	size_t offset = job*__SIMPLE_PNG_IDAT_CHUNK_SIZE;
+	size_t length = ctx->size - offset;
+	if(length > __SIMPLE_PNG_IDAT_CHUNK_SIZE)
+		length = __SIMPLE_PNG_IDAT_CHUNK_SIZE;
+
+	ctx->crcs[job] = __simplePNG__chunk_crc(ctx->chunk_type, ctx->data + offset, length);
+}
+
+//returns -1 if any of the idat chunks could not be written
+__SIMPLE_PNG_REQUIRE_STATIC
+int __simplePNG_write_IDAT(FILE * f, uint32_t width, uint32_t height, uint8_t const * rgb_image, int level, 
+	simplePNG_executor executor, void * executor_data)
 {
 	uint8_t chunk_type[__SIMPLE_PNG_CHUNK_NAME_SIZE];
 	uint32_t* u32_ptr;
 	
 	size_t img_size = width*height*__SIMPLE_PNG_NUM_CHANNELS;
 	size_t img_size_with_filter = img_size + height; //one filter byte per scanline
+	
+	if(level < 0)
+		level = 0;
+	if(level > 9)
+		level = 9;
+
+	//filter the scanlines and sum them up in blocks of rows
+	size_t num_filter_jobs = (height + __SIMPLE_PNG_ROWS_PER_JOB - 1) / __SIMPLE_PNG_ROWS_PER_JOB;
+
+	__simplePNG_filter_context filter_ctx;
+	filter_ctx.width = width;
+	filter_ctx.height = height;
+	filter_ctx.rgb_image = rgb_image;
+	filter_ctx.level = level;
+	filter_ctx.img_with_filter = (uint8_t*)malloc(img_size_with_filter);
+	filter_ctx.adler_a = (uint32_t*)malloc(num_filter_jobs*sizeof(uint32_t));
+	filter_ctx.adler_b = (uint32_t*)malloc(num_filter_jobs*sizeof(uint32_t));
+
+	executor(num_filter_jobs, __simplePNG__filter_rows, &filter_ctx, executor_data);
+
+	uint8_t* img_with_filter = filter_ctx.img_with_filter;
+
+	//compress the filtered image in segments
+	size_t num_segments = (img_size_with_filter + __SIMPLE_PNG_SEGMENT_SIZE - 1) / __SIMPLE_PNG_SEGMENT_SIZE;
+
+	__simplePNG_deflate_context deflate_ctx;
+	deflate_ctx.data = img_with_filter;
+	deflate_ctx.size = img_size_with_filter;
+	deflate_ctx.level = level;
+	deflate_ctx.segments = (__simplePNG_bit_writer*)calloc(num_segments, sizeof(__simplePNG_bit_writer));
+
+	executor(num_segments, __simplePNG__deflate_segment, &deflate_ctx, executor_data);
+
 	size_t zlib_meta_size = sizeof(uint8_t)*2 + sizeof(uint32_t); //2 bytes: cmf and flg, 1 adler32 sum
-	size_t num_deflate_blocks = __simplePNG__deflate_block_count(img_size_with_filter);
-	size_t deflate_meta_per_block = (sizeof(uint8_t)+sizeof(uint16_t)*2); //1 header byte, 2 16bit lengths
-	size_t deflate_size = img_size_with_filter + deflate_meta_per_block*num_deflate_blocks;
+	size_t deflate_size = 0;
+	for(size_t i=0; i<num_segments; i++)
+		deflate_size += deflate_ctx.segments[i].size;
 	size_t idat_size = zlib_meta_size + deflate_size;
 	
-	//insert the scanline filter code
-	uint8_t* img_with_filter = (uint8_t*)malloc(img_size_with_filter);
-	for(size_t i=0; i<height; i++)
-	{
-		size_t scanline_offset = i*width*__SIMPLE_PNG_NUM_CHANNELS+i;
-		img_with_filter[scanline_offset] = 0x00; //no filter
-		memcpy(img_with_filter + scanline_offset + 1, rgb_image+(i*width*__SIMPLE_PNG_NUM_CHANNELS), width*__SIMPLE_PNG_NUM_CHANNELS);
-	}
-	
 	uint8_t* idat_chunk = (uint8_t*)malloc(idat_size);
 	
 	chunk_type[0] = 'I';
@@ -307,35 +1080,64 @@ void __simplePNG_write_IDAT(FILE * f, uint32_t width, uint32_t height, uint8_t c
 	chunk_type[2] = 'A';
 	chunk_type[3] = 'T';
 	
-	//zlib header: http://www.rfc-editor.org/rfc/rfc1950.txt
-	//window & compression: 0x08
-	//flags: compression none 00, no dict 0, multiple of 31 11101 (1d)
-	uint8_t zlib_compression = 0x08; //8 = deflate
-	uint8_t zlib_window = 0x00; //0 = smallest window
-	uint8_t zlib_cmf = zlib_window << 4 | zlib_compression;
-	uint8_t zlib_dict = 0x00; //no dict
-	uint8_t zlib_flevel = 0x00; //least amount of compression
-	uint8_t zlib_fcheck = 0x1d; //to make cmf & flg bytes multiple of 31
-	uint8_t zlib_flg = zlib_dict | zlib_flevel | zlib_fcheck;
-	
-	idat_chunk[0] = zlib_cmf;
-	idat_chunk[1] = zlib_flg;
+	__simplePNG__zlib_header(level, idat_chunk);
 	size_t idat_offset = 2;
 	
-	size_t deflate_bytes = __simplePNG__store_deflate_blocks(idat_chunk+idat_offset, img_with_filter, img_size_with_filter);
+	for(size_t i=0; i<num_segments; i++)
+	{
+		memcpy(idat_chunk + idat_offset, deflate_ctx.segments[i].data, deflate_ctx.segments[i].size);
+		idat_offset += deflate_ctx.segments[i].size;
+		free(deflate_ctx.segments[i].data);
+	}
 	
-	//zlib adler32
-	uint32_t zlib_adler = __simplePNG__adler32(img_with_filter, img_size_with_filter);
-	u32_ptr = (uint32_t*) (idat_chunk + idat_offset + deflate_size);
+	//zlib adler32, combined from the sums of the row blocks
+	uint32_t adler_a = 1;
+	uint32_t adler_b = 0;
+	for(size_t i=0; i<num_filter_jobs; i++)
+	{
+		size_t rows = (i+1 == num_filter_jobs) ? height - i*__SIMPLE_PNG_ROWS_PER_JOB : __SIMPLE_PNG_ROWS_PER_JOB;
+		__simplePNG__adler32_append(&adler_a, &adler_b, filter_ctx.adler_a[i], filter_ctx.adler_b[i], 
+			rows*(width*__SIMPLE_PNG_NUM_CHANNELS+1));
+	}
+	uint32_t zlib_adler = __simplePNG__adler32_pack(adler_a, adler_b);
+	u32_ptr = (uint32_t*) (idat_chunk + idat_offset);
 	u32_ptr[0] = zlib_adler;
 	
-	__simplePNG__write_chunk(f, chunk_type, idat_chunk, idat_size);
+	//the zlib stream may be spread over any number of consecutive idat chunks
+	size_t num_idat_chunks = (idat_size + __SIMPLE_PNG_IDAT_CHUNK_SIZE - 1) / __SIMPLE_PNG_IDAT_CHUNK_SIZE;
+
+	__simplePNG_crc_context crc_ctx;
+	crc_ctx.chunk_type = chunk_type;
+	crc_ctx.data = idat_chunk;
+	crc_ctx.size = idat_size;
+	crc_ctx.crcs = (uint32_t*)malloc(num_idat_chunks*sizeof(uint32_t));
+
+	executor(num_idat_chunks, __simplePNG__idat_crc, &crc_ctx, executor_data);
+
+	int result = 0;
+
+	for(size_t i=0; i<num_idat_chunks && result == 0; i++)
+	{
+		size_t offset = i*__SIMPLE_PNG_IDAT_CHUNK_SIZE;
+		size_t length = idat_size - offset;
+		if(length > __SIMPLE_PNG_IDAT_CHUNK_SIZE)
+			length = __SIMPLE_PNG_IDAT_CHUNK_SIZE;
+
+		result = __simplePNG__write_chunk_with_crc(f, chunk_type, idat_chunk + offset, length, crc_ctx.crcs[i]);
+	}
+
 	free(img_with_filter);
 	free(idat_chunk);
+	free(filter_ctx.adler_a);
+	free(filter_ctx.adler_b);
+	free(deflate_ctx.segments);
+	free(crc_ctx.crcs);
+
+	return result;
 }
 
 __SIMPLE_PNG_REQUIRE_STATIC
-void __simplePNG_write_IEND(FILE * f)
+int __simplePNG_write_IEND(FILE * f)
 {
 	uint8_t chunk_type[__SIMPLE_PNG_CHUNK_NAME_SIZE];
 	//uint8_t iend_chunk[__SIMPLE_PNG_IEND_SIZE];
@@ -345,31 +1147,175 @@ void __simplePNG_write_IEND(FILE * f)
 	chunk_type[2] = 'N';
 	chunk_type[3] = 'D';
 	
-	__simplePNG__write_chunk(f, chunk_type, NULL, __SIMPLE_PNG_IEND_SIZE);
+	return __simplePNG__write_chunk(f, chunk_type, NULL, __SIMPLE_PNG_IEND_SIZE);
 }
 
+//Writes an rgb image compressed at level 0 (stored) to 9 (smallest), with the
+//encoding split into jobs that are handed to executor. Fails with -1 if the file
+//can't be opened or written, leaving whatever was written of it.
 __SIMPLE_PNG_REQUIRE_STATIC
-int simplePNG_write(char const * filename, uint32_t width, uint32_t height, uint8_t const * rgb_image)
+int simplePNG_write_parallel(char const * filename, uint32_t width, uint32_t height, uint8_t const * rgb_image, 
+	int level, simplePNG_executor executor, void * executor_data)
 {
 	//png spec: http://www.libpng.org/pub/png/spec/1.2/
-	FILE* f = __simplePNG__sfopen(filename, "wb");
+	FILE* f = fopen(filename, "wb");
+	if(f == NULL)
+		return -1;
 
 	//header
 	uint8_t png_header[__SIMPLE_PNG_HEADER_SIZE] = {0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a};
-	fwrite(png_header, 1, __SIMPLE_PNG_HEADER_SIZE, f);
+	int ok = fwrite(png_header, 1, __SIMPLE_PNG_HEADER_SIZE, f) == __SIMPLE_PNG_HEADER_SIZE;
 
 	//ihdr chunk
-	__simplePNG_write_IHDR(f, width, height, rgb_image);
+	ok = ok && __simplePNG_write_IHDR(f, width, height) == 0;
 
 	//idat
-	__simplePNG_write_IDAT(f, width, height, rgb_image);
+	ok = ok && __simplePNG_write_IDAT(f, width, height, rgb_image, level, executor, executor_data) == 0;
 	
 	//iend
-	__simplePNG_write_IEND(f);
+	ok = ok && __simplePNG_write_IEND(f) == 0;
+
+	if(fclose(f) != 0)
+		ok = 0;
+
+	return ok ? 0 : -1;
+}
+
+/*************** Streaming ***************/
+//Writes a png a few rows at a time, top row first, so that neither the image nor
+//the file have to be in memory in full. Each compressed segment goes to the file
+//as soon as it is full. A stream that failed to write stays failed, the calls
+//after it only report it.
+typedef struct
+{
+	FILE * f;
+	int failed;
+	uint32_t width;
+	uint32_t height;
+	int level;
+	uint32_t rows_written;
+	uint8_t * prev_row; //the unfiltered row above the next one
+	//filtered rows, the first window_size bytes of them only kept for matches to reach back into
+	uint8_t * filtered;
+	size_t filtered_size;
+	size_t window_size;
+	uint32_t adler_a;
+	uint32_t adler_b;
+	__simplePNG_bit_writer idat; //zlib stream data not written yet
+} simplePNG_stream;
+
+//returns NULL if the file can't be opened or its header written
+__SIMPLE_PNG_REQUIRE_STATIC
+simplePNG_stream* simplePNG_stream_open(char const * filename, uint32_t width, uint32_t height, int level)
+{
+	FILE * f = fopen(filename, "wb");
+	if(f == NULL)
+		return NULL;
+
+	simplePNG_stream* s = (simplePNG_stream*)calloc(1, sizeof(simplePNG_stream));
+	size_t row_size = width*__SIMPLE_PNG_NUM_CHANNELS;
+
+	s->f = f;
+	s->width = width;
+	s->height = height;
+	s->level = level < 0 ? 0 : level > 9 ? 9 : level;
+	s->prev_row = (uint8_t*)malloc(row_size);
+	s->filtered = (uint8_t*)malloc(__SIMPLE_PNG_WINDOW_SIZE + __SIMPLE_PNG_SEGMENT_SIZE + row_size + 1);
+	s->adler_a = 1;
+	s->adler_b = 0;
+
+	uint8_t png_header[__SIMPLE_PNG_HEADER_SIZE] = {0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a};
+	if(fwrite(png_header, 1, __SIMPLE_PNG_HEADER_SIZE, s->f) != __SIMPLE_PNG_HEADER_SIZE || 
+		__simplePNG_write_IHDR(s->f, width, height) != 0)
+	{
+		fclose(s->f);
+		free(s->prev_row);
+		free(s->filtered);
+		free(s);
+		return NULL;
+	}
+
+	__simplePNG__reserve(&s->idat, 2);
+	__simplePNG__zlib_header(s->level, s->idat.data);
+	s->idat.size = 2;
+
+	return s;
+}
+
+//compresses the filtered rows so far and writes them out as an idat chunk
+__SIMPLE_PNG_REQUIRE_STATIC
+void __simplePNG__stream_flush(simplePNG_stream* s, int is_final)
+{
+	__simplePNG__deflate_aligned(&s->idat, s->filtered, 0, s->window_size, s->filtered_size, s->level, is_final);
+
+	size_t keep = s->filtered_size < __SIMPLE_PNG_WINDOW_SIZE ? s->filtered_size : __SIMPLE_PNG_WINDOW_SIZE;
+	memmove(s->filtered, s->filtered + s->filtered_size - keep, keep);
+	s->filtered_size = keep;
+	s->window_size = keep;
+
+	if(is_final)
+	{
+		uint32_t zlib_adler = __simplePNG__adler32_pack(s->adler_a, s->adler_b);
+		__simplePNG__reserve(&s->idat, sizeof(zlib_adler));
+		memcpy(s->idat.data + s->idat.size, &zlib_adler, sizeof(zlib_adler));
+		s->idat.size += sizeof(zlib_adler);
+	}
+
+	uint8_t chunk_type[__SIMPLE_PNG_CHUNK_NAME_SIZE] = {'I', 'D', 'A', 'T'};
+	if(s->idat.size > 0 && __simplePNG__write_chunk(s->f, chunk_type, s->idat.data, s->idat.size) != 0)
+		s->failed = 1;
+	s->idat.size = 0;
+}
+
+//rows continue where the last call stopped, fails with -1 once the file can't be written
+__SIMPLE_PNG_REQUIRE_STATIC
+int simplePNG_stream_write_rows(simplePNG_stream* s, uint8_t const * rgb_rows, uint32_t row_count)
+{
+	size_t row_size = s->width*__SIMPLE_PNG_NUM_CHANNELS;
+
+	for(uint32_t i=0; i<row_count && s->rows_written < s->height && !s->failed; i++)
+	{
+		uint8_t const * row = rgb_rows + i*row_size;
+		uint8_t * scanline = s->filtered + s->filtered_size;
+
+		__simplePNG__filter_scanline(s->level, row, s->rows_written > 0 ? s->prev_row : NULL, row_size, scanline);
+
+		uint32_t block_a, block_b;
+		__simplePNG__adler32_partial(scanline, row_size + 1, &block_a, &block_b);
+		__simplePNG__adler32_append(&s->adler_a, &s->adler_b, block_a, block_b, row_size + 1);
+
+		memcpy(s->prev_row, row, row_size);
+		s->filtered_size += row_size + 1;
+		s->rows_written++;
+
+		if(s->filtered_size - s->window_size >= __SIMPLE_PNG_SEGMENT_SIZE)
+			__simplePNG__stream_flush(s, 0);
+	}
+
+	return s->failed ? -1 : 0;
+}
+
+//finishes and closes the file, fails with -1 if rows are missing or the file
+//couldn't be written, leaving the file broken
+__SIMPLE_PNG_REQUIRE_STATIC
+int simplePNG_stream_close(simplePNG_stream* s)
+{
+	int complete = s->rows_written == s->height && !s->failed;
+
+	if(complete)
+	{
+		__simplePNG__stream_flush(s, 1);
+		complete = !s->failed && __simplePNG_write_IEND(s->f) == 0;
+	}
 
-	fclose(f);
+	if(fclose(s->f) != 0)
+		complete = 0;
+	free(s->prev_row);
+	free(s->filtered);
+	free(s->idat.data);
+	free(s);
 
-	return 0;
+	return complete ? 0 : -1;
 }
 
 #endif
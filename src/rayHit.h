@@ -3,15 +3,18 @@
 
 #include "libs/Matrix.h"
 
-#include <string>
+#include <xmmintrin.h>
+
+// materialID of a hit that has no material (e.g. leaf bounding boxes), shaded by its normal
+#define NO_MATERIAL_ID -1
 
 struct rayHit
 {
     float intersectionTime;
     Vec3 intersectionPoint;
     Vec3 surfaceNormal;
-    std::string materialID;
-    //Material
+    // index into the scene's material table, see Scene::getMaterial
+    int materialID;
 };
 
 struct hitBundle
@@ -22,6 +25,12 @@ struct hitBundle
     {
         return records[index];
     }
+
+    __m128 intersectionTimes() const
+    {
+        return _mm_setr_ps(records[0].intersectionTime, records[1].intersectionTime,
+            records[2].intersectionTime, records[3].intersectionTime);
+    }
 };
 
 #endif